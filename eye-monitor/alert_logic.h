@@ -0,0 +1,209 @@
+/**
+ * @file alert_logic.h
+ * @brief Turns the per-frame eye detection into the LED, buzzer and eCall states.
+ */
+
+#ifndef __ALERT_LOGIC_H
+#define __ALERT_LOGIC_H
+
+// Standard library Header files
+#include <algorithm>
+
+/**
+ * @struct AlertState
+ * @brief What the outputs should show after a frame.
+ */
+
+struct AlertState {
+    bool led = false;        ///< Eyes detected LED.
+    bool buzzerOn = false;   ///< Buzzer on.
+    bool relayOn = false;    ///< eCall relay on.
+    bool playSound = false;  ///< The warning sound is due with this frame.
+    bool alarm = false;      ///< The buzzer alarm has started with this frame.
+    bool ecall = false;      ///< The eCall has been triggered with this frame.
+};
+
+/**
+ * @struct BlinkStats
+ * @brief The eyes as measured by the high-frame-rate blink mode.
+ */
+
+struct BlinkStats {
+    double time = 0;               ///< Time of the frame in seconds.
+    double closedSeconds = 0;      ///< How long the eyes have been closed, 0 while they are open.
+    unsigned long blinks = 0;      ///< Blinks in the last minute.
+    double blinksPerMinute = 0;    ///< Blink frequency over the last minute.
+    double meanBlinkSeconds = 0;   ///< Mean blink duration over the last minute.
+    double perclos = 0;            ///< Fraction of the last minute with the eyes closed.
+};
+
+/**
+ * @class AlertLogic
+ * @brief Counts the frames with the eyes shut and decides when to warn and when to call.
+ *
+ * The buzzer goes on once the eyes have not been detected for buzzerFrames
+ * frames and the eCall relay once they have not been detected for
+ * relayFrames frames. Both stay on until the eyes are detected again.
+ * With frameSeconds set and the frame time passed to update(), the
+ * thresholds are frames at that nominal interval, so the closure is
+ * measured in time: when the framerate governor lowers the framerate the
+ * alarm still goes off after the same time, not after the same frames.
+ * There's no hardware access here, so the same logic runs in the eye
+ * monitor and in the regression harness.
+ *
+ * In the blink mode the decision is made on time instead of frames, so
+ * that a normal blink of 100 to 400 ms doesn't count as closed eyes:
+ * the buzzer goes on for a microsleep, eyes closed for microsleepSeconds,
+ * or while the blinks look drowsy, that is slow, frequent or with the
+ * eyes closed for a large part of the last minute. The eCall relay goes
+ * on once the eyes have been closed for relaySeconds. The frame counter
+ * and the outputs start afresh whenever the camera switches between the
+ * modes, as 100 fps blink frames must not count towards relayFrames.
+ */
+
+class AlertLogic {
+public:
+    double microsleepSeconds = 0.5;    ///< Closure which is a microsleep rather than a blink.
+    double relaySeconds = 2.0;         ///< Closure after which the eCall relay goes on.
+    double slowBlinkSeconds = 0.3;     ///< Mean blink duration which counts as drowsy.
+    double maxBlinksPerMinute = 40;    ///< Blink frequency which counts as drowsy.
+    double maxPerclos = 0.15;          ///< Fraction of time with closed eyes which counts as drowsy.
+    unsigned long minBlinks = 3;       ///< Blinks needed before duration and frequency are judged.
+    double soundEverySeconds = 1.0;    ///< Repetition of the warning sound in the blink mode.
+    double frameSeconds = 0;           ///< Nominal frame interval of buzzerFrames and relayFrames, 0 to count frames.
+
+    /**
+     * @param buzzerFrames Frames without eyes before the buzzer goes on.
+     * @param relayFrames Frames without eyes before the eCall relay goes on.
+     */
+
+    AlertLogic(int buzzerFrames = 4, int relayFrames = 20) :
+        buzzerFrames(buzzerFrames), relayFrames(relayFrames) {}
+
+    /**
+     * @brief Advances the logic by one frame.
+     *
+     * @param eyesDetected True if open eyes were detected in the frame.
+     * @param time Time of the frame in seconds, such as its SensorTimestamp, negative if unknown.
+     * @return Returns the state of the outputs after this frame.
+     */
+
+    const AlertState &update(bool eyesDetected, double time = -1) {
+        enterMode(false);
+        state.playSound = false;
+        state.alarm = false;
+        state.ecall = false;
+        if (eyesDetected) {
+            frameEyeShut = 0;
+            state.led = true;
+            state.buzzerOn = false;
+            state.relayOn = false;
+        } else {
+            if (frameEyeShut == 0) shutSince = time;
+            frameEyeShut++;
+            state.led = false;
+        }
+        const int previous = shutLength;
+        shutLength = closure(time);
+
+        // eyes closed for a short time
+        if (shutLength >= buzzerFrames) {
+            state.buzzerOn = true;
+            state.alarm = (previous < buzzerFrames);
+            // the sound is repeated every 10 frames
+            state.playSound = state.alarm || ((shutLength / 10) != (previous / 10));
+        }
+
+        // eyes still closed even after the buzzer, call for help
+        if (shutLength >= relayFrames) {
+            state.relayOn = true;
+            state.ecall = true;
+            frameEyeShut = 0;
+            shutLength = 0;
+        }
+        return state;
+    }
+
+    /**
+     * @brief Advances the logic by one frame of the blink mode.
+     *
+     * @param blink The blink measurements after this frame.
+     * @return Returns the state of the outputs after this frame.
+     */
+
+    const AlertState &updateBlink(const BlinkStats &blink) {
+        enterMode(true);
+        state.playSound = false;
+        state.alarm = false;
+        state.ecall = false;
+        const bool closed = blink.closedSeconds > 0;
+        const bool drowsy = (blink.perclos > maxPerclos) ||
+            ((blink.blinks >= minBlinks) &&
+             ((blink.meanBlinkSeconds > slowBlinkSeconds) || (blink.blinksPerMinute > maxBlinksPerMinute)));
+        state.led = !closed;
+
+        const bool warn = (blink.closedSeconds >= microsleepSeconds) || drowsy;
+        if (warn) {
+            state.alarm = !state.buzzerOn;
+            state.playSound = state.alarm || (blink.time - lastSound >= soundEverySeconds);
+            if (state.playSound) lastSound = blink.time;
+        }
+        state.buzzerOn = warn;
+
+        // the eCall is made once per closure
+        if (blink.closedSeconds >= relaySeconds) {
+            state.ecall = !state.relayOn;
+            state.relayOn = true;
+        } else if (!closed) {
+            state.relayOn = false;
+        }
+        return state;
+    }
+
+    /**
+     * @brief Number of consecutive frames without eyes, 0 in the blink mode.
+     */
+
+    int framesShut() const {
+        return frameEyeShut;
+    }
+
+    /**
+     * @brief Back to eyes open with all outputs off.
+     */
+
+    void reset() {
+        frameEyeShut = 0;
+        shutLength = 0;
+        lastSound = 0;
+        blinkMode = false;
+        state = AlertState();
+    }
+
+private:
+    const int buzzerFrames;
+    const int relayFrames;
+    int frameEyeShut = 0;
+    int shutLength = 0;
+    double shutSince = 0;
+    double lastSound = 0;
+    bool blinkMode = false;
+    AlertState state;
+
+    // a switch between the normal and the blink mode starts with the eyes open and all outputs off
+    void enterMode(bool blink) {
+        if (blink == blinkMode) return;
+        blinkMode = blink;
+        frameEyeShut = 0;
+        shutLength = 0;
+        state = AlertState();
+    }
+
+    // length of the current closure in frames, in nominal frame intervals if the time is known
+    int closure(double time) const {
+        if ((frameEyeShut == 0) || !(frameSeconds > 0) || (time < 0) || (shutSince < 0)) return frameEyeShut;
+        return std::max(frameEyeShut, (int)((time - shutSince) / frameSeconds) + 1);
+    }
+};
+
+#endif
@@ -0,0 +1,524 @@
+/**
+ * @file blink_mode.h
+ * @brief High-frame-rate capture of a small crop around the eyes to measure blinks.
+ */
+
+#ifndef __BLINK_MODE_H
+#define __BLINK_MODE_H
+
+// Standard library Header files
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+// Header file for Camera interfacing
+#include "libcam2opencv.h"
+#include <libcamera/libcamera.h>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+#include "alert_logic.h"
+
+/**
+ * @class BlinkAnalyzer
+ * @brief Turns the per-frame open/closed decision into blink duration, frequency and PERCLOS.
+ *
+ * A blink is a closure which has ended. The statistics cover the last
+ * windowSeconds seconds.
+ */
+
+class BlinkAnalyzer {
+public:
+    double windowSeconds = 60;   ///< Time the statistics are taken over.
+
+    /**
+     * @brief Adds a frame.
+     *
+     * @param time Time of the frame in seconds.
+     * @param closed True if both eyes were closed.
+     * @return Returns the statistics after this frame.
+     */
+
+    const BlinkStats &update(double time, bool closed) {
+        if (started) {
+            const double dt = std::max(0.0, time - lastTime);
+            samples.push_back({ time, wasClosed ? dt : 0.0 });
+            closedTime += samples.back().closed;
+        } else {
+            first = time;
+            started = true;
+        }
+        if (closed && !wasClosed) closeStart = time;
+        if (!closed && wasClosed) blinks.push_back({ time, time - closeStart });
+        wasClosed = closed;
+        lastTime = time;
+
+        // forget what is older than the window
+        while (!samples.empty() && (samples.front().time < time - windowSeconds)) {
+            closedTime -= samples.front().closed;
+            samples.pop_front();
+        }
+        while (!blinks.empty() && (blinks.front().time < time - windowSeconds)) {
+            blinks.pop_front();
+        }
+
+        const double span = std::min(windowSeconds, time - first);
+        stats.time = time;
+        stats.closedSeconds = closed ? time - closeStart : 0;
+        stats.blinks = blinks.size();
+        stats.blinksPerMinute = span > 1 ? blinks.size() * 60 / span : 0;
+        double sum = 0;
+        for (const auto &b : blinks) sum += b.duration;
+        stats.meanBlinkSeconds = blinks.empty() ? 0 : sum / blinks.size();
+        stats.perclos = span > 1 ? std::max(0.0, closedTime) / span : 0;
+        return stats;
+    }
+
+    /**
+     * @brief Starts from scratch, for example after the eyes have been lost.
+     */
+
+    void reset() {
+        const double window = windowSeconds;
+        *this = BlinkAnalyzer();
+        windowSeconds = window;
+    }
+
+private:
+    struct Sample {
+        double time;
+        double closed;   // closed time since the previous sample
+    };
+    struct Blink {
+        double time;     // end of the blink
+        double duration;
+    };
+
+    std::deque<Sample> samples;
+    std::deque<Blink> blinks;
+    BlinkStats stats;
+    bool started = false;
+    bool wasClosed = false;
+    double first = 0, lastTime = 0, closeStart = 0, closedTime = 0;
+};
+
+/**
+ * @class EyeStateClassifier
+ * @brief Decides whether one eye is open by matching it with its open-eye template.
+ *
+ * The template is taken when the eye is found, which is when it is open.
+ * A closing eye no longer correlates with it. The match is only searched
+ * in a small neighbourhood of the last position, and the position is only
+ * followed while the eye is open, so a closed eye can't drag the box away.
+ */
+
+class EyeStateClassifier {
+public:
+    double closedThreshold = 0.6;   ///< Correlation below which an open eye counts as closed.
+    double openThreshold = 0.7;     ///< Correlation above which a closed eye counts as open again.
+    double searchMargin = 0.3;      ///< Search neighbourhood relative to the eye size.
+
+    /**
+     * @brief Takes the open-eye template.
+     */
+
+    void init(const cv::Mat &gray, const cv::Rect &eye) {
+        box = eye;
+        templ = gray(eye).clone();
+        closed = false;
+    }
+
+    /**
+     * @brief Classifies the eye in a new frame.
+     *
+     * @return Returns true if the eye is closed.
+     */
+
+    bool update(const cv::Mat &gray) {
+        const cv::Rect image(0, 0, gray.cols, gray.rows);
+        const int mx = std::max(2, cvRound(box.width * searchMargin));
+        const int my = std::max(2, cvRound(box.height * searchMargin));
+        const cv::Rect search = cv::Rect(box.x - mx, box.y - my, box.width + 2 * mx, box.height + 2 * my) & image;
+        if ((search.width < box.width) || (search.height < box.height)) {
+            closed = true;
+            return closed;
+        }
+        cv::matchTemplate(gray(search), templ, score, cv::TM_CCOEFF_NORMED);
+        double maxVal;
+        cv::Point maxLoc;
+        cv::minMaxLoc(score, nullptr, &maxVal, nullptr, &maxLoc);
+        closed = maxVal < (closed ? openThreshold : closedThreshold);
+        if (!closed) {
+            box = cv::Rect(search.x + maxLoc.x, search.y + maxLoc.y, box.width, box.height);
+        }
+        return closed;
+    }
+
+    /**
+     * @brief True if the eye has reached the border of the crop.
+     */
+
+    bool atBorder(const cv::Size &size) const {
+        return (box.x <= 0) || (box.y <= 0) || (box.x + box.width >= size.width) || (box.y + box.height >= size.height);
+    }
+
+private:
+    cv::Rect box;
+    cv::Mat templ;
+    cv::Mat score;
+    bool closed = false;
+};
+
+/**
+ * @class BlinkCapture
+ * @brief Switches the camera between the normal mode and a fast mode on a crop around the eyes.
+ *
+ * In the normal mode the face and eye cascades run on the whole frame.
+ * Once both eyes have been found in stableFrames frames in a row, the
+ * band around them is mapped through ScalerCrop into sensor coordinates
+ * and the camera is reconfigured to a small frame of just that band at
+ * fps frames per second. The sensor is asked for its smallest mode which
+ * still covers the whole pixel array, usually the 2x2 binned one, so the
+ * crop stays inside its field of view. If the FrameDuration of the blink
+ * frames shows that the camera doesn't reach 80% of fps, the normal mode
+ * returns. In the blink mode each eye is found
+ * once with the eye cascade and then classified per frame by an
+ * EyeStateClassifier, which is a lot cheaper than the cascades, so the
+ * CPU load stays about that of the normal mode.
+ *
+ * The camera goes back to the normal mode when the head moves, that is
+ * the crop no longer looks like the one taken when the eyes were found,
+ * when an eye leaves the crop, and every revalidateSeconds to let the
+ * cascades confirm the face, but never while the eyes are closed.
+ *
+ * After a failed attempt, the eyes not found in the crop, a framerate
+ * too low or a failed reconfiguration, the blink mode isn't tried again
+ * for backoffFrames normal frames, twice that after the next failure and
+ * so on up to maxBackoffFrames, so that glasses or an unsuitable sensor
+ * don't keep the camera restarting.
+ *
+ * The switching runs on a thread of its own, as the camera must not be
+ * reconfigured from its callback.
+ */
+
+class BlinkCapture {
+public:
+    cv::Size size = cv::Size(320, 160);   ///< Frame size of the blink mode, its aspect is that of the crop.
+    unsigned int fps = 100;               ///< Framerate of the blink mode.
+    int stableFrames = 10;                ///< Normal frames with both eyes before the blink mode starts.
+    double revalidateSeconds = 20;        ///< Blink mode time after which the cascades check the face again.
+    double cropWidth = 1.6;               ///< Width of the crop relative to the span of both eyes.
+    int acquireFrames = 10;               ///< Blink frames to find the eyes in before giving up.
+    double sceneThreshold = 0.5;          ///< Correlation with the reference crop below which the head has moved.
+    int lostFrames = 20;                  ///< Frames with the head moved before the normal mode returns.
+    double minFpsRatio = 0.8;             ///< Fraction of fps the blink frames must reach.
+    int backoffFrames = 150;              ///< Normal frames after a failed blink mode before the next attempt.
+    int maxBackoffFrames = 2400;          ///< Longest wait after repeated failures.
+
+    /**
+     * @param camera The camera to switch.
+     * @param normal The settings of the normal mode.
+     */
+
+    BlinkCapture(Libcam2OpenCV &camera, const Libcam2OpenCVSettings &normal) :
+        camera(camera), normalSettings(normal) {
+        eyeCascade.load("haarcascade_eye.xml");
+        switcher = std::thread(&BlinkCapture::run, this);
+    }
+
+    ~BlinkCapture() {
+        stop();
+    }
+
+    /**
+     * @brief Stops the switching thread, after a reconfiguration in progress has finished.
+     *
+     * Frames may still arrive afterwards, so the camera must be stopped
+     * before the BlinkCapture is destroyed.
+     */
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            quit = true;
+        }
+        jobCond.notify_all();
+        if (switcher.joinable()) switcher.join();
+    }
+
+    /**
+     * @brief True while the camera is in, or on its way into, the blink mode.
+     */
+
+    bool active() const {
+        return (mode == ToBlink) || (mode == Blink);
+    }
+
+    /**
+     * @brief True if the frame comes from the blink mode.
+     */
+
+    bool isBlinkFrame(unsigned int width, unsigned int height) const {
+        return active() && (cv::Size(width, height) != normalSize);
+    }
+
+    /**
+     * @brief True if the frame is a late one of the blink mode which has just been left.
+     */
+
+    bool isStale(unsigned int width, unsigned int height) const {
+        return (mode == ToNormal) && (cv::Size(width, height) != normalSize);
+    }
+
+    /**
+     * @brief Looks at a frame of the normal mode and starts the blink mode when the eyes are stable.
+     *
+     * @param gray The grey frame.
+     * @param eyes The eyes found in it, in the coordinates of the frame.
+     * @param metadata The request metadata, for ScalerCrop.
+     */
+
+    void normalFrame(const cv::Mat &gray, const std::vector<cv::Rect> &eyes, const libcamera::ControlList &metadata) {
+        normalSize = gray.size();
+        if (mode != Normal) return;
+        if (switchFailed.exchange(false)) backOff("Can't switch to the blink mode");
+        if (cooldown > 0) {
+            cooldown--;
+            return;
+        }
+        stable = (eyes.size() == 2) ? stable + 1 : 0;
+        if (stable < stableFrames) return;
+        const auto crop = metadata.get(libcamera::controls::ScalerCrop);
+        if (!crop) return;
+
+        // the band around both eyes with the aspect of the blink frames
+        const cv::Rect span = eyes[0] | eyes[1];
+        int w = cvRound(span.width * cropWidth);
+        int h = w * size.height / size.width;
+        if (h < span.height * 2) {
+            h = span.height * 2;
+            w = h * size.width / size.height;
+        }
+        if ((w > gray.cols) || (h > gray.rows)) return;
+        const int x = std::min(std::max(0, span.x + span.width / 2 - w / 2), gray.cols - w);
+        const int y = std::min(std::max(0, span.y + span.height / 2 - h / 2), gray.rows - h);
+
+        // frame coordinates to the sensor coordinates of the current crop
+        const double sx = (double)crop->width / gray.cols;
+        const double sy = (double)crop->height / gray.rows;
+        Libcam2OpenCVSettings blink;
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            blink = normalSettings;
+        }
+        blink.width = size.width;
+        blink.height = size.height;
+        blink.framerate = fps;
+        blink.sensorMode = binnedMode();
+        blink.scalerCrop = libcamera::Rectangle(crop->x + (int)(x * sx), crop->y + (int)(y * sy),
+                                                (unsigned int)(w * sx), (unsigned int)(h * sy));
+        stable = 0;
+        request(ToBlink, blink);
+    }
+
+    /**
+     * @brief Measures the eyes in a frame of the blink mode.
+     *
+     * @param gray The grey frame of the crop.
+     * @param metadata The request metadata, for the SensorTimestamp.
+     * @param blink Receives the blink measurements.
+     * @return Returns false while the eyes haven't been found in the crop yet.
+     */
+
+    bool blinkFrame(const cv::Mat &gray, const libcamera::ControlList &metadata, BlinkStats &blink) {
+        const auto ts = metadata.get(libcamera::controls::SensorTimestamp);
+        const double time = ts ? *ts / 1e9 :
+            std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+        // the sensor mode may not be as fast as asked for
+        const auto duration = metadata.get(libcamera::controls::FrameDuration);
+        slow = (duration && (*duration * fps * minFpsRatio > 1e6)) ? slow + 1 : 0;
+        if (slow >= acquireFrames) {
+            backOff("The blink mode only reaches " + std::to_string(1e6 / *duration) + " fps");
+            request(ToNormal, Libcam2OpenCVSettings());
+            return false;
+        }
+
+        if (!acquired) {
+            if (acquire(gray)) {
+                acquired = true;
+                enteredAt = time;
+                moved = 0;
+                backoff = 0;
+                analyzer.reset();
+            } else if (++acquireTries >= acquireFrames) {
+                backOff("Eyes not found in the blink crop");
+                request(ToNormal, Libcam2OpenCVSettings());
+            }
+            return false;
+        }
+
+        const bool leftClosed = eyes[0].update(gray);
+        const bool rightClosed = eyes[1].update(gray);
+        blink = analyzer.update(time, leftClosed && rightClosed);
+
+        // the head has moved when the whole crop no longer looks like it did
+        cv::Mat small, score;
+        cv::resize(gray, small, reference.size(), 0, 0, cv::INTER_AREA);
+        cv::matchTemplate(small, reference, score, cv::TM_CCOEFF_NORMED);
+        moved = (score.at<float>(0, 0) < sceneThreshold) ? moved + 1 : 0;
+
+        const bool open = blink.closedSeconds == 0;
+        const bool leaving = (moved >= lostFrames) ||
+            (open && (eyes[0].atBorder(gray.size()) || eyes[1].atBorder(gray.size()))) ||
+            (open && (time - enteredAt > revalidateSeconds));
+        if (leaving) request(ToNormal, Libcam2OpenCVSettings());
+        return true;
+    }
+
+    /**
+     * @brief Applies new normal settings, leaving the blink mode if the camera is in it.
+     *
+     * @return Returns 0 or the negative errno of the reconfiguration.
+     */
+
+    int reconfigure(const Libcam2OpenCVSettings &settings) {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            normalSettings = settings;
+            pending = false;
+        }
+        std::lock_guard<std::mutex> lock(switchMutex);
+        stable = 0;
+        const int ret = camera.reconfigure(settings);
+        mode = Normal;
+        return ret;
+    }
+
+private:
+    enum Mode { Normal, ToBlink, Blink, ToNormal };
+
+    Libcam2OpenCV &camera;
+    cv::CascadeClassifier eyeCascade;
+    EyeStateClassifier eyes[2];
+    BlinkAnalyzer analyzer;
+    cv::Mat reference;
+    cv::Size normalSize;
+    std::atomic<int> mode{Normal};
+    int stable = 0;
+    bool acquired = false;
+    int acquireTries = 0;
+    int moved = 0;
+    int slow = 0;
+    double enteredAt = 0;
+    int backoff = 0;       // current wait after a failure, 0 after a success
+    int cooldown = 0;      // normal frames left to wait
+    std::atomic<bool> switchFailed{false};
+
+    // the switching thread
+    std::thread switcher;
+    std::mutex jobMutex;
+    std::condition_variable jobCond;
+    bool quit = false;
+    bool pending = false;
+    bool pendingBlink = false;
+    Libcam2OpenCVSettings normalSettings;
+    Libcam2OpenCVSettings pendingSettings;
+    std::mutex switchMutex;   // one reconfiguration at a time
+
+    void request(Mode target, const Libcam2OpenCVSettings &blink) {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            if (target == ToBlink) {
+                pendingSettings = blink;
+                acquired = false;
+                acquireTries = 0;
+                slow = 0;
+            } else {
+                pendingSettings = normalSettings;
+            }
+            pendingBlink = (target == ToBlink);
+            pending = true;
+            mode = target;
+        }
+        jobCond.notify_all();
+    }
+
+    // waits before the next attempt, longer after each failure in a row
+    void backOff(const std::string &reason) {
+        backoff = (backoff > 0) ? std::min(2 * backoff, maxBackoffFrames) : backoffFrames;
+        cooldown = backoff;
+        stable = 0;
+        std::cerr << reason << ", next blink mode in " << backoff << " frames" << std::endl;
+    }
+
+    // the smallest sensor mode with at least half the size of the largest, a binned one of the whole pixel array
+    libcamera::Size binnedMode() {
+        const std::vector<libcamera::Size> modes = camera.sensorModes();
+        if (modes.empty()) return libcamera::Size();
+        const libcamera::Size &full = modes.back();
+        for (const auto &m : modes) {
+            if ((m.width * 2 >= full.width) && (m.height * 2 >= full.height)) return m;
+        }
+        return libcamera::Size();
+    }
+
+    // each eye in its half of the crop, with a reference of the whole crop for head movement
+    bool acquire(const cv::Mat &gray) {
+        if (eyeCascade.empty()) return false;
+        const int half = gray.cols / 2;
+        const cv::Rect halves[2] = { cv::Rect(0, 0, half, gray.rows), cv::Rect(half, 0, gray.cols - half, gray.rows) };
+        cv::Rect found[2];
+        for (int i = 0; i < 2; i++) {
+            std::vector<cv::Rect> candidates;
+            eyeCascade.detectMultiScale(gray(halves[i]), candidates, 1.1, 3, 0, cv::Size(gray.rows / 4, gray.rows / 4));
+            if (candidates.empty()) return false;
+            found[i] = candidates[0];
+            for (const auto &c : candidates) {
+                if (c.area() > found[i].area()) found[i] = c;
+            }
+            found[i] += halves[i].tl();
+        }
+        for (int i = 0; i < 2; i++) eyes[i].init(gray, found[i]);
+        cv::resize(gray, reference, cv::Size(40, 40 * gray.rows / gray.cols), 0, 0, cv::INTER_AREA);
+        return true;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(jobMutex);
+        for (;;) {
+            jobCond.wait(lock, [this]() { return quit || pending; });
+            if (quit) return;
+            pending = false;
+            const Libcam2OpenCVSettings settings = pendingSettings;
+            const Libcam2OpenCVSettings normal = normalSettings;
+            const bool toBlink = pendingBlink;
+            lock.unlock();
+            bool inBlink = toBlink;
+            {
+                std::lock_guard<std::mutex> guard(switchMutex);
+                int ret = camera.reconfigure(settings);
+                if ((ret < 0) && toBlink) {
+                    std::cerr << "Can't switch to the blink mode: " << strerror(-ret) << std::endl;
+                    inBlink = false;
+                    switchFailed = true;
+                    ret = camera.reconfigure(normal);
+                }
+                if (ret < 0) std::cerr << "Reconfiguration failed: " << strerror(-ret) << std::endl;
+            }
+            lock.lock();
+            // a newer request decides the mode once it's done
+            if (!pending) mode = inBlink ? Blink : Normal;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ * @file calibration.h
+ * @brief Sweeps capture and detector parameters and picks the Pareto-optimal set.
+ */
+
+#ifndef __CALIBRATION_H
+#define __CALIBRATION_H
+
+// Standard library Header files
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Header file for Camera interfacing
+#include "libcam2opencv.h"
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+#include "eye_detection.h"
+#include "monitor_config.h"
+
+/**
+ * @struct CalibrationResult
+ * @brief Measurements of one combination of the calibration grid.
+ */
+
+struct CalibrationResult {
+    MonitorConfig config;       ///< The combination that was measured.
+    double latencyMs = 0;       ///< Mean detection time per frame in milliseconds.
+    double faceHitRate = 0;     ///< Fraction of frames with at least one face.
+    double eyeHitRate = 0;      ///< Fraction of frames with eyes detected.
+
+    /**
+     * @brief Checks if this result is at least as good as another one in every
+     * objective and strictly better in one of them.
+     */
+
+    bool dominates(const CalibrationResult &other) const {
+        bool noWorse = latencyMs <= other.latencyMs &&
+                       faceHitRate >= other.faceHitRate &&
+                       eyeHitRate >= other.eyeHitRate;
+        bool better = latencyMs < other.latencyMs ||
+                      faceHitRate > other.faceHitRate ||
+                      eyeHitRate > other.eyeHitRate;
+        return noWorse && better;
+    }
+};
+
+/**
+ * @class Calibrator
+ * @brief Replays a set of frames through a grid of resolutions and cascade parameters.
+ *
+ * The frames come either from a recorded clip or from the live camera. Every
+ * frame is resized to the candidate capture resolution, so one recording
+ * covers all resolutions of the grid. For each combination the mean latency
+ * and the face and eye hit rates are measured; the Pareto front of these
+ * three objectives is kept and the fastest configuration which is close to
+ * the best hit rates is chosen.
+ */
+
+class Calibrator {
+public:
+    std::vector<unsigned int> widths = { 320, 480, 640, 800, 1280 };  ///< Capture widths to try.
+    std::vector<double> downscales = { 1.0, 0.75, 0.5 };              ///< Downscale factors to try.
+    std::vector<double> scaleFactors = { 1.05, 1.1, 1.2, 1.3 };       ///< Cascade scale steps to try.
+    std::vector<int> minNeighbors = { 2, 3, 5 };                      ///< Cascade neighbour counts to try.
+
+    unsigned int maxFrames = 100;    ///< Number of frames used for the sweep.
+    unsigned int framerate = 30;     ///< Nominal capture framerate.
+    double hitRateTolerance = 0.05;  ///< Accepted loss of hit rate in exchange for speed.
+
+    /**
+     * @brief Reads the calibration frames from a recorded clip.
+     *
+     * @param path Path of a video file readable by OpenCV.
+     * @return Returns true if at least one frame was read.
+     */
+
+    bool loadClip(const std::string &path) {
+        cv::VideoCapture clip(path);
+        if (!clip.isOpened()) {
+            std::cerr << "Cannot open calibration clip " << path << std::endl;
+            return false;
+        }
+        cv::Mat f;
+        while (frames.size() < maxFrames && clip.read(f)) {
+            frames.push_back(f.clone());
+        }
+        return !frames.empty();
+    }
+
+    /**
+     * @brief Records the calibration frames from the live camera.
+     *
+     * The camera is started at its default resolution and stopped
+     * again once maxFrames frames have been collected.
+     *
+     * @param camera The camera to record from.
+     * @return Returns true if at least one frame was recorded, false
+     *         also if the camera can't be started.
+     */
+
+    bool recordLive(Libcam2OpenCV &camera) {
+        struct Recorder : Libcam2OpenCV::Callback {
+            Calibrator *calibrator;
+            std::mutex m;
+            std::condition_variable done;
+            virtual void hasFrame(const cv::Mat &frame, const libcamera::ControlList &metadata) {
+                std::lock_guard<std::mutex> lock(m);
+                if (calibrator->frames.size() < calibrator->maxFrames) {
+                    calibrator->frames.push_back(frame.clone());
+                }
+                done.notify_one();
+            }
+        } recorder;
+        recorder.calibrator = this;
+
+        camera.registerCallback(&recorder);
+        Libcam2OpenCVSettings settings;
+        settings.framerate = framerate;
+        int ret = camera.start(settings);
+        if (ret < 0) {
+            std::cerr << "Can't start the camera: " << strerror(-ret) << std::endl;
+            camera.stop();
+            camera.registerCallback(nullptr);
+            return false;
+        }
+        {
+            std::unique_lock<std::mutex> lock(recorder.m);
+            recorder.done.wait_for(lock, std::chrono::seconds(30), [this]{ return frames.size() >= maxFrames; });
+        }
+        camera.stop();
+        camera.registerCallback(nullptr);
+        return !frames.empty();
+    }
+
+    /**
+     * @brief Runs the sweep over the whole grid.
+     *
+     * @return Returns the Pareto front of all measured combinations.
+     */
+
+    std::vector<CalibrationResult> sweep() {
+        std::vector<CalibrationResult> results;
+        if (frames.empty()) return results;
+
+        const cv::Size source = frames[0].size();
+        for (unsigned int w : widths) {
+            if (w > (unsigned int)source.width) continue;
+            // keep the aspect ratio of the source, with an even height
+            unsigned int h = (unsigned int)std::lround((double)w * source.height / source.width) & ~1u;
+            std::vector<cv::Mat> scaled(frames.size());
+            for (size_t i = 0; i < frames.size(); i++) {
+                cv::resize(frames[i], scaled[i], cv::Size(w, h), 0, 0, cv::INTER_AREA);
+            }
+            for (double d : downscales) {
+                for (double sf : scaleFactors) {
+                    for (int mn : minNeighbors) {
+                        CalibrationResult r;
+                        r.config.width = w;
+                        r.config.height = h;
+                        r.config.framerate = framerate;
+                        r.config.detection.downscale = d;
+                        r.config.detection.faceScaleFactor = sf;
+                        r.config.detection.faceMinNeighbors = mn;
+                        r.config.detection.eyeScaleFactor = sf;
+                        r.config.detection.eyeMinNeighbors = mn;
+                        measure(r, scaled);
+                        std::cout << w << "x" << h << " downscale=" << d << " scaleFactor=" << sf
+                                  << " minNeighbors=" << mn << ": " << r.latencyMs << " ms, face "
+                                  << r.faceHitRate << ", eyes " << r.eyeHitRate << std::endl;
+                        results.push_back(r);
+                    }
+                }
+            }
+        }
+        return paretoFront(results);
+    }
+
+    /**
+     * @brief Picks the configuration to use from the Pareto front.
+     *
+     * The fastest configuration whose hit rates are within hitRateTolerance of
+     * the best ones on the front is chosen. The framerate is lowered if the
+     * detection cannot keep up with the nominal one.
+     *
+     * @param front The Pareto front returned by sweep().
+     * @return Returns the chosen result.
+     */
+
+    CalibrationResult choose(const std::vector<CalibrationResult> &front) const {
+        double bestFace = 0, bestEye = 0;
+        for (const auto &r : front) {
+            bestFace = std::max(bestFace, r.faceHitRate);
+            bestEye = std::max(bestEye, r.eyeHitRate);
+        }
+        const CalibrationResult *chosen = nullptr;
+        for (const auto &r : front) {
+            if (r.faceHitRate < bestFace - hitRateTolerance) continue;
+            if (r.eyeHitRate < bestEye - hitRateTolerance) continue;
+            if (!chosen || r.latencyMs < chosen->latencyMs) chosen = &r;
+        }
+        CalibrationResult result = chosen ? *chosen : CalibrationResult();
+        if (result.latencyMs > 0) {
+            unsigned int sustainable = (unsigned int)(1000.0 / result.latencyMs);
+            result.config.framerate = std::max(1u, std::min(framerate, sustainable));
+        }
+        return result;
+    }
+
+    /**
+     * @brief Writes the chosen configuration and the Pareto front to a file.
+     *
+     * @param path Path of the YAML file which is read at startup.
+     * @param chosen The configuration returned by choose().
+     * @param front The Pareto front returned by sweep().
+     * @return Returns true if the file could be written.
+     */
+
+    bool save(const std::string &path, const CalibrationResult &chosen,
+              const std::vector<CalibrationResult> &front) const {
+        cv::FileStorage fs(path, cv::FileStorage::WRITE);
+        if (!fs.isOpened()) {
+            std::cerr << "Cannot write calibration to " << path << std::endl;
+            return false;
+        }
+        chosen.config.write(fs);
+        fs << "pareto" << "[";
+        for (const auto &r : front) {
+            fs << "{";
+            fs << "width" << (int)r.config.width << "height" << (int)r.config.height;
+            fs << "downscale" << r.config.detection.downscale;
+            fs << "scaleFactor" << r.config.detection.faceScaleFactor;
+            fs << "minNeighbors" << r.config.detection.faceMinNeighbors;
+            fs << "latencyMs" << r.latencyMs;
+            fs << "faceHitRate" << r.faceHitRate;
+            fs << "eyeHitRate" << r.eyeHitRate;
+            fs << "}";
+        }
+        fs << "]";
+        return true;
+    }
+
+private:
+    std::vector<cv::Mat> frames;
+    EyeDetection cascades;       // parsed once, its copies share the classifiers
+    bool cascadesLoaded = false;
+
+    void measure(CalibrationResult &r, std::vector<cv::Mat> &scaled) {
+        if (!cascadesLoaded) {
+            cascades.loadCascades();
+            cascadesLoaded = true;
+        }
+        const libcamera::ControlList metadata;
+        // an untimed frame first, so that the first detection's allocations aren't measured
+        EyeDetection warmUp = cascades;
+        warmUp.setSettings(r.config.detection);
+        warmUp.Frame(scaled[0], metadata, 0);
+        // a fresh copy has the classifiers but no tracking state
+        EyeDetection detector = cascades;
+        detector.setSettings(r.config.detection);
+        unsigned int faceHits = 0, eyeHits = 0;
+        double totalMs = 0;
+        for (size_t i = 0; i < scaled.size(); i++) {
+            auto t0 = std::chrono::steady_clock::now();
+            bool eyes = detector.Frame(scaled[i], metadata, (int)i);
+            auto t1 = std::chrono::steady_clock::now();
+            totalMs += std::chrono::duration<double, std::milli>(t1 - t0).count();
+            if (detector.lastFaceCount() > 0) faceHits++;
+            if (eyes) eyeHits++;
+        }
+        r.latencyMs = totalMs / scaled.size();
+        r.faceHitRate = (double)faceHits / scaled.size();
+        r.eyeHitRate = (double)eyeHits / scaled.size();
+    }
+
+    static std::vector<CalibrationResult> paretoFront(const std::vector<CalibrationResult> &results) {
+        std::vector<CalibrationResult> front;
+        for (const auto &candidate : results) {
+            bool dominated = false;
+            for (const auto &other : results) {
+                if (other.dominates(candidate)) {
+                    dominated = true;
+                    break;
+                }
+            }
+            if (!dominated) front.push_back(candidate);
+        }
+        return front;
+    }
+};
+
+#endif
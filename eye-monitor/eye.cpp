@@ -1,6 +1,7 @@
 // Standard library Header file
 #include <unistd.h>
 #include <iostream>
+#include <cstring>
 
 // Header file for GPIO access, user functions and pin declarations
 #include <pigpio.h>
@@ -9,6 +10,9 @@
 // Header file for multi-threading, and returning values from threads
 #include <thread>
 #include <future>
+#include <memory>
+#include <optional>
+#include <mutex>
 
 // Header files for playing sounds (.wav files) and playSound() function
 #include <alsa/asoundlib.h>
@@ -16,17 +20,48 @@
 
 // Header file for Camera interfacing
 #include "libcam2opencv.h"
+#include "framerecorder.h"
 #include <libcamera/libcamera.h>
 
 // Header file for OpenCV
 #include <opencv2/opencv.hpp>
 #include "eye_detection.h"
 
+// Header files for the stored configuration and the calibration mode
+#include "monitor_config.h"
+#include "calibration.h"
+
+// Header file for the adaptive framerate
+#include "framerate_governor.h"
+
+// Header files for the evidence snapshots
+#include <sys/stat.h>
+#include "snapshot.h"
+
+// Header file for the MJPEG preview
+#include "preview_server.h"
+
+// Header file for the alert decisions
+#include "alert_logic.h"
+
+// Header file for metering the exposure on the face
+#include "face_metering.h"
+
+// Header file for the high-frame-rate blink mode
+#include "blink_mode.h"
+
+// Header file for the processing stages
+#include "pipeline.h"
+
 // Definitions:
 // Number of frames(with eyes not detected) after which buzzer rings
 #define MIN_FRAMES_B 4
 // Number of frames(with eyes not detected) after which relay switches ON 
 #define MIN_FRAMES_R 20
+// Configuration file written by --calibrate and read at startup
+#define CONFIG_FILE "eye-config.yml"
+// Directory for the evidence snapshots
+#define SNAPSHOT_DIR "snapshots"
 
 /**********************************************************************/
 
@@ -36,82 +71,390 @@ GPIOctrl gpioCtrl;
 EyeDetection eyeDetection;
 
 /**
- * @struct MyCallback
- * @brief A callback structure for handling frames from the camera.
+ * @struct MonitorSettings
+ * @brief Settings reloaded from the configuration while the camera runs.
+ */
+
+struct MonitorSettings {
+   DetectionSettings detection; // cascade parameters
+   unsigned int framerate = 0; // nominal framerate, 0 keeps the governor and the alarm timing as they are
+};
+
+/**
+ * @struct Monitor
+ * @brief The optional parts of the monitor, shared by the pipeline stages.
+ *
+ * The stages run on the camera's worker thread. New settings from the
+ * main thread are only posted here and the stages apply them at the start
+ * of the next frame.
+ */
+
+struct Monitor {
+   AlertLogic alertLogic{MIN_FRAMES_B, MIN_FRAMES_R}; // counts the frames with eyes closed
+   Libcam2OpenCV *camera = nullptr; // camera to adjust the framerate of
+   FramerateGovernor *governor = nullptr; // adaptive framerate, nullptr for a fixed one
+   SnapshotService *snapshots = nullptr; // evidence frames, nullptr to save none
+   PreviewServer *preview = nullptr; // MJPEG preview, nullptr if disabled
+   FaceMetering *metering = nullptr; // exposure on the driver's face, nullptr for the camera's own metering
+   MeteringComparison *comparison = nullptr; // alternates the metering on and off, nullptr if not comparing
+   BlinkCapture *blink = nullptr; // fast capture of the eyes, nullptr if disabled
+
+   /**
+    * @brief Hands new settings to the pipeline, replacing any not yet applied.
+    */
+
+   void post(const MonitorSettings &s) {
+       std::lock_guard<std::mutex> lock(settingsMutex);
+       pendingSettings = s;
+   }
+
+   /**
+    * @brief The settings posted since the last call, if any.
+    */
+
+   std::optional<MonitorSettings> takeSettings() {
+       std::lock_guard<std::mutex> lock(settingsMutex);
+       std::optional<MonitorSettings> s;
+       s.swap(pendingSettings);
+       return s;
+   }
+
+private:
+   std::mutex settingsMutex;
+   std::optional<MonitorSettings> pendingSettings;
+};
+
+/**
+ * @struct MonitorFrame
+ * @brief One frame on its way through the pipeline, filled in by the stages.
+ */
+
+struct MonitorFrame {
+   MonitorFrame(const Libcam2OpenCVFrame &view, const libcamera::ControlList &metadata) :
+       view(view), metadata(metadata) {}
+
+   const Libcam2OpenCVFrame &view; // the frame, possibly still in the camera buffer
+   const libcamera::ControlList &metadata; // metadata associated with the frame
+   int number = 0; // frame counter
+   bool blinkMode = false; // a frame of the eye crop of the blink mode
+   cv::Mat grey; // grey image for the detection
+   bool eyesDetected = false; // result of the cascades
+   double detectionSeconds = 0; // time the cascades took
+   BlinkStats blinkStats; // result of the blink mode
+   AlertState alert; // outputs after this frame
+   bool alertChanged = false; // eyes open or closed in the blink mode since the last frame
+   unsigned int framerate = 0; // new framerate, 0 if unchanged
+};
+
+/**
+ * @struct CaptureStage
+ * @brief Counts the frames and tells the frames of the blink mode from the normal ones.
+ *
+ * Frames of the old size which are still in flight after a switch of
+ * the blink mode are dropped here.
+ */
+
+struct CaptureStage {
+   static constexpr const char *name = "capture";
+   Monitor *monitor;
+   int frameCount = 0; // counter for number of frames
+
+   bool process(MonitorFrame &f) {
+       BlinkCapture *blink = monitor->blink;
+       if (nullptr != blink) {
+           if (blink->isStale(f.view.width(), f.view.height())) return false;
+           f.blinkMode = blink->isBlinkFrame(f.view.width(), f.view.height());
+       }
+       f.number = frameCount++;
+       return true;
+   }
+};
+
+/**
+ * @struct ConvertStage
+ * @brief Gets the grey image, which is the Y plane of a YUV frame without any conversion.
+ */
+
+struct ConvertStage {
+   static constexpr const char *name = "convert";
+
+   bool process(MonitorFrame &f) {
+       f.grey = f.view.grey();
+       return true;
+   }
+};
+
+/**
+ * @struct DetectStage
+ * @brief Scans the face and detects if the eyes are open, or classifies the eyes of the blink mode.
+ *
+ * Settings posted to the Monitor are applied here, before the frame is
+ * detected, so the main thread never writes to what the stages read.
+ * A frame of the blink mode ends here while the eyes are still being
+ * acquired in the crop.
+ */
+
+struct DetectStage {
+   static constexpr const char *name = "detect";
+   Monitor *monitor;
+
+   bool process(MonitorFrame &f) {
+       // a reloaded configuration takes effect between two frames
+       const std::optional<MonitorSettings> settings = monitor->takeSettings();
+       if (settings) apply(*settings);
+       if (f.blinkMode) {
+           return monitor->blink->blinkFrame(f.grey, f.metadata, f.blinkStats);
+       }
+       auto t0 = std::chrono::steady_clock::now();
+       f.eyesDetected = eyeDetection.Frame(f.grey, f.metadata, f.number);
+       f.detectionSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+       return true;
+   }
+
+   /**
+    * @brief Applies reloaded settings to the detection, the governor and the alarm timing.
+    */
+
+   void apply(const MonitorSettings &s) {
+       eyeDetection.setSettings(s.detection);
+       if (s.framerate == 0) return;
+       if (nullptr != monitor->governor) {
+           FramerateGovernor &governor = *monitor->governor;
+           governor.fullFps = s.framerate;
+           governor.idleFps = std::max(5u, s.framerate / 3);
+           governor.hotFps = std::max(governor.idleFps, s.framerate / 2);
+           governor.reset();
+       }
+       // the alarm thresholds are meant for the full framerate, keep them in time
+       monitor->alertLogic.frameSeconds = 1.0 / s.framerate;
+   }
+};
+
+/**
+ * @struct DecideStage
+ * @brief Runs the alert logic and adjusts the camera to the driver.
+ */
+
+struct DecideStage {
+   static constexpr const char *name = "decide";
+   Monitor *monitor;
+   bool blinkOpen = true; // eyes open in the last frame of the blink mode
+
+   bool process(MonitorFrame &f) {
+       Monitor &m = *monitor;
+       if (f.blinkMode) {
+           // the alert logic decides on the blink duration and frequency
+           f.alert = m.alertLogic.updateBlink(f.blinkStats);
+           f.alertChanged = f.alert.led != blinkOpen;
+           blinkOpen = f.alert.led;
+           return true;
+       }
+
+       // Expose for the driver's face rather than the windscreen behind it
+       if ((nullptr != m.metering) && (nullptr != m.camera)) {
+           if (nullptr != m.comparison) {
+               m.metering->setEnabled(m.comparison->meteringOn());
+               m.comparison->record(eyeDetection.lastFaceCount() > 0, f.detectionSeconds);
+           }
+           libcamera::ControlList controls = m.metering->update(f.grey, eyeDetection.lastFaces(), f.metadata);
+           if (!controls.empty()) m.camera->setControls(controls);
+       }
+
+       // Switch to the blink mode once the eyes are found reliably
+       if (nullptr != m.blink) {
+           m.blink->normalFrame(f.grey, eyeDetection.lastEyes(), f.metadata);
+       }
+
+       // Slow down while the driver is alert, speed up as the eyes close
+       if ((nullptr != m.governor) && (nullptr != m.camera) && ((nullptr == m.blink) || !m.blink->active())) {
+           f.framerate = m.governor->update(f.eyesDetected);
+           if (f.framerate > 0) m.camera->setFramerate(f.framerate);
+       }
+
+       // LED on while the eyes are detected, buzzer and relay(eCall system) once they have been closed for long
+       const auto ts = f.metadata.get(libcamera::controls::SensorTimestamp);
+       f.alert = m.alertLogic.update(f.eyesDetected, ts ? *ts / 1e9 : -1.0);
+       return true;
+   }
+};
+
+/**
+ * @struct ActuateStage
+ * @brief Drives the LED, buzzer, relay and snapshots from the alert state.
+ */
+
+struct ActuateStage {
+   static constexpr const char *name = "actuate";
+   Monitor *monitor;
+
+   bool process(MonitorFrame &f) {
+       const AlertState &alert = f.alert;
+       // initialise GPIO
+       if (!f.blinkMode) gpioCtrl.initializeGPIO();
+
+       gpioWrite(led_eye_detect, alert.led ? ON : OFF);
+       gpioWrite(buzzer, alert.buzzerOn ? ON : OFF);
+       gpioWrite(relay, alert.relayOn ? ON : OFF);
+
+       // Keep the frame as evidence when the alarm goes off and when the eCall is made
+       if ((nullptr != monitor->snapshots) && alert.alarm) {
+           saveSnapshot(f, "alarm");
+       }
+       if ((nullptr != monitor->snapshots) && alert.ecall) {
+           saveSnapshot(f, "ecall");
+       }
+       return true;
+   }
+
+   /**
+    * @brief Queues the frame and the face crop for saving, without copying the frame.
+    */
+
+   void saveSnapshot(const MonitorFrame &f, const std::string &label) {
+       const std::vector<cv::Rect> &faces = eyeDetection.lastFaces();
+       cv::Rect face = faces.empty() ? cv::Rect() : faces[0];
+       monitor->snapshots->submit(f.view.detachedBgr(), face, label + "_" + std::to_string(f.number));
+   }
+};
+
+/**
+ * @struct SoundTap
+ * @brief Plays the warning sound on a thread of its own.
+ *
+ * Playing takes longer than a frame, so at most one request waits while
+ * the sound plays and a newer one takes its place.
+ */
+
+struct SoundTap {
+   static constexpr const char *name = "sound";
+   static constexpr StageExecution execution = StageExecution::Executor;
+
+   std::optional<bool> take(const MonitorFrame &f) {
+       if (!f.alert.playSound) return std::nullopt;
+       return true;
+   }
+
+   void process(bool) {
+       player.playSound();
+   }
+};
+
+/**
+ * @struct PreviewTap
+ * @brief Shows the frame and the boxes to the preview clients, if any.
+ *
+ * Runs inline as the PreviewServer encodes on its own thread and only
+ * takes a frame at its own rate.
+ */
+
+struct PreviewTap {
+   static constexpr const char *name = "preview";
+   Monitor *monitor;
+
+   bool process(MonitorFrame &f) {
+       PreviewServer *preview = monitor->preview;
+       if (!f.blinkMode && (nullptr != preview) && preview->wantsFrame()) {
+           preview->submit(f.view.detachedBgr(), eyeDetection.lastFaces(), eyeDetection.lastEyes());
+       }
+       return true;
+   }
+};
+
+/**
+ * @struct LogTap
+ * @brief Prints the state of each frame on a thread of its own, so the console never holds up the camera.
  *
- * This structure inherits from Libcam2OpenCV::Callback and overrides the
- * hasFrame method to process frames received from the camera.
+ * In the blink mode only changes are printed, as there are 100 of these
+ * frames per second.
+ */
+
+struct LogTap {
+   static constexpr const char *name = "log";
+   static constexpr StageExecution execution = StageExecution::Executor;
+   static constexpr size_t queueDepth = 64;
+   Monitor *monitor;
+
+   struct Line {
+       int number;
+       bool blinkMode;
+       bool eyesDetected;
+       bool eyesOpen;
+       int framesShut;
+       unsigned int framerate;
+       bool throttling;
+       BlinkStats blinkStats;
+   };
+
+   std::optional<Line> take(const MonitorFrame &f) {
+       if (f.blinkMode && !f.alertChanged) return std::nullopt;
+       const bool throttling = (nullptr != monitor->governor) && monitor->governor->throttling();
+       return Line{f.number, f.blinkMode, f.eyesDetected, f.alert.led, monitor->alertLogic.framesShut(),
+                   f.framerate, throttling, f.blinkStats};
+   }
+
+   void process(const Line &l) {
+       if (l.blinkMode) {
+           std::cout << (l.eyesOpen ? "Eyes open, " : "Eyes closed, ") << l.blinkStats.blinksPerMinute
+                     << " blinks/min, mean blink " << l.blinkStats.meanBlinkSeconds * 1000
+                     << " ms, PERCLOS " << l.blinkStats.perclos << std::endl;
+           return;
+       }
+
+       // Display FrameCount
+       std::cout << l.number << std::endl;
+       if (l.framerate > 0) {
+           std::cout << "Framerate " << l.framerate << " fps" << (l.throttling ? " (throttled)" : "") << std::endl;
+       }
+
+       // Display appropriate message based on eyes detection
+       if (l.eyesDetected) {
+           std::cout << "Eyes Detected!" << std::endl;
+       }
+       else {
+           std::cout << "No eyes detected in the image!" << std::endl;
+       }
+
+       std::cout << "Eyes shut for "<< l.framesShut << " frames" << std::endl; //print counter value
+   }
+};
+
+/**
+ * @struct EyePipeline
+ * @brief The camera callback of the eye monitor: capture, convert, detect, decide, actuate, sound, preview and log.
  */
 
-struct MyCallback : Libcam2OpenCV::Callback {
-   int frameCount=0; // counter for number of frames
-   int frameEyeShut=0; // counter for number of consecutive frames with eyes closed
+struct EyePipeline : Pipeline<MonitorFrame, CaptureStage, ConvertStage, DetectStage, DecideStage,
+                              ActuateStage, SoundTap, PreviewTap, LogTap> {
+   explicit EyePipeline(Monitor *m) :
+       Pipeline(CaptureStage{m}, ConvertStage{}, DetectStage{m}, DecideStage{m},
+                ActuateStage{m}, SoundTap{}, PreviewTap{m}, LogTap{m}) {}
 
    /**
-    * @brief Function to process each frame received from the camera.
+    * @brief The camera has stopped delivering frames.
     *
-    * @param frame The input image frame.
-    * @param metadata Metadata associated with the frame.
+    * Without frames the driver isn't monitored, so this is signalled
+    * like closed eyes: buzzer on, LED off, until the frames are back.
+    *
+    * @param secondsSinceLastFrame Time since the last frame.
     */
 
-    virtual void hasFrame(const cv::Mat &frame, const libcamera::ControlList &metadata)	
-{	
-   // Load the pre-trained face and eye cascade classifiers
-    cv::CascadeClassifier face_cascade, eye_cascade;
-    
-    // Create a modifiable copy of the frame 
-    cv::Mat FRAME = frame.clone();
-     
-    // Scan face and detect if eyes are open
-    bool eyes_detected = runFrameInThread(eyeDetection, FRAME, metadata, frameCount);
-
-    // Display FrameCount
-    std::cout << frameCount << std::endl;
- 
-     // initialise GPIO 
-    gpioCtrl.initializeGPIO();
-    
-    // Display appropriate message based on eyes detection
-    if (eyes_detected) {
-        std::cout << "Eyes Detected!" << std::endl;
-        //reset counter
-        frameEyeShut = 0; 
-        // Turn ON the LED (indicate eyes are detected)
-        gpioWrite(led_eye_detect, ON); 
-        // Turn OFF buzzer 
-        gpioWrite(buzzer, OFF);
-        // Turn OFF relay(eCall system) 
-        gpioWrite(relay, OFF);
-         
-    } 
-    else {
-        std::cout << "No eyes detected in the image!" << std::endl;
-        frameEyeShut++; //increment counter
-        // Turn OFF the LED (indicate eyes are NOT detected)
-        gpioWrite(led_eye_detect, OFF); 
-    }    
-    
-    // if eyes are closed for short time
-    if(frameEyeShut>= MIN_FRAMES_B){
-        // Turn ON buzzer 
-        gpioWrite(buzzer, ON);
-        
-        // Play sound file on different thread, fewer times
-        if((frameEyeShut%10)==0 || (frameEyeShut==MIN_FRAMES_B) )
-            std::thread soundThread(&AudioPlayer::threadFunc, nullptr); 
-    }
+   virtual void captureStalled(double secondsSinceLastFrame) {
+       std::cout << "Camera fault, no frame for " << secondsSinceLastFrame << " s" << std::endl;
+       gpioCtrl.initializeGPIO();
+       gpioWrite(led_eye_detect, OFF);
+       gpioWrite(buzzer, ON);
+   }
 
-    // if eyes are closed for long time even after buzzer rings, trigger eCall system
-    if(frameEyeShut>=MIN_FRAMES_R){
-        // Turn ON relay(eCall system) 
-        gpioWrite(relay, ON);
-        frameEyeShut=0; //reset counter
-    }
-    
-    std::cout << "Eyes shut for "<< frameEyeShut << " frames" << std::endl; //print counter value
+   /**
+    * @brief The camera delivers frames again, the next frame decides about the buzzer.
+    *
+    * @param blindSeconds Time without frames.
+    */
 
-	frameCount++;
- }   
+   virtual void captureRecovered(double blindSeconds) {
+       std::cout << "Camera recovered after " << blindSeconds << " s" << std::endl;
+       gpioWrite(buzzer, OFF);
+   }
 };
 
 /**********************************************************************/
@@ -121,6 +464,24 @@ struct MyCallback : Libcam2OpenCV::Callback {
  *
  * Initializes the camera, registers the callback, and processes frames until a key is pressed.
  *
+ * With "--calibrate [clip]" the capture and detector parameters are swept
+ * over a recorded clip (or the live camera if no clip is given) and the
+ * best configuration is written to CONFIG_FILE instead. "--config <file>"
+ * selects a different configuration file and "--camera <index|id>" the
+ * driver-facing camera if there is more than one. "--record <file>" dumps
+ * the raw capture session and "--replay <file> [--fast]" runs the monitor
+ * on such a recording instead of the camera, either with the original
+ * timing or as fast as possible. "--snapshots <dir>" sets where the
+ * evidence frames of an alarm are saved (default SNAPSHOT_DIR),
+ * "--preview [port]" serves an MJPEG preview for aligning the camera on
+ * the loopback address, "--preview-bind <address>" on another one,
+ * "--publish <socket>" shares the frames with other local processes and
+ * "--face-metering" exposes for the driver's face. "--metering-ab [s]"
+ * alternates the face metering on and off every s seconds (default 20)
+ * and prints the face hit rate and detection time of both at the end.
+ * "--blink-mode [fps]" captures a small crop around the eyes at fps
+ * (default 100) once they are tracked, to tell blinks from microsleeps.
+ *
  * @param argc The number of command-line arguments.
  * @param argv The command-line arguments.
  * @return Returns 0 upon successful completion.
@@ -128,37 +489,232 @@ struct MyCallback : Libcam2OpenCV::Callback {
 
 int main(int argc, char *argv[]) {
     
-    
+    bool calibrate = false;
+    std::string clip;
+    std::string configFile = CONFIG_FILE;
+    std::string cameraSelect;
+    std::string recordFile;
+    std::string publishSocket;
+    std::string replayFile;
+    std::string snapshotDir = SNAPSHOT_DIR;
+    int previewPort = 0;
+    std::string previewAddress = "::1";
+    bool fast = false;
+    bool faceMetering = false;
+    double meteringPeriod = 0;
+    unsigned int blinkFps = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--calibrate") {
+            calibrate = true;
+            if ((i + 1 < argc) && (argv[i + 1][0] != '-')) clip = argv[++i];
+        } else if ((arg == "--config") && (i + 1 < argc)) {
+            configFile = argv[++i];
+        } else if ((arg == "--camera") && (i + 1 < argc)) {
+            cameraSelect = argv[++i];
+        } else if ((arg == "--record") && (i + 1 < argc)) {
+            recordFile = argv[++i];
+        } else if ((arg == "--publish") && (i + 1 < argc)) {
+            publishSocket = argv[++i];
+        } else if ((arg == "--replay") && (i + 1 < argc)) {
+            replayFile = argv[++i];
+        } else if (arg == "--fast") {
+            fast = true;
+        } else if ((arg == "--snapshots") && (i + 1 < argc)) {
+            snapshotDir = argv[++i];
+        } else if (arg == "--preview") {
+            previewPort = 8080;
+            if ((i + 1 < argc) && (argv[i + 1][0] != '-')) previewPort = std::stoi(argv[++i]);
+        } else if ((arg == "--preview-bind") && (i + 1 < argc)) {
+            previewAddress = argv[++i];
+        } else if (arg == "--face-metering") {
+            faceMetering = true;
+        } else if (arg == "--metering-ab") {
+            meteringPeriod = 20;
+            if ((i + 1 < argc) && (argv[i + 1][0] != '-')) meteringPeriod = std::stod(argv[++i]);
+        } else if (arg == "--blink-mode") {
+            blinkFps = 100;
+            if ((i + 1 < argc) && (argv[i + 1][0] != '-')) blinkFps = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--calibrate [clip]] [--config file] [--camera index|id]"
+                      << " [--record file] [--replay file [--fast]] [--snapshots dir]"
+                      << " [--preview [port]] [--preview-bind address] [--publish socket] [--face-metering] [--metering-ab [s]]"
+                      << " [--blink-mode [fps]]" << std::endl;
+            return 1;
+        }
+    }
     
     // create an instance of the camera class
     Libcam2OpenCV camera;
+
+    // sweep the parameters and store the best configuration
+    if (calibrate) {
+        Calibrator calibrator;
+        bool ok = clip.empty() ? calibrator.recordLive(camera) : calibrator.loadClip(clip);
+        if (!ok) {
+            std::cerr << "No frames for calibration" << std::endl;
+            return 1;
+        }
+        std::vector<CalibrationResult> front = calibrator.sweep();
+        CalibrationResult best = calibrator.choose(front);
+        if (!calibrator.save(configFile, best, front)) return 1;
+        std::cout << "Calibration written to " << configFile << ": " << best.config.width << "x"
+                  << best.config.height << "@" << best.config.framerate << "fps, "
+                  << best.latencyMs << " ms per frame" << std::endl;
+        return 0;
+    }
+
+    // load the calibrated configuration if there is one
+    MonitorConfig config;
+    if (config.load(configFile)) {
+        std::cout << "Using configuration " << configFile << std::endl;
+    }
     
     // initialise GPIO 
     gpioCtrl.initializeGPIO();
     
     
-    std::cout << "Press any key to stop" << std::endl;
+    std::cout << "Press r to reload the configuration, any other key to stop" << std::endl;
     
-    // create an instance of the callback
-    MyCallback myCallback;
+    // create the processing stages and the callback which runs them
+    Monitor monitor;
+    EyePipeline pipeline(&monitor);
+    monitor.post(MonitorSettings{config.detection, 0});
+
+    // save evidence frames when the alarm goes off
+    mkdir(snapshotDir.c_str(), 0755);
+    SnapshotService snapshots(snapshotDir);
+    monitor.snapshots = &snapshots;
+
+    // preview for installation and alignment
+    std::unique_ptr<PreviewServer> preview;
+    if (previewPort > 0) {
+        preview = std::make_unique<PreviewServer>(previewPort, previewAddress);
+        monitor.preview = preview.get();
+    }
+
+    // run on a recorded session instead of the camera
+    if (!replayFile.empty()) {
+        FrameReplay replay;
+        int ret = replay.open(replayFile);
+        if (ret < 0) {
+            std::cerr << "Can't open recording " << replayFile << ": " << strerror(-ret) << std::endl;
+            return 1;
+        }
+        std::cout << "Replaying " << replay.size() << " frames" << std::endl;
+        replay.registerCallback(&pipeline);
+        replay.start(!fast);
+        replay.wait();
+        pipeline.stop();
+        pipeline.timings(std::cout);
+        snapshots.report(std::cout);
+        gpioCtrl.cleanupGPIO();
+        return 0;
+    }
 
     // register the callback
-    camera.registerCallback(&myCallback);
+    camera.registerCallback(&pipeline);
+
+    // run the detection on a worker so that the camera thread never waits for it
+    Libcam2OpenCVWorkerPool workerPool(1);
+    camera.setWorkerPool(&workerPool);
 
     // create an instance of the settings
     Libcam2OpenCVSettings settings;
 
-    // set the framerate (default is variable framerate)
-    settings.framerate = 30;
+    // select the driver-facing camera
+    if (!cameraSelect.empty()) {
+        if (cameraSelect.find_first_not_of("0123456789") == std::string::npos)
+            settings.cameraIndex = std::stoi(cameraSelect);
+        else
+            settings.cameraId = cameraSelect;
+    }
+
+    // set resolution and framerate from the configuration (default is 30 fps)
+    config.apply(settings);
+
+    // adapt the framerate to the driver state and the SoC temperature
+    FramerateGovernor governor;
+    if (settings.framerate > 0) {
+        monitor.camera = &camera;
+        monitor.governor = &governor;
+        // the first frame sets the governor up and the alarm timing
+        monitor.post(MonitorSettings{config.detection, settings.framerate});
+    }
+
+    // meter the exposure on the face, or compare it with the camera's own metering
+    FaceMetering metering;
+    MeteringComparison comparison;
+    if (faceMetering || (meteringPeriod > 0)) {
+        metering.setEnabled(true);
+        monitor.camera = &camera;
+        monitor.metering = &metering;
+        if (meteringPeriod > 0) {
+            comparison.periodSeconds = meteringPeriod;
+            monitor.comparison = &comparison;
+        }
+    }
 
     // start the camera with these settings
-    camera.start(settings);
+    int ret = camera.start(settings);
+    if (ret < 0) {
+        std::cerr << "Can't start the camera: " << strerror(-ret) << std::endl;
+        gpioCtrl.cleanupGPIO();
+        return 1;
+    }
 
-    // do nothing till the user presses any key
-    getchar();
+    // measure the blinks on a fast crop of the eyes
+    std::unique_ptr<BlinkCapture> blink;
+    if (blinkFps > 0) {
+        blink = std::make_unique<BlinkCapture>(camera, settings);
+        blink->fps = blinkFps;
+        monitor.camera = &camera;
+        monitor.blink = blink.get();
+    }
+
+    // dump the raw capture session if requested
+    if (!recordFile.empty()) {
+        camera.startRecording(recordFile);
+    }
+
+    // share the frames with the analytics processes if requested
+    if (!publishSocket.empty()) {
+        camera.startPublishing(publishSocket);
+    }
+
+    // reload the configuration on "r", stop on any other key
+    for (;;) {
+        int c = getchar();
+        if (c != 'r') break;
+        while ((c = getchar()) != '\n' && c != EOF);
+        if (config.load(configFile)) {
+            config.apply(settings);
+            // the pipeline picks these up at its next frame, the camera thread keeps them apart
+            monitor.post(MonitorSettings{config.detection, settings.framerate});
+            auto t0 = std::chrono::steady_clock::now();
+            int ret = blink ? blink->reconfigure(settings) : camera.reconfigure(settings);
+            auto t1 = std::chrono::steady_clock::now();
+            if (ret < 0) {
+                std::cerr << "Reconfiguration failed: " << strerror(-ret) << std::endl;
+                break;
+            }
+            std::cout << "Reconfigured in " << std::chrono::duration<double, std::milli>(t1 - t0).count()
+                      << " ms" << std::endl;
+        }
+    }
 
-    // stop the camera
+    // stop the camera, the blink mode is only released once no more frames arrive
+    if (blink) blink->stop();
     camera.stop();
+    monitor.blink = nullptr;
+    blink.reset();
+    pipeline.stop();
+    pipeline.timings(std::cout);
+    if (nullptr != monitor.comparison) comparison.print(std::cout);
+    snapshots.report(std::cout);
+    Libcam2OpenCVWatchdogStats watchdog = camera.watchdogStats();
+    std::cout << "Camera stalls: " << watchdog.stalls << ", longest blind period "
+              << watchdog.maxBlindSeconds << " s" << std::endl;
     
     // set the GPIO pins back to input mode
     gpioCtrl.cleanupGPIO();
@@ -1,3 +1,6 @@
+#ifndef __EYE_DETECTION_H
+#define __EYE_DETECTION_H
+
 // Standard library Header file
 #include <unistd.h>
 #include <iostream>
@@ -8,6 +11,29 @@
 
 // Header file for OpenCV
 #include <opencv2/opencv.hpp>
+#include "eye_tracker.h"
+#include "fast_haar.h"
+#include "low_light.h"
+
+/**
+ * @struct DetectionSettings
+ * @brief Tunable parameters of the face and eye cascades.
+ *
+ * The defaults reproduce the plain detectMultiScale() calls. They are
+ * normally filled in from the configuration written by "eye --calibrate".
+ */
+
+struct DetectionSettings {
+    double downscale = 1.0;          ///< Factor the grayscale image is resized by before detection.
+    double faceScaleFactor = 1.1;    ///< Scale step of the face cascade.
+    int faceMinNeighbors = 3;        ///< Neighbours needed to keep a face candidate.
+    int faceMinSize = 0;             ///< Smallest face (pixels, after downscaling). Zero means no limit.
+    double eyeScaleFactor = 1.1;     ///< Scale step of the eye cascade.
+    int eyeMinNeighbors = 3;         ///< Neighbours needed to keep an eye candidate.
+    bool fastCascade = false;        ///< Evaluate the cascades with FastHaarCascade instead of OpenCV.
+    int lowLight = 0;                ///< Enhancement of the face search window in the dark, see LowLightEnhancer::Mode.
+    double lowLightExposure = 30000; ///< ExposureTime (us) times gain above which the frame counts as dark.
+};
 
 /**
 * * @class EyeDetection
@@ -32,6 +58,12 @@ public:
             std::cerr << "Error loading cascade classifiers!" << std::endl;
             throw std::runtime_error("Error loading cascade classifiers");
         }
+        // OpenCV stays in charge of any cascade the fixed-point evaluator can't handle
+        if (!fast_face.load("haarcascade_frontalface_alt.xml") || !fast_eye.load("haarcascade_eye.xml")) {
+            std::cerr << "Cascades not supported by FastHaarCascade, using OpenCV" << std::endl;
+            fast_face = FastHaarCascade();
+            fast_eye = FastHaarCascade();
+        }
     }
 
 /**
@@ -39,23 +71,56 @@ public:
      *
      * This method converts the frame to grayscale, detects faces, and then checks for eyes within each detected face.
      *
-     * @param frame The input image frame in which eyes will be detected.
+     * @param frame The input image frame in which eyes will be detected, either BGR or already grey.
      * @param frameCount The number of frames being processed so far.
      * @return Returns true if eyes are detected in the frame, false otherwise.
      */
 
     bool Frame(cv::Mat &frame, const libcamera::ControlList &metadata, int frameCount) {
-        if (frameCount == 0) {
+        if (face_cascade.empty() || eye_cascade.empty()) {
             loadCascades();
         }
 
-	// Convert image to grayscale
+	// Convert image to grayscale, a grey frame is used as it is
         cv::Mat gray_image;
-        cv::cvtColor(frame, gray_image, cv::COLOR_BGR2GRAY);
+        if (frame.channels() == 1) {
+            gray_image = frame;
+        } else {
+            cv::cvtColor(frame, gray_image, cv::COLOR_BGR2GRAY);
+        }
+
+        // Shrink the image if the configuration asks for it
+        if (settings.downscale > 0 && settings.downscale < 1.0) {
+            cv::resize(gray_image, gray_image, cv::Size(), settings.downscale, settings.downscale, cv::INTER_AREA);
+        }
+
+        // Brighten the face search window when the AGC says it's dark
+        const cv::Rect window = searchWindow(gray_image);
+        if ((settings.lowLight != LowLightEnhancer::Off) &&
+            lowLight.dark(metadata, gray_image, window, settings.lowLightExposure)) {
+            // a grey frame may be the Y plane of the camera buffer, which must stay untouched
+            if (gray_image.data == frame.data) gray_image = gray_image.clone();
+            lowLight.apply(gray_image, window, settings.lowLight);
+        }
 
         // Detect faces in the grayscale image	
         std::vector<cv::Rect> faces;
-        face_cascade.detectMultiScale(gray_image, faces);
+        if (useFast()) {
+            fast_face.detectMultiScale(gray_image, faces, settings.faceScaleFactor, settings.faceMinNeighbors, 0,
+                                       cv::Size(settings.faceMinSize, settings.faceMinSize));
+        } else {
+            face_cascade.detectMultiScale(gray_image, faces, settings.faceScaleFactor, settings.faceMinNeighbors, 0,
+                                          cv::Size(settings.faceMinSize, settings.faceMinSize));
+        }
+        // remember the faces in the coordinates of the frame
+        toFrame = (double)frame.cols / gray_image.cols;
+        faceRects.clear();
+        for (const auto &face : faces) {
+            faceRects.push_back(scaleToFrame(face));
+        }
+
+        // the next frame is enhanced around the driver's face
+        updateSearchWindow(faces);
 
         // check if eyes are detected in face
         bool eyes_detected = detectEyes(frame, gray_image, faces);
@@ -63,64 +128,138 @@ public:
 	return eyes_detected;
     }
 
+    /**
+     * @brief Replaces the cascade parameters used by Frame().
+     *
+     * @param newSettings The parameters to use from the next frame on.
+     */
+
+    void setSettings(const DetectionSettings &newSettings) {
+        settings = newSettings;
+    }
+
+    /**
+     * @brief Returns the cascade parameters currently in use.
+     */
+
+    const DetectionSettings &getSettings() const {
+        return settings;
+    }
+
+    /**
+     * @brief Number of faces found in the last processed frame.
+     */
+
+    size_t lastFaceCount() const {
+        return faceRects.size();
+    }
+
+    /**
+     * @brief Faces found in the last processed frame, in the coordinates of that frame.
+     */
+
+    const std::vector<cv::Rect> &lastFaces() const {
+        return faceRects;
+    }
+
+    /**
+     * @brief Eyes found in the last processed frame, in the coordinates of that frame.
+     */
+
+    const std::vector<cv::Rect> &lastEyes() const {
+        return eyeRects;
+    }
+
+    /**
+     * @brief True if the last frame was dark enough for the low-light enhancement.
+     */
+
+    bool lowLightActive() const {
+        return (settings.lowLight != LowLightEnhancer::Off) && lowLight.isActive();
+    }
+
 private:
     cv::CascadeClassifier face_cascade, eye_cascade;
-    int frameCount;
+    FastHaarCascade fast_face, fast_eye;
+    DetectionSettings settings;
+    std::vector<cv::Rect> faceRects;
+    std::vector<cv::Rect> eyeRects;
+    EyeTracker eyeTracker;
+    double toFrame = 1.0;
+    LowLightEnhancer lowLight;
+    cv::Rect lastDriver;
+    int framesWithoutFace = 0;
+    static constexpr double searchMargin = 0.5;   // around the last face, relative to its size
+    static constexpr int searchFrames = 15;       // frames after which the whole image is searched again
+
+    bool useFast() const {
+        return settings.fastCascade && !fast_face.empty() && !fast_eye.empty();
+    }
+
+    /*
+     * The region where the face is expected: around the last driver's
+     * face while it was seen recently, otherwise the whole image.
+     */
+    cv::Rect searchWindow(const cv::Mat &gray) const {
+        const cv::Rect image(0, 0, gray.cols, gray.rows);
+        if ((lastDriver.area() == 0) || (framesWithoutFace > searchFrames)) return image;
+        const int mx = cvRound(lastDriver.width * searchMargin);
+        const int my = cvRound(lastDriver.height * searchMargin);
+        const cv::Rect window = cv::Rect(lastDriver.x - mx, lastDriver.y - my,
+                                         lastDriver.width + 2 * mx, lastDriver.height + 2 * my) & image;
+        return (window.area() > 0) ? window : image;
+    }
+
+    void updateSearchWindow(const std::vector<cv::Rect> &faces) {
+        if (faces.empty()) {
+            framesWithoutFace++;
+            return;
+        }
+        framesWithoutFace = 0;
+        lastDriver = *std::max_element(faces.begin(), faces.end(),
+                                       [](const cv::Rect &a, const cv::Rect &b) { return a.area() < b.area(); });
+    }
+
+    cv::Rect scaleToFrame(const cv::Rect &r) const {
+        return cv::Rect(cvRound(r.x * toFrame), cvRound(r.y * toFrame),
+                        cvRound(r.width * toFrame), cvRound(r.height * toFrame));
+    }
 
     /**
      * @brief Detects eyes within the detected faces.
      *    
-     * This method iterates through the detected faces and attempts to detect eyes within each face region.
+     * Only the largest face, the driver, is examined, so that a passenger's open
+     * eyes can't hide the driver's closed ones. The eyes are searched for in
+     * their own windows of the face and tracked between frames by the EyeTracker.
      *
      * @param frame The input image frame.
      * @param gray_image The grayscale version of the frame.
      * @param faces A list of rectangles representing detected faces.
-     * @return Returns true if eyes are detected within at least one face, false otherwise.
+     * @return Returns true if eyes are detected within the face, false otherwise.
      */
 
     bool detectEyes(cv::Mat &frame, const cv::Mat &gray_image, const std::vector<cv::Rect> &faces) {
-        bool eyes_detected = false;
+        eyeRects.clear();
 
-        for (const auto& face : faces) {
-            cv::Mat face_roi = gray_image(face);
-            std::vector<cv::Rect> eyes;
-            eye_cascade.detectMultiScale(face_roi, eyes);
+        if (faces.empty()) {
+            eyeTracker.reset();
+            return false;
+        }
+        const cv::Rect *driver = &faces[0];
+        for (const auto &face : faces) {
+            if (face.area() > driver->area()) driver = &face;
+        }
 
-            if (!eyes.empty()) {
-                eyes_detected = true; // Set flag to true if eyes were detected for at least one face
-            }
+        std::vector<cv::Rect> eyes;
+        int found = useFast() ?
+            eyeTracker.detect(gray_image, *driver, fast_eye, settings.eyeScaleFactor, settings.eyeMinNeighbors, eyes) :
+            eyeTracker.detect(gray_image, *driver, eye_cascade, settings.eyeScaleFactor, settings.eyeMinNeighbors, eyes);
+        for (const auto &eye : eyes) {
+            eyeRects.push_back(scaleToFrame(eye));
         }
 
-        return eyes_detected;
+        return found > 0;
     }
 };
 
-/**
- * @brief Runs the Frame method for eye detection in separate thread.
- * 
- * This function creates a thread to execute the Frame method and returns the result.
- *
- * @param eyeDetection Instance of EyeDetection used to process the frame.
- * @param frame The input image frame to be processed.
- * @param frameCount The number of frames processed so far.
- * @return Returns true if eyes are detected in the frame, false otherwise.
- */
-
-bool runFrameInThread(EyeDetection& eyeDetection, cv::Mat& frame, const libcamera::ControlList& metadata, int frameCount) {
-    // Create a promise and future to get the result from the thread
-    std::promise<bool> promise;
-    std::future<bool> future = promise.get_future();
-
-    // Create a thread to run the Frame method
-    std::thread frameThread([&eyeDetection, &frame, &metadata, frameCount, &promise]() {
-        bool result = eyeDetection.Frame(frame, metadata, frameCount);
-        promise.set_value(result);
-    });
-
-    // Join the thread back to the main thread
-    frameThread.join();
-
-    // Get the result from the future
-    return future.get();
-}
-
+#endif
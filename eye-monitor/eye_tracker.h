@@ -0,0 +1,165 @@
+/**
+ * @file eye_tracker.h
+ * @brief Localises and tracks the two eyes inside a detected face.
+ */
+
+#ifndef __EYE_TRACKER_H
+#define __EYE_TRACKER_H
+
+// Standard library Header files
+#include <vector>
+#include <algorithm>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+/**
+ * @class EyeTracker
+ * @brief Finds each eye in its own small window of the face and follows it between frames.
+ *
+ * The eyes of an upright face lie in a band of its upper half and have a
+ * size proportional to the face width, so the eye cascade only has to scan
+ * a small window per eye with a narrow range of scales. Once an eye has
+ * been found by the cascade its patch becomes a template. In the following
+ * frames the template locates the eye near the predicted position, and the
+ * cascade only scans a neighbourhood of that location at scales close to
+ * the tracked size. The correlation never decides that an eye is open: the
+ * template includes brow and skin and still matches a closing eye, so
+ * only a cascade hit counts. Without a hit in the neighbourhood the cascade
+ * scans the whole eye window before the eye counts as closed.
+ */
+
+class EyeTracker {
+public:
+    double bandTop = 0.20;            ///< Top of the eye band as a fraction of the face height.
+    double bandBottom = 0.58;         ///< Bottom of the eye band as a fraction of the face height.
+    double minEyeSize = 0.14;         ///< Smallest eye as a fraction of the face width.
+    double maxEyeSize = 0.40;         ///< Largest eye as a fraction of the face width.
+    double matchThreshold = 0.75;     ///< Normalised correlation needed to locate the eye by its template.
+    double searchMargin = 0.5;        ///< Search neighbourhood around the prediction, relative to the eye size.
+    double cascadeMargin = 0.35;      ///< Neighbourhood of the located eye the cascade scans, relative to its size.
+    double sizeTolerance = 0.25;      ///< Size change of the eye the cascade allows from frame to frame.
+
+    /**
+     * @brief Looks for both eyes in a face.
+     *
+     * @param gray The grayscale image.
+     * @param face The face in the grayscale image.
+     * @param cascade The eye cascade, a cv::CascadeClassifier or a FastHaarCascade.
+     * @param scaleFactor Scale step of the eye cascade.
+     * @param minNeighbors Neighbours needed by the eye cascade.
+     * @param eyes Receives the boxes of the eyes found, in image coordinates.
+     * @return Returns the number of eyes found open.
+     */
+
+    template <class Cascade>
+    int detect(const cv::Mat &gray, const cv::Rect &face, Cascade &cascade,
+               double scaleFactor, int minNeighbors, std::vector<cv::Rect> &eyes) {
+        const cv::Rect image(0, 0, gray.cols, gray.rows);
+        const int bandY = face.y + cvRound(face.height * bandTop);
+        const int bandH = cvRound(face.height * (bandBottom - bandTop));
+        const int halfW = face.width / 2;
+        const cv::Rect windows[2] = {
+            cv::Rect(face.x, bandY, halfW, bandH) & image,
+            cv::Rect(face.x + halfW, bandY, face.width - halfW, bandH) & image
+        };
+        const int minSize = std::max(8, cvRound(face.width * minEyeSize));
+        const int maxSize = cvRound(face.width * maxEyeSize);
+
+        int found = 0;
+        for (int i = 0; i < 2; i++) {
+            Track &t = tracks[i];
+            cv::Rect box;
+            bool ok = false;
+            cv::Rect located;
+            if (t.valid && locate(gray, face, windows[i], t, located)) {
+                // the cascade confirms the eye in a small window at about its size
+                const int mx = cvRound(located.width * cascadeMargin);
+                const int my = cvRound(located.height * cascadeMargin);
+                const cv::Rect narrow = cv::Rect(located.x - mx, located.y - my,
+                                                 located.width + 2 * mx, located.height + 2 * my) & windows[i];
+                const int size = std::max(located.width, located.height);
+                ok = runCascade(gray, narrow, cascade, scaleFactor, minNeighbors,
+                                std::max(minSize, cvRound(size * (1 - sizeTolerance))),
+                                std::min(maxSize, cvRound(size * (1 + sizeTolerance))), box);
+            }
+            if (!ok) {
+                ok = runCascade(gray, windows[i], cascade, scaleFactor, minNeighbors, minSize, maxSize, box);
+            }
+            t.valid = ok;
+            if (ok) {
+                // only cascade hits are trusted as templates
+                gray(box).copyTo(t.templ);
+                // remember the eye relative to the face so that it follows head movement
+                t.relative = cv::Rect2d((double)(box.x - face.x) / face.width, (double)(box.y - face.y) / face.height,
+                                        (double)box.width / face.width, (double)box.height / face.height);
+                eyes.push_back(box);
+                found++;
+            }
+        }
+        return found;
+    }
+
+    /**
+     * @brief Forgets both tracks, for example when the face has been lost.
+     */
+
+    void reset() {
+        tracks[0] = Track();
+        tracks[1] = Track();
+    }
+
+private:
+    struct Track {
+        bool valid = false;
+        cv::Mat templ;
+        cv::Rect2d relative;
+    };
+    Track tracks[2];
+
+    // where the template is now, or the predicted position if it doesn't match well
+    bool locate(const cv::Mat &gray, const cv::Rect &face, const cv::Rect &window, Track &t, cv::Rect &box) {
+        // predicted position from the last box relative to the face
+        const cv::Rect predicted(face.x + cvRound(t.relative.x * face.width), face.y + cvRound(t.relative.y * face.height),
+                                 cvRound(t.relative.width * face.width), cvRound(t.relative.height * face.height));
+        if ((predicted.width < 4) || (predicted.height < 4)) return false;
+        const int mx = cvRound(predicted.width * searchMargin);
+        const int my = cvRound(predicted.height * searchMargin);
+        const cv::Rect search = cv::Rect(predicted.x - mx, predicted.y - my,
+                                         predicted.width + 2 * mx, predicted.height + 2 * my) & window;
+        box = predicted & window;
+        if ((search.width <= predicted.width) || (search.height <= predicted.height)) return box.area() > 0;
+
+        cv::Mat templ = t.templ;
+        if (templ.size() != predicted.size()) {
+            cv::resize(t.templ, templ, predicted.size(), 0, 0, cv::INTER_AREA);
+        }
+        cv::Mat score;
+        cv::matchTemplate(gray(search), templ, score, cv::TM_CCOEFF_NORMED);
+        double maxVal;
+        cv::Point maxLoc;
+        cv::minMaxLoc(score, nullptr, &maxVal, nullptr, &maxLoc);
+        if (maxVal < matchThreshold) return box.area() > 0;
+        box = cv::Rect(search.x + maxLoc.x, search.y + maxLoc.y, predicted.width, predicted.height);
+        return true;
+    }
+
+    template <class Cascade>
+    static bool runCascade(const cv::Mat &gray, const cv::Rect &window, Cascade &cascade,
+                           double scaleFactor, int minNeighbors, int minSize, int maxSize, cv::Rect &box) {
+        if ((window.width < minSize) || (window.height < minSize)) return false;
+        std::vector<cv::Rect> candidates;
+        cascade.detectMultiScale(gray(window), candidates, scaleFactor, minNeighbors, 0,
+                                 cv::Size(minSize, minSize), cv::Size(maxSize, maxSize));
+        if (candidates.empty()) return false;
+        // the largest candidate is the eye, smaller ones are usually eyebrow corners
+        const cv::Rect *best = &candidates[0];
+        for (const auto &c : candidates) {
+            if (c.area() > best->area()) best = &c;
+        }
+        box = *best + window.tl();
+        return true;
+    }
+};
+
+#endif
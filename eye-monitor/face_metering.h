@@ -0,0 +1,287 @@
+/**
+ * @file face_metering.h
+ * @brief Exposure and focus on the driver's face instead of the whole scene.
+ */
+
+#ifndef __FACE_METERING_H
+#define __FACE_METERING_H
+
+// Standard library Header files
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+
+// Header file for Camera interfacing
+#include <libcamera/libcamera.h>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+/**
+ * @class FaceMetering
+ * @brief Works out the per-request controls which expose and focus for the tracked face.
+ *
+ * libcamera has no control for an exposure window, so the face is metered
+ * here: its mean grey level is compared with targetMean and the difference
+ * is fed back as ExposureValue, the exposure compensation of the AGC, a
+ * fraction evStep of it per step. The AGC needs several frames to follow
+ * a new ExposureValue, and integrating the error of those frames as well
+ * would wind the compensation up until it overshoots. After a change has
+ * been sent the integration therefore waits until ExposureTime times the
+ * gains in the metadata has moved at least half of the change and then
+ * held still for a frame, or for at most settleFrames frames when the AGC
+ * is at its limit or doesn't report them. AeMeteringMode is switched to
+ * meteringMode so that the AGC itself favours the centre, where the driver
+ * sits. On cameras with autofocus the face box, mapped through ScalerCrop
+ * into sensor coordinates, becomes the AfWindows.
+ *
+ * update() only returns controls when they have changed noticeably or
+ * every resendFrames frames, as a restarted camera has forgotten them.
+ * The caller queues them with Libcam2OpenCV::setControls(), which drops
+ * what the camera doesn't support.
+ */
+
+class FaceMetering {
+public:
+    double targetMean = 110;          ///< Grey level the face should have.
+    double maxEv = 2.0;               ///< Largest exposure compensation in stops.
+    double evStep = 0.3;              ///< Fraction of the brightness error corrected per step.
+    double evDeadband = 0.1;          ///< Smaller changes of the compensation (stops) aren't sent.
+    double afMove = 0.1;              ///< Movement of the face, relative to its size, which moves the AF window.
+    int settleFrames = 10;            ///< Frames waited at most for the AGC to apply a new compensation.
+    int faceLostFrames = 15;          ///< Frames without a face after which the compensation goes back to 0.
+    int resendFrames = 30;            ///< Frames after which all controls are sent again.
+    int32_t meteringMode = libcamera::controls::MeteringSpot;            ///< AeMeteringMode while on.
+    int32_t defaultMode = libcamera::controls::MeteringCentreWeighted;   ///< AeMeteringMode while off.
+
+    /**
+     * @brief Switches face metering on or off. The next update() returns the controls for the new state.
+     */
+
+    void setEnabled(bool on) {
+        if (on == active) return;
+        active = on;
+        ev = 0;
+        missed = 0;
+        settling = 0;
+        afWindow = cv::Rect();
+        sinceSent = resendFrames;
+    }
+
+    /**
+     * @brief True while the face is metered.
+     */
+
+    bool enabled() const {
+        return active;
+    }
+
+    /**
+     * @brief Advances the metering by one frame.
+     *
+     * @param gray The grey image the faces were detected in.
+     * @param faces The faces found, in the coordinates of gray. The largest is the driver.
+     * @param metadata The request metadata of the frame, for ScalerCrop.
+     * @return Returns the controls to queue, empty if nothing needs to change.
+     */
+
+    libcamera::ControlList update(const cv::Mat &gray, const std::vector<cv::Rect> &faces,
+                                  const libcamera::ControlList &metadata) {
+        libcamera::ControlList c;
+        const bool resend = ++sinceSent >= resendFrames;
+        if (!active) {
+            // back to the camera's own metering
+            if (resend) {
+                c.set(libcamera::controls::AeMeteringMode, defaultMode);
+                c.set(libcamera::controls::ExposureValue, 0.0f);
+                c.set(libcamera::controls::AfMetering, libcamera::controls::AfMeteringAuto);
+                sentEv = 0;
+                sinceSent = 0;
+            }
+            return c;
+        }
+
+        const cv::Rect image(0, 0, gray.cols, gray.rows);
+        const cv::Rect *driver = nullptr;
+        for (const auto &face : faces) {
+            if ((nullptr == driver) || (face.area() > driver->area())) driver = &face;
+        }
+        if (nullptr != driver) {
+            missed = 0;
+            // the inner part of the face, without hair and background
+            const cv::Rect inner = cv::Rect(driver->x + driver->width / 5, driver->y + driver->height / 5,
+                                            driver->width * 3 / 5, driver->height * 3 / 5) & image;
+            if ((inner.area() > 0) && settled(metadata)) {
+                const double mean = std::max(1.0, cv::mean(gray(inner))[0]);
+                ev = std::min(maxEv, std::max(-maxEv, ev + evStep * std::log2(targetMean / mean)));
+            }
+            const auto crop = metadata.get(libcamera::controls::ScalerCrop);
+            if (crop && (resend || moved(*driver))) {
+                // frame coordinates to the sensor coordinates of the crop
+                const double sx = (double)crop->width / gray.cols;
+                const double sy = (double)crop->height / gray.rows;
+                const libcamera::Rectangle window(crop->x + (int)(driver->x * sx), crop->y + (int)(driver->y * sy),
+                                                  (unsigned int)(driver->width * sx), (unsigned int)(driver->height * sy));
+                c.set(libcamera::controls::AfMetering, libcamera::controls::AfMeteringWindows);
+                c.set(libcamera::controls::AfWindows, libcamera::Span<const libcamera::Rectangle>(&window, 1));
+                afWindow = *driver;
+            }
+        } else if (++missed > faceLostFrames) {
+            // no face to meter, let the exposure drift back
+            ev = 0;
+        }
+
+        if (resend || (std::fabs(ev - sentEv) >= evDeadband)) {
+            c.set(libcamera::controls::ExposureValue, (float)ev);
+            if (ev != sentEv) {
+                // wait for the AGC before integrating again
+                const double exposure = exposureOf(metadata);
+                settling = settleFrames;
+                settleFrom = exposure;
+                lastExposure = exposure;
+                wantedStops = ev - sentEv;
+            }
+            sentEv = ev;
+        }
+        if (resend) {
+            c.set(libcamera::controls::AeMeteringMode, meteringMode);
+            sinceSent = 0;
+        }
+        return c;
+    }
+
+    /**
+     * @brief Exposure compensation currently asked for, in stops.
+     */
+
+    double exposureValue() const {
+        return ev;
+    }
+
+private:
+    bool active = false;
+    double ev = 0;
+    double sentEv = 0;
+    int missed = 0;
+    int sinceSent = 0;
+    int settling = 0;            // frames still waited for the AGC, 0 when settled
+    double settleFrom = 0;       // exposure when the compensation was sent
+    double lastExposure = 0;
+    double wantedStops = 0;      // change of the compensation which was sent
+    cv::Rect afWindow;
+
+    // ExposureTime times the gains, 0 if the camera doesn't report them
+    static double exposureOf(const libcamera::ControlList &metadata) {
+        const auto time = metadata.get(libcamera::controls::ExposureTime);
+        const auto gain = metadata.get(libcamera::controls::AnalogueGain);
+        if (!time || !gain) return 0;
+        const auto digital = metadata.get(libcamera::controls::DigitalGain);
+        return (double)*time * *gain * (digital ? *digital : 1.0f);
+    }
+
+    // true once the AGC has applied the compensation sent last
+    bool settled(const libcamera::ControlList &metadata) {
+        if (settling <= 0) return true;
+        const double exposure = exposureOf(metadata);
+        if ((exposure > 0) && (settleFrom > 0) && (lastExposure > 0)) {
+            const double moved = std::log2(exposure / settleFrom);
+            const bool still = std::fabs(std::log2(exposure / lastExposure)) < 0.03;
+            if ((moved * wantedStops > 0) && (std::fabs(moved) >= std::fabs(wantedStops) / 2) && still) {
+                settling = 0;
+                return true;
+            }
+        }
+        lastExposure = exposure;
+        return --settling <= 0;
+    }
+
+    bool moved(const cv::Rect &face) const {
+        if (afWindow.area() == 0) return true;
+        const double tolerance = afMove * std::max(face.width, face.height);
+        return (std::abs(face.x - afWindow.x) > tolerance) || (std::abs(face.y - afWindow.y) > tolerance) ||
+               (std::abs(face.width - afWindow.width) > tolerance);
+    }
+};
+
+/**
+ * @class MeteringComparison
+ * @brief Alternates face metering on and off and compares the face hit rate and the detection cost.
+ *
+ * The periods take turns, starting with face metering on. The first
+ * settleFrames frames of each period are not counted, as the AGC is
+ * still converging.
+ */
+
+class MeteringComparison {
+public:
+    double periodSeconds = 20;   ///< Length of each on and off period.
+    int settleFrames = 15;       ///< Frames after a switch which aren't counted.
+
+    /**
+     * @brief Whether face metering should be on for the current period.
+     */
+
+    bool meteringOn() {
+        const auto now = std::chrono::steady_clock::now();
+        if (!started) {
+            start = now;
+            started = true;
+        }
+        const long period = (long)(std::chrono::duration<double>(now - start).count() / periodSeconds);
+        const bool on = (period % 2) == 0;
+        if (on != lastOn) {
+            lastOn = on;
+            sinceSwitch = 0;
+        }
+        return on;
+    }
+
+    /**
+     * @brief Counts one frame of the current period.
+     *
+     * @param faceFound True if a face was found.
+     * @param seconds Time the detection took.
+     */
+
+    void record(bool faceFound, double seconds) {
+        if (sinceSwitch++ < settleFrames) return;
+        Counts &c = lastOn ? on : off;
+        c.frames++;
+        if (faceFound) c.faces++;
+        c.seconds += seconds;
+    }
+
+    /**
+     * @brief Prints face hit rate and mean detection time of both modes.
+     */
+
+    void print(std::ostream &out) const {
+        out << "Face metering  frames  face hit rate  detection ms/frame" << std::endl;
+        print(out, "on ", on);
+        print(out, "off", off);
+    }
+
+private:
+    struct Counts {
+        unsigned long frames = 0;
+        unsigned long faces = 0;
+        double seconds = 0;
+    };
+
+    Counts on, off;
+    bool started = false;
+    bool lastOn = true;
+    int sinceSwitch = 0;
+    std::chrono::steady_clock::time_point start;
+
+    static void print(std::ostream &out, const char *label, const Counts &c) {
+        out << "          " << label << "  " << std::setw(6) << c.frames << "  "
+            << std::setw(13) << (c.frames ? (double)c.faces / c.frames : 0.0) << "  "
+            << std::setw(18) << (c.frames ? c.seconds / c.frames * 1000 : 0.0) << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,606 @@
+/**
+ * @file fast_haar.h
+ * @brief Fixed-point Haar cascade evaluator which rejects windows four at a time.
+ */
+
+#ifndef __FAST_HAAR_H
+#define __FAST_HAAR_H
+
+// Standard library Header files
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FAST_HAAR_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define FAST_HAAR_SSE2
+#endif
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+/**
+ * @brief Four lanes of the cascade evaluation: NEON, SSE2 or plain C++.
+ *
+ * A lane is one window. Int4 holds rectangle sums and fixed-point stage
+ * sums, Float4 the normalised feature values and Mask4 which lanes took
+ * a branch.
+ */
+
+namespace FastHaar {
+
+#if defined(FAST_HAAR_NEON)
+
+typedef int32x4_t Int4;
+typedef float32x4_t Float4;
+typedef uint32x4_t Mask4;
+
+// step is 1 or 2, at most 8 values are read
+inline Int4 load(const int32_t *p, int step) { return (step == 1) ? vld1q_s32(p) : vld2q_s32(p).val[0]; }
+inline Int4 splat(int32_t v) { return vdupq_n_s32(v); }
+inline Float4 splat(float v) { return vdupq_n_f32(v); }
+inline Float4 loadFloat(const float *p) { return vld1q_f32(p); }
+inline Int4 add(Int4 a, Int4 b) { return vaddq_s32(a, b); }
+inline Int4 rectSum(Int4 a, Int4 b, Int4 c, Int4 d) { return vaddq_s32(vsubq_s32(vsubq_s32(a, b), c), d); }
+inline Float4 weighted(Float4 acc, Int4 sum, float w) { return vaddq_f32(acc, vmulq_n_f32(vcvtq_f32_s32(sum), w)); }
+inline Float4 mul(Float4 a, Float4 b) { return vmulq_f32(a, b); }
+inline Mask4 less(Float4 a, Float4 b) { return vcltq_f32(a, b); }
+inline Mask4 less(Int4 a, Int4 b) { return vcltq_s32(a, b); }
+inline Mask4 both(Mask4 a, Mask4 b) { return vandq_u32(a, b); }
+inline Mask4 butNot(Mask4 a, Mask4 b) { return vbicq_u32(a, b); }
+inline Int4 select(Mask4 m, Int4 v) { return vandq_s32(vreinterpretq_s32_u32(m), v); }
+inline Mask4 lanes(int bits) {
+    const uint32_t m[4] = { (bits & 1) ? ~0u : 0u, (bits & 2) ? ~0u : 0u, (bits & 4) ? ~0u : 0u, (bits & 8) ? ~0u : 0u };
+    return vld1q_u32(m);
+}
+inline int bits(Mask4 m) {
+    uint32_t v[4];
+    vst1q_u32(v, m);
+    return (v[0] & 1) | (v[1] & 2) | (v[2] & 4) | (v[3] & 8);
+}
+
+#elif defined(FAST_HAAR_SSE2)
+
+typedef __m128i Int4;
+typedef __m128 Float4;
+typedef __m128i Mask4;
+
+// step is 1 or 2, at most 8 values are read
+inline Int4 load(const int32_t *p, int step) {
+    const __m128i a = _mm_loadu_si128((const __m128i *)p);
+    if (step == 1) return a;
+    const __m128i b = _mm_loadu_si128((const __m128i *)(p + 4));
+    return _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+inline Int4 splat(int32_t v) { return _mm_set1_epi32(v); }
+inline Float4 splat(float v) { return _mm_set1_ps(v); }
+inline Float4 loadFloat(const float *p) { return _mm_loadu_ps(p); }
+inline Int4 add(Int4 a, Int4 b) { return _mm_add_epi32(a, b); }
+inline Int4 rectSum(Int4 a, Int4 b, Int4 c, Int4 d) { return _mm_add_epi32(_mm_sub_epi32(_mm_sub_epi32(a, b), c), d); }
+inline Float4 weighted(Float4 acc, Int4 sum, float w) { return _mm_add_ps(acc, _mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(w))); }
+inline Float4 mul(Float4 a, Float4 b) { return _mm_mul_ps(a, b); }
+inline Mask4 less(Float4 a, Float4 b) { return _mm_castps_si128(_mm_cmplt_ps(a, b)); }
+inline Mask4 less(Int4 a, Int4 b) { return _mm_cmplt_epi32(a, b); }
+inline Mask4 both(Mask4 a, Mask4 b) { return _mm_and_si128(a, b); }
+inline Mask4 butNot(Mask4 a, Mask4 b) { return _mm_andnot_si128(b, a); }
+inline Int4 select(Mask4 m, Int4 v) { return _mm_and_si128(m, v); }
+inline Mask4 lanes(int bits) {
+    return _mm_setr_epi32((bits & 1) ? -1 : 0, (bits & 2) ? -1 : 0, (bits & 4) ? -1 : 0, (bits & 8) ? -1 : 0);
+}
+inline int bits(Mask4 m) { return _mm_movemask_ps(_mm_castsi128_ps(m)); }
+
+#else
+
+struct Int4 { int32_t v[4]; };
+struct Float4 { float v[4]; };
+struct Mask4 { uint32_t v[4]; };
+
+inline Int4 load(const int32_t *p, int step) { return Int4{{ p[0], p[step], p[2 * step], p[3 * step] }}; }
+inline Int4 splat(int32_t v) { return Int4{{ v, v, v, v }}; }
+inline Float4 splat(float v) { return Float4{{ v, v, v, v }}; }
+inline Float4 loadFloat(const float *p) { return Float4{{ p[0], p[1], p[2], p[3] }}; }
+inline Int4 add(Int4 a, Int4 b) {
+    for (int i = 0; i < 4; i++) a.v[i] = (int32_t)((uint32_t)a.v[i] + (uint32_t)b.v[i]);
+    return a;
+}
+inline Int4 rectSum(Int4 a, Int4 b, Int4 c, Int4 d) {
+    for (int i = 0; i < 4; i++) a.v[i] = (int32_t)((uint32_t)a.v[i] - (uint32_t)b.v[i] - (uint32_t)c.v[i] + (uint32_t)d.v[i]);
+    return a;
+}
+inline Float4 weighted(Float4 acc, Int4 sum, float w) {
+    for (int i = 0; i < 4; i++) acc.v[i] += (float)sum.v[i] * w;
+    return acc;
+}
+inline Float4 mul(Float4 a, Float4 b) {
+    for (int i = 0; i < 4; i++) a.v[i] *= b.v[i];
+    return a;
+}
+inline Mask4 less(Float4 a, Float4 b) {
+    Mask4 m;
+    for (int i = 0; i < 4; i++) m.v[i] = (a.v[i] < b.v[i]) ? ~0u : 0u;
+    return m;
+}
+inline Mask4 less(Int4 a, Int4 b) {
+    Mask4 m;
+    for (int i = 0; i < 4; i++) m.v[i] = (a.v[i] < b.v[i]) ? ~0u : 0u;
+    return m;
+}
+inline Mask4 both(Mask4 a, Mask4 b) {
+    for (int i = 0; i < 4; i++) a.v[i] &= b.v[i];
+    return a;
+}
+inline Mask4 butNot(Mask4 a, Mask4 b) {
+    for (int i = 0; i < 4; i++) a.v[i] &= ~b.v[i];
+    return a;
+}
+inline Int4 select(Mask4 m, Int4 v) {
+    for (int i = 0; i < 4; i++) v.v[i] = (int32_t)((uint32_t)v.v[i] & m.v[i]);
+    return v;
+}
+inline Mask4 lanes(int bits) {
+    Mask4 m;
+    for (int i = 0; i < 4; i++) m.v[i] = (bits & (1 << i)) ? ~0u : 0u;
+    return m;
+}
+inline int bits(Mask4 m) { return (m.v[0] & 1) | (m.v[1] & 2) | (m.v[2] & 4) | (m.v[3] & 8); }
+
+#endif
+
+}
+
+/**
+ * @class FastHaarCascade
+ * @brief Drop-in replacement for cv::CascadeClassifier with stump and tree based Haar cascades.
+ *
+ * load() converts the XML of a cascade into flat arrays: the features in the
+ * order in which the stages use them, the nodes with the index of their
+ * feature and threshold, and the leaf values and stage thresholds in 12.20
+ * fixed point, so that a stage sum is an exact integer sum. The first
+ * simdStages stages are evaluated for four horizontally adjacent windows
+ * at once. A window which survives them continues on its own.
+ *
+ * The rectangle sums are exact integers and the normalised feature values
+ * are computed with the same float operations as OpenCV, so each node takes
+ * the same branch as in cv::CascadeClassifier. The image pyramid, the
+ * window steps, the flat-window rejection and the grouping follow OpenCV's
+ * detectMultiScale() as well. Only the stage sums are rounded differently,
+ * by less than 1e-4, so a window whose sum lies that close to a stage
+ * threshold can be decided the other way. eye-haarbench measures this.
+ */
+
+class FastHaarCascade {
+public:
+    int simdStages = 3;    ///< Stages evaluated for four windows at once.
+
+    /**
+     * @brief Loads a cascade in the format written by opencv_traincascade.
+     *
+     * Only Haar cascades without tilted features and with trees of at most
+     * maxTreeNodes nodes are supported. Old-style cascades, LBP and HOG are
+     * not, the caller should keep using cv::CascadeClassifier for them.
+     *
+     * @param path Path of the XML file.
+     * @return Returns true if the cascade has been loaded.
+     */
+
+    bool load(const std::string &path) {
+        clear();
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (!fs.isOpened()) return false;
+        const cv::FileNode root = fs["cascade"];
+        if (root.empty() || ((std::string)root["stageType"] != "BOOST") || ((std::string)root["featureType"] != "HAAR")) {
+            return false;
+        }
+        const cv::FileNode params = root["featureParams"];
+        if (!params.empty() && !params["maxCatCount"].empty() && ((int)params["maxCatCount"] != 0)) return false;
+        window = cv::Size((int)root["width"], (int)root["height"]);
+        if ((window.width <= 2) || (window.height <= 2)) return false;
+
+        // the features as they are stored
+        std::vector<Feature> stored;
+        for (const auto &f : root["features"]) {
+            Feature feature;
+            if (!f["tilted"].empty() && ((int)f["tilted"] != 0)) return false;
+            for (const auto &r : f["rects"]) {
+                std::vector<float> v;
+                for (const auto &n : r) v.push_back((float)n);
+                if ((v.size() != 5) || (feature.rects == 3)) return false;
+                const cv::Rect rect((int)v[0], (int)v[1], (int)v[2], (int)v[3]);
+                if ((rect & cv::Rect(cv::Point(), window)) != rect) return false;
+                feature.rect[feature.rects] = rect;
+                feature.weight[feature.rects++] = v[4];
+            }
+            if (feature.rects < 2) return false;
+            stored.push_back(feature);
+        }
+
+        // the stages, with the features renumbered in the order of use
+        std::vector<int> renumbered(stored.size(), -1);
+        for (const auto &s : root["stages"]) {
+            Stage stage;
+            stage.firstTree = (int)trees.size();
+            stage.threshold = toFixed((float)s["stageThreshold"] - thresholdEps);
+            for (const auto &w : s["weakClassifiers"]) {
+                std::vector<float> in, out;
+                for (const auto &n : w["internalNodes"]) in.push_back((float)n);
+                for (const auto &n : w["leafValues"]) out.push_back((float)n);
+                const int nodeCount = (int)in.size() / 4;
+                if ((nodeCount < 1) || (nodeCount > maxTreeNodes) || ((int)in.size() != nodeCount * 4) ||
+                    ((int)out.size() != nodeCount + 1)) {
+                    return false;
+                }
+                Tree tree;
+                tree.firstNode = (int)nodes.size();
+                tree.nodes = nodeCount;
+                tree.firstLeaf = (int)leaves.size();
+                for (int k = 0; k < nodeCount; k++) {
+                    Node node;
+                    node.left = (int)in[k * 4];
+                    node.right = (int)in[k * 4 + 1];
+                    const int f = (int)in[k * 4 + 2];
+                    node.threshold = in[k * 4 + 3];
+                    // children have to come after their parent and leaves must exist
+                    if ((f < 0) || (f >= (int)stored.size()) ||
+                        !validChild(node.left, k, nodeCount) || !validChild(node.right, k, nodeCount)) {
+                        return false;
+                    }
+                    if (renumbered[f] < 0) {
+                        renumbered[f] = (int)features.size();
+                        features.push_back(stored[f]);
+                    }
+                    node.feature = renumbered[f];
+                    nodes.push_back(node);
+                }
+                for (const float v : out) leaves.push_back(toFixed(v));
+                trees.push_back(tree);
+            }
+            stage.trees = (int)trees.size() - stage.firstTree;
+            if (stage.trees == 0) return false;
+            stages.push_back(stage);
+        }
+        if (stages.empty()) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Returns true if no cascade has been loaded.
+     */
+
+    bool empty() const {
+        return stages.empty();
+    }
+
+    /**
+     * @brief Size of the detection window of the cascade.
+     */
+
+    cv::Size getOriginalWindowSize() const {
+        return window;
+    }
+
+    /**
+     * @brief Detects objects of different sizes, with the parameters of cv::CascadeClassifier::detectMultiScale().
+     *
+     * The scales of the pyramid are evaluated in parallel with cv::parallel_for_.
+     *
+     * @param image The image, grey or BGR.
+     * @param objects Receives the objects found.
+     * @param scaleFactor Scale step of the pyramid, greater than 1.
+     * @param minNeighbors Candidates needed to keep an object, 0 returns the raw candidates.
+     * @param flags Unused, for compatibility with cv::CascadeClassifier.
+     * @param minSize Smallest object, empty for no limit.
+     * @param maxSize Largest object, empty for the image size.
+     */
+
+    void detectMultiScale(const cv::Mat &image, std::vector<cv::Rect> &objects, double scaleFactor = 1.1,
+                          int minNeighbors = 3, int flags = 0, cv::Size minSize = cv::Size(),
+                          cv::Size maxSize = cv::Size()) const {
+        objects.clear();
+        if (empty() || image.empty() || (scaleFactor <= 1.0)) return;
+        cv::Mat gray = image;
+        if (image.channels() == 3) {
+            cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+        } else if (image.channels() == 4) {
+            cv::cvtColor(image, gray, cv::COLOR_BGRA2GRAY);
+        }
+        if ((maxSize.width == 0) || (maxSize.height == 0)) maxSize = gray.size();
+
+        std::vector<float> scales;
+        for (double factor = 1; ; factor *= scaleFactor) {
+            const cv::Size windowSize(cvRound(window.width * factor), cvRound(window.height * factor));
+            if ((windowSize.width > maxSize.width) || (windowSize.height > maxSize.height)) break;
+            if ((windowSize.width < minSize.width) || (windowSize.height < minSize.height)) continue;
+            scales.push_back((float)factor);
+        }
+
+        std::vector<std::vector<cv::Rect>> found(scales.size());
+        cv::parallel_for_(cv::Range(0, (int)scales.size()), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) {
+                scan(gray, scales[i], found[i]);
+            }
+        });
+        for (const auto &f : found) {
+            objects.insert(objects.end(), f.begin(), f.end());
+        }
+        cv::groupRectangles(objects, minNeighbors, groupEps);
+    }
+
+private:
+    static constexpr int maxTreeNodes = 8;
+    static constexpr int leafShift = 20;          // leaf values and stage thresholds in 12.20 fixed point
+    static constexpr float thresholdEps = 1e-5f;  // subtracted from the stage thresholds, as OpenCV does
+    static constexpr double groupEps = 0.2;
+    static constexpr int padding = 32;            // the lanes past the end of a row may read beyond the integral
+
+    struct Feature {
+        int rects = 0;
+        cv::Rect rect[3];
+        float weight[3] = { 0, 0, 0 };
+    };
+
+    // a feature for one stride of the integral image
+    struct FeatureOffsets {
+        int rects;
+        int32_t ofs[3][4];
+        float weight[3];
+    };
+
+    struct Node {
+        int feature;
+        float threshold;
+        int left;     // child node if positive, otherwise the leaf -left
+        int right;
+    };
+
+    struct Tree {
+        int firstNode;
+        int nodes;
+        int firstLeaf;
+    };
+
+    struct Stage {
+        int firstTree;
+        int trees;
+        int32_t threshold;
+    };
+
+    // integral images of one scale
+    struct Scan {
+        std::vector<int32_t> sum;
+        std::vector<uint32_t> sqsum;
+        int stride = 0;
+        int32_t norm[4];
+        double normArea = 0;
+        std::vector<FeatureOffsets> features;
+    };
+
+    cv::Size window;
+    std::vector<Feature> features;
+    std::vector<Node> nodes;
+    std::vector<Tree> trees;
+    std::vector<Stage> stages;
+    std::vector<int32_t> leaves;
+
+    void clear() {
+        window = cv::Size();
+        features.clear();
+        nodes.clear();
+        trees.clear();
+        stages.clear();
+        leaves.clear();
+    }
+
+    static int32_t toFixed(float v) {
+        return (int32_t)std::lround((double)v * (1 << leafShift));
+    }
+
+    static bool validChild(int child, int node, int nodeCount) {
+        return (child > 0) ? ((child > node) && (child < nodeCount)) : (-child <= nodeCount);
+    }
+
+    static void corners(const cv::Rect &r, int stride, int32_t *ofs) {
+        ofs[0] = r.y * stride + r.x;
+        ofs[1] = r.y * stride + r.x + r.width;
+        ofs[2] = (r.y + r.height) * stride + r.x;
+        ofs[3] = (r.y + r.height) * stride + r.x + r.width;
+    }
+
+    // sum of a rectangle, computed modulo 2^32 like the integral itself
+    static int32_t rectSum(const int32_t *p, const int32_t *ofs) {
+        return (int32_t)((uint32_t)p[ofs[0]] - (uint32_t)p[ofs[1]] - (uint32_t)p[ofs[2]] + (uint32_t)p[ofs[3]]);
+    }
+
+    void integral(const cv::Mat &img, Scan &s) const {
+        s.stride = img.cols + 1;
+        s.sum.assign((size_t)s.stride * (img.rows + 1) + padding, 0);
+        s.sqsum.assign(s.sum.size(), 0);
+        for (int y = 0; y < img.rows; y++) {
+            const uint8_t *row = img.ptr<uint8_t>(y);
+            uint32_t rowSum = 0, rowSq = 0;
+            const size_t above = (size_t)y * s.stride;
+            const size_t here = above + s.stride;
+            for (int x = 0; x < img.cols; x++) {
+                rowSum += row[x];
+                rowSq += (uint32_t)row[x] * row[x];
+                s.sum[here + x + 1] = (int32_t)((uint32_t)s.sum[above + x + 1] + rowSum);
+                s.sqsum[here + x + 1] = s.sqsum[above + x + 1] + rowSq;
+            }
+        }
+        const cv::Rect normRect(1, 1, window.width - 2, window.height - 2);
+        corners(normRect, s.stride, s.norm);
+        s.normArea = normRect.area();
+        s.features.resize(features.size());
+        for (size_t i = 0; i < features.size(); i++) {
+            FeatureOffsets &f = s.features[i];
+            f.rects = features[i].rects;
+            for (int r = 0; r < 3; r++) {
+                if (r < f.rects) {
+                    corners(features[i].rect[r], s.stride, f.ofs[r]);
+                } else {
+                    std::fill(f.ofs[r], f.ofs[r] + 4, 0);
+                }
+                f.weight[r] = features[i].weight[r];
+            }
+        }
+    }
+
+    // 1 / standard deviation of the window, false if the window is too flat to look at
+    static bool normFactor(const Scan &s, size_t ofs, float &invNf) {
+        const int32_t valsum = rectSum(s.sum.data() + ofs, s.norm);
+        const uint32_t *q = s.sqsum.data() + ofs;
+        const uint32_t valsqsum = q[s.norm[0]] - q[s.norm[1]] - q[s.norm[2]] + q[s.norm[3]];
+        double nf = s.normArea * valsqsum - (double)valsum * valsum;
+        if (nf > 0.) {
+            nf = std::sqrt(nf);
+            invNf = (float)(1. / nf);
+            return s.normArea * invNf < 1e-1;
+        }
+        invNf = 1.f;
+        return false;
+    }
+
+    static float featureValue(const FeatureOffsets &f, const int32_t *p) {
+        float v = f.weight[0] * (float)rectSum(p, f.ofs[0]) + f.weight[1] * (float)rectSum(p, f.ofs[1]);
+        if (f.rects > 2) v += f.weight[2] * (float)rectSum(p, f.ofs[2]);
+        return v;
+    }
+
+    static FastHaar::Float4 featureValue4(const FeatureOffsets &f, const int32_t *p, int step) {
+        FastHaar::Float4 v = FastHaar::splat(0.f);
+        for (int r = 0; r < f.rects; r++) {
+            const int32_t *o = f.ofs[r];
+            const FastHaar::Int4 sum = FastHaar::rectSum(FastHaar::load(p + o[0], step), FastHaar::load(p + o[1], step),
+                                                         FastHaar::load(p + o[2], step), FastHaar::load(p + o[3], step));
+            v = FastHaar::weighted(v, sum, f.weight[r]);
+        }
+        return v;
+    }
+
+    /*
+     * Runs the stages from the given one on a single window.
+     * Returns 1 if the window passes all of them, otherwise minus the
+     * index of the rejecting stage, so 0 for the first one.
+     */
+    int evaluate(const Scan &s, size_t ofs, float invNf, int firstStage) const {
+        const int32_t *p = s.sum.data() + ofs;
+        for (int si = firstStage; si < (int)stages.size(); si++) {
+            const Stage &stage = stages[si];
+            int32_t sum = 0;
+            for (int t = stage.firstTree; t < stage.firstTree + stage.trees; t++) {
+                const Tree &tree = trees[t];
+                const Node *treeNodes = &nodes[tree.firstNode];
+                int idx = 0;
+                do {
+                    const Node &node = treeNodes[idx];
+                    const float val = featureValue(s.features[node.feature], p) * invNf;
+                    idx = (val < node.threshold) ? node.left : node.right;
+                } while (idx > 0);
+                sum += leaves[tree.firstLeaf - idx];
+            }
+            if (sum < stage.threshold) return -si;
+        }
+        return 1;
+    }
+
+    /*
+     * Evaluates the four windows at ofs, ofs + step, ofs + 2 step and
+     * ofs + 3 step with the same return values as evaluate(). Lanes not
+     * in valid are ignored, flat windows get -1 like in OpenCV.
+     */
+    void evaluate4(const Scan &s, size_t ofs, int step, int valid, int result[4]) const {
+        using namespace FastHaar;
+        float invNf[4] = { 1.f, 1.f, 1.f, 1.f };
+        int alive = 0;
+        for (int j = 0; j < 4; j++) {
+            result[j] = -1;
+            if ((valid & (1 << j)) && normFactor(s, ofs + (size_t)j * step, invNf[j])) alive |= 1 << j;
+        }
+        const int32_t *p = s.sum.data() + ofs;
+        const Float4 norm = loadFloat(invNf);
+        const int simd = std::min(simdStages, (int)stages.size());
+        int si = 0;
+        for (; (si < simd) && alive; si++) {
+            const Stage &stage = stages[si];
+            Int4 sum = splat((int32_t)0);
+            for (int t = stage.firstTree; t < stage.firstTree + stage.trees; t++) {
+                const Tree &tree = trees[t];
+                const Node *treeNodes = &nodes[tree.firstNode];
+                // which lanes reach each node, the children always come after their parent
+                Mask4 reach[maxTreeNodes];
+                reach[0] = lanes(0xf);
+                for (int k = 0; k < tree.nodes; k++) {
+                    const Node &node = treeNodes[k];
+                    const Mask4 isLess = less(mul(featureValue4(s.features[node.feature], p, step), norm),
+                                              splat(node.threshold));
+                    const Mask4 left = both(reach[k], isLess);
+                    const Mask4 right = butNot(reach[k], isLess);
+                    if (node.left > 0) {
+                        reach[node.left] = left;
+                    } else {
+                        sum = add(sum, select(left, splat(leaves[tree.firstLeaf - node.left])));
+                    }
+                    if (node.right > 0) {
+                        reach[node.right] = right;
+                    } else {
+                        sum = add(sum, select(right, splat(leaves[tree.firstLeaf - node.right])));
+                    }
+                }
+            }
+            const int rejected = bits(less(sum, splat(stage.threshold))) & alive;
+            for (int j = 0; j < 4; j++) {
+                if (rejected & (1 << j)) result[j] = -si;
+            }
+            alive &= ~rejected;
+        }
+        for (int j = 0; j < 4; j++) {
+            if (alive & (1 << j)) result[j] = evaluate(s, ofs + (size_t)j * step, invNf[j], si);
+        }
+    }
+
+    // all windows of one scale of the pyramid
+    void scan(const cv::Mat &gray, float scale, std::vector<cv::Rect> &found) const {
+        const cv::Size sz(cvRound(gray.cols / scale), cvRound(gray.rows / scale));
+        // window positions per axis, as ScaleData::getWorkingSize() with the integral size sz + 1
+        const cv::Size szw(sz.width + 1 - window.width, sz.height + 1 - window.height);
+        if ((szw.width <= 0) || (szw.height <= 0)) return;
+        cv::Mat img;
+        cv::resize(gray, img, sz, 0, 0, cv::INTER_LINEAR_EXACT);
+        Scan s;
+        integral(img, s);
+
+        // every row and column from a scale of 2 on, as ScaleData::ystep
+        const int step = (scale >= 2) ? 1 : 2;
+        const cv::Size winSize(cvRound(window.width * scale), cvRound(window.height * scale));
+        for (int y = 0; y < szw.height; y += step) {
+            int x = 0;
+            while (x < szw.width) {
+                int valid = 0;
+                for (int j = 0; j < 4; j++) {
+                    if (x + j * step < szw.width) valid |= 1 << j;
+                }
+                int result[4];
+                evaluate4(s, (size_t)y * s.stride + x, step, valid, result);
+                // a window rejected by the first stage lets the scan skip the next one, as in OpenCV
+                int j = 0;
+                while ((j < 4) && (x + j * step < szw.width)) {
+                    if (result[j] > 0) {
+                        found.push_back(cv::Rect(cvRound((x + j * step) * scale), cvRound(y * scale),
+                                                 winSize.width, winSize.height));
+                    }
+                    j += (result[j] == 0) ? 2 : 1;
+                }
+                x += j * step;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,122 @@
+/**
+ * @file framerate_governor.h
+ * @brief Chooses the capture framerate from the driver state and the SoC temperature.
+ */
+
+#ifndef __FRAMERATE_GOVERNOR_H
+#define __FRAMERATE_GOVERNOR_H
+
+// Standard library Header files
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <chrono>
+#include <algorithm>
+
+/**
+ * @class FramerateGovernor
+ * @brief Lowers the framerate while the driver is alert and raises it when eyes close.
+ *
+ * An exponential average of the closed-eye frames is kept. While it stays
+ * low and the eyes have been open for idleAfter seconds the governor drops
+ * to idleFps. Every closure pushes the average up and the framerate ramps
+ * towards fullFps, which is reached once the average hits rampScore. When
+ * the SoC temperature passes hotTemp the framerate is capped at hotFps until
+ * it has cooled below coolTemp.
+ */
+
+class FramerateGovernor {
+public:
+    unsigned int fullFps = 30;     ///< Framerate when drowsiness is suspected.
+    unsigned int idleFps = 10;     ///< Framerate while the eyes are consistently open.
+    unsigned int hotFps = 15;      ///< Cap while the SoC is throttling.
+    double idleAfter = 3.0;        ///< Seconds of open eyes before dropping to idleFps.
+    double rampScore = 0.2;        ///< Closure average at which fullFps is reached.
+    double smoothing = 0.1;        ///< Weight of the newest frame in the closure average.
+    int hotTemp = 80000;           ///< Throttling temperature in milli degrees Celsius.
+    int coolTemp = 75000;          ///< Temperature below which the cap is lifted.
+    const char *thermalZone = "/sys/class/thermal/thermal_zone0/temp"; ///< SoC temperature.
+
+    /**
+     * @brief Restarts the governor at fullFps, which is the rate the camera is started with.
+     */
+
+    void reset() {
+        current = fullFps;
+        closureScore = 0;
+        hot = false;
+        lastClosure = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * @brief Feeds the detection result of one frame to the governor.
+     *
+     * @param eyesDetected True if the eyes were found open in the frame.
+     * @return Returns the new framerate if it should be changed, zero otherwise.
+     */
+
+    unsigned int update(bool eyesDetected) {
+        const auto now = std::chrono::steady_clock::now();
+        closureScore = (1.0 - smoothing) * closureScore + smoothing * (eyesDetected ? 0.0 : 1.0);
+        if (!eyesDetected) lastClosure = now;
+
+        // the temperature changes slowly, one reading per second is plenty
+        if (now - lastThermalCheck >= std::chrono::seconds(1)) {
+            lastThermalCheck = now;
+            int temp = readTemperature();
+            if (temp >= hotTemp) hot = true;
+            if (temp >= 0 && temp < coolTemp) hot = false;
+        }
+
+        unsigned int target;
+        const double openFor = std::chrono::duration<double>(now - lastClosure).count();
+        if ((openFor >= idleAfter) && (closureScore < rampScore / 4)) {
+            target = idleFps;
+        } else {
+            double ramp = std::min(1.0, closureScore / rampScore);
+            target = idleFps + (unsigned int)((fullFps - idleFps) * ramp + 0.5);
+            // a closure never lowers the rate below the current one
+            target = std::max(target, current);
+        }
+        if (hot) target = std::min(target, hotFps);
+
+        // avoid flooding the camera with small changes
+        if (target == current) return 0;
+        if ((target != fullFps) && (target != idleFps) && (target != hotFps) &&
+            (target < current + 5) && (target + 5 > current)) return 0;
+        current = target;
+        return current;
+    }
+
+    /**
+     * @brief Returns the framerate last handed out.
+     */
+
+    unsigned int framerate() const {
+        return current;
+    }
+
+    /**
+     * @brief Returns true while the SoC is considered to be throttling.
+     */
+
+    bool throttling() const {
+        return hot;
+    }
+
+private:
+    double closureScore = 0;
+    unsigned int current = 30;
+    bool hot = false;
+    std::chrono::steady_clock::time_point lastClosure = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point lastThermalCheck;
+
+    int readTemperature() const {
+        std::ifstream f(thermalZone);
+        int temp = -1;
+        if (!(f >> temp)) return -1;
+        return temp;
+    }
+};
+
+#endif
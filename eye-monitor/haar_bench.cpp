@@ -0,0 +1,254 @@
+// Header file for input output functions
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <tuple>
+#include <algorithm>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+// Header files for the recordings and the fixed-point cascade
+#include "framerecorder.h"
+#include "fast_haar.h"
+
+/**********************************************************************/
+
+/**
+ * @brief Reads the frames of a recording, a video file or a single image as grey images.
+ */
+
+static bool loadFrames(const std::string &path, size_t maxFrames, std::vector<cv::Mat> &frames) {
+    FrameReplay replay;
+    if (replay.open(path) >= 0) {
+        struct Collector : Libcam2OpenCV::Callback {
+            std::vector<cv::Mat> *frames;
+            virtual void hasFrame(const cv::Mat &frame, const libcamera::ControlList &) {
+                hasFrameView(Libcam2OpenCVFrame::fromBgr(frame), libcamera::ControlList());
+            }
+            virtual void hasFrameView(const Libcam2OpenCVFrame &view, const libcamera::ControlList &) {
+                frames->push_back(view.grey().clone());
+            }
+        } collector;
+        collector.frames = &frames;
+        replay.registerCallback(&collector);
+        for (size_t i = 0; (i < replay.size()) && (frames.size() < maxFrames); i++) {
+            replay.deliver(i);
+        }
+        return !frames.empty();
+    }
+    cv::Mat image = cv::imread(path, cv::IMREAD_GRAYSCALE);
+    if (!image.empty()) {
+        frames.push_back(image);
+        return true;
+    }
+    cv::VideoCapture clip(path);
+    cv::Mat frame;
+    while ((frames.size() < maxFrames) && clip.read(frame)) {
+        cv::Mat grey;
+        cv::cvtColor(frame, grey, cv::COLOR_BGR2GRAY);
+        frames.push_back(grey);
+    }
+    return !frames.empty();
+}
+
+/**
+ * @brief Draws a grey test image with five cartoon faces of 100 to 220 pixels height.
+ *
+ * Each face is a bright ellipse with dark pupils in bright eyes, brows, a
+ * nose and a mouth, slightly blurred. Both cascades of the eye monitor find
+ * raw candidates in it, at scales below, at and above 2, so the image needs
+ * no labelled clip to compare the evaluators.
+ */
+
+static cv::Mat syntheticFrame() {
+    cv::Mat image(480, 640, CV_8UC1, cv::Scalar(90));
+    const int faces[5][3] = { { 120, 130, 70 }, { 330, 150, 110 }, { 540, 120, 50 }, { 160, 360, 90 }, { 460, 370, 100 } };
+    for (const auto &f : faces) {
+        const int cx = f[0], cy = f[1], r = f[2];
+        cv::ellipse(image, cv::Point(cx, cy), cv::Size((int)(r * 0.8), r), 0, 0, 360, cv::Scalar(200), cv::FILLED);
+        for (int side = -1; side <= 1; side += 2) {
+            const cv::Point eye(cx + side * (int)(r * 0.35), cy - (int)(r * 0.2));
+            cv::ellipse(image, eye - cv::Point(0, (int)(r * 0.2)), cv::Size((int)(r * 0.22), (int)(r * 0.05)),
+                        0, 0, 360, cv::Scalar(70), cv::FILLED);
+            cv::ellipse(image, eye, cv::Size((int)(r * 0.2), (int)(r * 0.1)), 0, 0, 360, cv::Scalar(240), cv::FILLED);
+            cv::circle(image, eye, (int)(r * 0.08), cv::Scalar(30), cv::FILLED);
+        }
+        cv::ellipse(image, cv::Point(cx, cy + (int)(r * 0.5)), cv::Size((int)(r * 0.3), (int)(r * 0.08)),
+                    0, 0, 360, cv::Scalar(100), cv::FILLED);
+        cv::line(image, cv::Point(cx, cy - (int)(r * 0.1)), cv::Point(cx, cy + (int)(r * 0.25)),
+                 cv::Scalar(150), std::max(1, r / 20));
+    }
+    cv::GaussianBlur(image, image, cv::Size(5, 5), 0);
+    return image;
+}
+
+/**
+ * @brief Number of rectangles found by both detectors without grouping, which have to be identical.
+ */
+
+static size_t identical(std::vector<cv::Rect> a, std::vector<cv::Rect> b) {
+    auto key = [](const cv::Rect &r) { return std::make_tuple(r.x, r.y, r.width, r.height); };
+    auto less = [&key](const cv::Rect &l, const cv::Rect &r) { return key(l) < key(r); };
+    std::sort(a.begin(), a.end(), less);
+    std::sort(b.begin(), b.end(), less);
+    std::vector<cv::Rect> both;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(both), less);
+    return both.size();
+}
+
+/**
+ * @brief Number of detections of one detector which overlap one of the other by at least half.
+ */
+
+static size_t matched(const std::vector<cv::Rect> &a, const std::vector<cv::Rect> &b) {
+    std::vector<bool> used(b.size(), false);
+    size_t n = 0;
+    for (const auto &r : a) {
+        for (size_t i = 0; i < b.size(); i++) {
+            const double overlap = (r & b[i]).area();
+            if (!used[i] && (overlap / (r.area() + b[i].area() - overlap) >= 0.5)) {
+                used[i] = true;
+                n++;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Runs one cascade with both evaluators on all frames and prints the comparison.
+ *
+ * @param agrees Set to false if there are no raw candidates at all or if
+ *               more than 1% of them are found by only one evaluator.
+ * @return Returns false if the cascade can't be loaded.
+ */
+
+static bool compare(const std::string &cascadePath, const std::vector<cv::Mat> &frames,
+                    double scaleFactor, int minNeighbors, bool &agrees) {
+    cv::CascadeClassifier reference;
+    FastHaarCascade fast;
+    if (!reference.load(cascadePath) || !fast.load(cascadePath)) {
+        std::cerr << "Cannot load " << cascadePath << " into both evaluators" << std::endl;
+        return false;
+    }
+
+    double referenceTime = 0, fastTime = 0;
+    size_t referenceRaw = 0, fastRaw = 0, sameRaw = 0;
+    size_t referenceFound = 0, fastFound = 0, sameFound = 0;
+    std::vector<cv::Rect> a, b;
+    for (const auto &frame : frames) {
+        // the raw candidates show whether the windows are decided the same way
+        reference.detectMultiScale(frame, a, scaleFactor, 0);
+        fast.detectMultiScale(frame, b, scaleFactor, 0);
+        referenceRaw += a.size();
+        fastRaw += b.size();
+        sameRaw += identical(a, b);
+
+        // the timing is taken with grouping, as used by the eye monitor
+        auto t0 = std::chrono::steady_clock::now();
+        reference.detectMultiScale(frame, a, scaleFactor, minNeighbors);
+        auto t1 = std::chrono::steady_clock::now();
+        fast.detectMultiScale(frame, b, scaleFactor, minNeighbors);
+        auto t2 = std::chrono::steady_clock::now();
+        referenceTime += std::chrono::duration<double>(t1 - t0).count();
+        fastTime += std::chrono::duration<double>(t2 - t1).count();
+        referenceFound += a.size();
+        fastFound += b.size();
+        sameFound += matched(a, b);
+    }
+
+    const double n = (double)frames.size();
+    std::cout << cascadePath << ", " << frames.size() << " frames of "
+              << frames[0].cols << "x" << frames[0].rows << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "  cv::CascadeClassifier: " << referenceTime / n * 1000 << " ms/frame" << std::endl;
+    std::cout << "  FastHaarCascade:       " << fastTime / n * 1000 << " ms/frame, "
+              << (fastTime > 0 ? referenceTime / fastTime : 0) << "x" << std::endl;
+    std::cout << "  raw candidates: " << referenceRaw << " OpenCV, " << fastRaw << " fast, "
+              << sameRaw << " identical" << std::endl;
+    std::cout << "  detections:     " << referenceFound << " OpenCV, " << fastFound << " fast, "
+              << sameFound << " matched" << std::endl;
+
+    // the stage sums are rounded differently, a window right at a threshold may differ
+    const size_t raw = std::max(referenceRaw, fastRaw);
+    agrees = (raw > 0) && ((raw - sameRaw) * 100 <= raw);
+    return true;
+}
+
+/**
+ * @brief Side-by-side benchmark of FastHaarCascade and cv::CascadeClassifier.
+ *
+ * Usage: eye-haarbench <recording|video|image|--synthetic> [--cascade <xml>] [--frames <n>] [--scale <f>] [--neighbors <n>] [--threads <n>] [--check]
+ *
+ * Both evaluators run on the same grey frames. "--synthetic" uses the
+ * image of syntheticFrame() instead of a file. Without "--cascade" the
+ * face and the eye cascade of the eye monitor are compared. The raw
+ * candidates of both, without grouping, are compared rectangle by
+ * rectangle, the grouped detections by overlap. "--threads" sets the
+ * number of threads of OpenCV's parallel loops, which both use.
+ * "--check" turns the comparison into a test, see compare().
+ *
+ * @return Returns 0 on success, 1 if "--check" fails and 2 on an error.
+ */
+
+int main(int argc, char *argv[]) {
+    std::string input;
+    std::vector<std::string> cascades;
+    size_t maxFrames = 300;
+    double scaleFactor = 1.1;
+    int minNeighbors = 3;
+    bool check = false;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if ((arg == "--cascade") && (i + 1 < argc)) {
+            cascades.push_back(argv[++i]);
+        } else if ((arg == "--frames") && (i + 1 < argc)) {
+            maxFrames = std::stoul(argv[++i]);
+        } else if ((arg == "--scale") && (i + 1 < argc)) {
+            scaleFactor = std::stod(argv[++i]);
+        } else if ((arg == "--neighbors") && (i + 1 < argc)) {
+            minNeighbors = std::stoi(argv[++i]);
+        } else if ((arg == "--threads") && (i + 1 < argc)) {
+            cv::setNumThreads(std::stoi(argv[++i]));
+        } else if (arg == "--check") {
+            check = true;
+        } else if (input.empty() && (arg == "--synthetic")) {
+            input = arg;
+        } else if (input.empty() && (arg[0] != '-')) {
+            input = arg;
+        } else {
+            input.clear();
+            break;
+        }
+    }
+    if (input.empty() || (scaleFactor <= 1.0)) {
+        std::cerr << "Usage: " << argv[0] << " <recording|video|image|--synthetic> [--cascade <xml>] [--frames <n>]"
+                  << " [--scale <f>] [--neighbors <n>] [--threads <n>] [--check]" << std::endl;
+        return 2;
+    }
+    if (cascades.empty()) {
+        cascades = { "haarcascade_frontalface_alt.xml", "haarcascade_eye.xml" };
+    }
+
+    std::vector<cv::Mat> frames;
+    if (input == "--synthetic") {
+        frames.push_back(syntheticFrame());
+    } else if (!loadFrames(input, maxFrames, frames)) {
+        std::cerr << "No frames in " << input << std::endl;
+        return 2;
+    }
+    bool failed = false;
+    for (const auto &cascade : cascades) {
+        bool agrees = true;
+        if (!compare(cascade, frames, scaleFactor, minNeighbors, agrees)) return 2;
+        if (check && !agrees) {
+            std::cerr << "FAIL " << cascade << ": the raw candidates of both evaluators differ" << std::endl;
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * @file low_light.h
+ * @brief Contrast enhancement of the face search window in low light.
+ */
+
+#ifndef __LOW_LIGHT_H
+#define __LOW_LIGHT_H
+
+// Standard library Header files
+#include <cmath>
+
+// Header file for Camera interfacing
+#include <libcamera/libcamera.h>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+/**
+ * @class LowLightEnhancer
+ * @brief Brightens the grey detection image where the face is searched for, but only when it's dark.
+ *
+ * Whether it's dark is decided from the exposure the AGC has chosen: the
+ * ExposureTime of the request metadata times its analogue and digital
+ * gain. Above threshold the image is enhanced, below hysteresis times
+ * threshold it's left alone again, so the decision doesn't flicker. A
+ * bright frame costs three metadata lookups. Frames without exposure
+ * metadata, such as replayed video files, fall back to the mean
+ * brightness of the search window.
+ *
+ * The enhancement is either a gamma lookup table or CLAHE on tiles of
+ * the search window, both of which OpenCV vectorises.
+ */
+
+class LowLightEnhancer {
+public:
+    enum Mode {
+        Off = 0,       ///< No enhancement.
+        Gamma = 1,     ///< Gamma lookup table.
+        Clahe = 2      ///< Contrast limited adaptive histogram equalisation.
+    };
+
+    double gamma = 0.5;           ///< Exponent of the gamma curve, below 1 brightens.
+    double clipLimit = 2.0;       ///< CLAHE contrast limit.
+    int tiles = 4;                ///< CLAHE tiles per side of the search window.
+    double hysteresis = 0.7;      ///< Fraction of the threshold at which the enhancement stops again.
+    double darkMean = 60;         ///< Mean grey value below which a frame without metadata counts as dark.
+
+    /**
+     * @brief Decides from the metadata whether this frame needs the enhancement.
+     *
+     * @param metadata The request metadata of the frame.
+     * @param gray The grey detection image, only used without exposure metadata.
+     * @param window The face search window in the grey image.
+     * @param threshold ExposureTime (us) times gain above which it's dark.
+     * @return Returns true if the frame should be enhanced.
+     */
+
+    bool dark(const libcamera::ControlList &metadata, const cv::Mat &gray, const cv::Rect &window, double threshold) {
+        const auto exposure = metadata.get(libcamera::controls::ExposureTime);
+        const auto gain = metadata.get(libcamera::controls::AnalogueGain);
+        if (exposure && gain) {
+            const auto digital = metadata.get(libcamera::controls::DigitalGain);
+            level = *exposure * *gain * (digital ? *digital : 1.0f);
+            active = level > (active ? threshold * hysteresis : threshold);
+        } else {
+            // no AGC values, look at the picture itself
+            const double mean = cv::mean(gray(window))[0];
+            level = mean;
+            active = mean < (active ? darkMean / hysteresis : darkMean);
+        }
+        return active;
+    }
+
+    /**
+     * @brief Enhances the search window in place.
+     *
+     * @param gray The grey detection image, which must not share its data with the camera buffer.
+     * @param window The face search window in the grey image.
+     * @param mode Gamma or Clahe, Off does nothing.
+     */
+
+    void apply(cv::Mat &gray, const cv::Rect &window, int mode) {
+        cv::Mat roi = gray(window);
+        if (mode == Gamma) {
+            if (lutGamma != gamma) {
+                lut.create(1, 256, CV_8U);
+                for (int i = 0; i < 256; i++) {
+                    lut.at<uint8_t>(i) = cv::saturate_cast<uint8_t>(std::pow(i / 255.0, gamma) * 255.0);
+                }
+                lutGamma = gamma;
+            }
+            cv::LUT(roi, lut, roi);
+        } else if (mode == Clahe) {
+            // tiles of the window, so a small face gets a fine grid and a big one a coarse one
+            if (!clahe) clahe = cv::createCLAHE();
+            clahe->setClipLimit(clipLimit);
+            clahe->setTilesGridSize(cv::Size(tiles, tiles));
+            clahe->apply(roi, enhanced);
+            enhanced.copyTo(roi);
+        }
+    }
+
+    /**
+     * @brief True if the last frame was found dark.
+     */
+
+    bool isActive() const {
+        return active;
+    }
+
+    /**
+     * @brief ExposureTime times gain of the last frame, or its mean brightness without metadata.
+     */
+
+    double lastLevel() const {
+        return level;
+    }
+
+private:
+    bool active = false;
+    double level = 0;
+    cv::Mat lut;
+    double lutGamma = -1;
+    cv::Ptr<cv::CLAHE> clahe;
+    cv::Mat enhanced;
+};
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * @file monitor_config.h
+ * @brief Loading and saving of the capture and detector configuration.
+ */
+
+#ifndef __MONITOR_CONFIG_H
+#define __MONITOR_CONFIG_H
+
+// Standard library Header files
+#include <iostream>
+#include <string>
+
+// Header file for Camera interfacing
+#include "libcam2opencv.h"
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+#include "eye_detection.h"
+
+/**
+ * @struct MonitorConfig
+ * @brief Capture and detector settings used by a normal run.
+ *
+ * The configuration is written by "eye --calibrate" and read at startup.
+ * It is stored as an OpenCV YAML file so that it can be edited by hand.
+ */
+
+struct MonitorConfig {
+    unsigned int width = 0;       ///< Capture width, zero lets libcamera decide.
+    unsigned int height = 0;      ///< Capture height, zero lets libcamera decide.
+    unsigned int framerate = 30;  ///< Capture framerate.
+    DetectionSettings detection;  ///< Cascade parameters.
+
+    /**
+     * @brief Reads the configuration from a file.
+     *
+     * Keys missing from the file keep their current value.
+     *
+     * @param path Path of the YAML file.
+     * @return Returns true if the file could be opened, false otherwise.
+     */
+
+    bool load(const std::string &path) {
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (!fs.isOpened()) {
+            return false;
+        }
+        readValue(fs["width"], width);
+        readValue(fs["height"], height);
+        readValue(fs["framerate"], framerate);
+        const cv::FileNode det = fs["detection"];
+        if (!det.empty()) {
+            readValue(det["downscale"], detection.downscale);
+            readValue(det["faceScaleFactor"], detection.faceScaleFactor);
+            readValue(det["faceMinNeighbors"], detection.faceMinNeighbors);
+            readValue(det["faceMinSize"], detection.faceMinSize);
+            readValue(det["eyeScaleFactor"], detection.eyeScaleFactor);
+            readValue(det["eyeMinNeighbors"], detection.eyeMinNeighbors);
+            readValue(det["fastCascade"], detection.fastCascade);
+            readValue(det["lowLight"], detection.lowLight);
+            readValue(det["lowLightExposure"], detection.lowLightExposure);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Writes the configuration to a file.
+     *
+     * @param fs An open FileStorage, so that callers can append their own entries.
+     */
+
+    void write(cv::FileStorage &fs) const {
+        fs << "width" << (int)width;
+        fs << "height" << (int)height;
+        fs << "framerate" << (int)framerate;
+        fs << "detection" << "{";
+        fs << "downscale" << detection.downscale;
+        fs << "faceScaleFactor" << detection.faceScaleFactor;
+        fs << "faceMinNeighbors" << detection.faceMinNeighbors;
+        fs << "faceMinSize" << detection.faceMinSize;
+        fs << "eyeScaleFactor" << detection.eyeScaleFactor;
+        fs << "eyeMinNeighbors" << detection.eyeMinNeighbors;
+        fs << "fastCascade" << (int)detection.fastCascade;
+        fs << "lowLight" << detection.lowLight;
+        fs << "lowLightExposure" << detection.lowLightExposure;
+        fs << "}";
+    }
+
+    /**
+     * @brief Copies the capture part of the configuration into the camera settings.
+     *
+     * @param settings The camera settings to update.
+     */
+
+    void apply(Libcam2OpenCVSettings &settings) const {
+        settings.width = width;
+        settings.height = height;
+        settings.framerate = framerate;
+    }
+
+private:
+    static void readValue(const cv::FileNode &node, unsigned int &value) {
+        if (!node.empty()) value = (unsigned int)(int)node;
+    }
+
+    static void readValue(const cv::FileNode &node, int &value) {
+        if (!node.empty()) value = (int)node;
+    }
+
+    static void readValue(const cv::FileNode &node, bool &value) {
+        if (!node.empty()) value = (int)node != 0;
+    }
+
+    static void readValue(const cv::FileNode &node, double &value) {
+        if (!node.empty()) value = (double)node;
+    }
+};
+
+#endif
@@ -0,0 +1,287 @@
+/**
+ * @file pipeline.h
+ * @brief Camera callback composed at compile time from processing stages.
+ */
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+// Standard library Header files
+#include <iostream>
+#include <iomanip>
+#include <tuple>
+#include <deque>
+#include <utility>
+#include <type_traits>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <optional>
+
+// Header file for Camera interfacing
+#include "libcam2opencv.h"
+
+/**
+ * @brief Where a pipeline stage runs.
+ */
+
+enum class StageExecution {
+    Inline,     ///< On the thread which delivers the frame, in the order of the stages.
+    Executor    ///< On a thread of its own, fed through a queue.
+};
+
+/**
+ * @struct StageTiming
+ * @brief Time spent in one stage.
+ */
+
+struct StageTiming {
+    unsigned long frames = 0;    ///< Frames the stage has processed.
+    unsigned long dropped = 0;   ///< Frames an executor stage had no room for.
+    double seconds = 0;          ///< Total processing time.
+    double maxSeconds = 0;       ///< Longest processing time of a single frame.
+
+    void add(double s) {
+        frames++;
+        seconds += s;
+        maxSeconds = std::max(maxSeconds, s);
+    }
+};
+
+/**
+ * @brief The execution of a stage, StageExecution::Inline unless it declares
+ * "static constexpr StageExecution execution".
+ */
+
+template<typename Stage, typename = void>
+struct StageExecutionOf : std::integral_constant<StageExecution, StageExecution::Inline> {};
+
+template<typename Stage>
+struct StageExecutionOf<Stage, std::void_t<decltype(Stage::execution)>>
+    : std::integral_constant<StageExecution, Stage::execution> {};
+
+/**
+ * @brief The queue length of an executor stage, 1 unless it declares
+ * "static constexpr size_t queueDepth".
+ */
+
+template<typename Stage, typename = void>
+struct StageQueueDepth : std::integral_constant<size_t, 1> {};
+
+template<typename Stage>
+struct StageQueueDepth<Stage, std::void_t<decltype(Stage::queueDepth)>>
+    : std::integral_constant<size_t, Stage::queueDepth> {};
+
+/**
+ * @class StageSlot
+ * @brief Holds an inline stage of a Pipeline and times it.
+ *
+ * An inline stage has "bool process(Context &)", which returns false to
+ * end the pipeline for this frame, and "static constexpr const char *name".
+ */
+
+template<typename Context, typename Stage, StageExecution = StageExecutionOf<Stage>::value>
+class StageSlot {
+public:
+    explicit StageSlot(Stage &&s) : stage(std::move(s)) {}
+
+    bool run(Context &context) {
+        const auto t0 = std::chrono::steady_clock::now();
+        const bool more = stage.process(context);
+        stats.add(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        return more;
+    }
+
+    StageTiming timing() const {
+        return stats;
+    }
+
+    void stop() {}
+
+    Stage stage;
+
+private:
+    StageTiming stats;
+};
+
+/**
+ * @class StageSlot
+ * @brief Holds an executor stage of a Pipeline, its queue and its thread.
+ *
+ * An executor stage has "std::optional<Job> take(const Context &)",
+ * which runs inline and copies what the stage needs out of the frame,
+ * and "void process(Job &)", which runs on the executor thread.
+ * Anything which points into the camera buffer must be copied by take(),
+ * as the buffer goes back to the camera when the pipeline returns. An
+ * empty optional skips the frame, so a stage can ignore most frames
+ * cheaply. When the queue of queueDepth jobs is full the oldest one is
+ * dropped, so a slow stage never holds up the camera.
+ */
+
+template<typename Context, typename Stage>
+class StageSlot<Context, Stage, StageExecution::Executor> {
+public:
+    using Job = typename decltype(std::declval<Stage &>().take(std::declval<const Context &>()))::value_type;
+
+    explicit StageSlot(Stage &&s) : stage(std::move(s)) {
+        thread = std::thread(&StageSlot::loop, this);
+    }
+
+    ~StageSlot() {
+        stop();
+    }
+
+    bool run(Context &context) {
+        std::optional<Job> job = stage.take(context);
+        if (!job) return true;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (quit) return true;
+            if (queue.size() >= StageQueueDepth<Stage>::value) {
+                queue.pop_front();
+                stats.dropped++;
+            }
+            queue.push_back(std::move(*job));
+        }
+        cond.notify_one();
+        return true;
+    }
+
+    StageTiming timing() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    /**
+     * @brief Processes what is still queued and ends the thread.
+     */
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cond.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+
+    Stage stage;
+
+private:
+    mutable std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Job> queue;
+    StageTiming stats;
+    bool quit = false;
+    std::thread thread;
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cond.wait(lock, [this]{ return quit || !queue.empty(); });
+            if (queue.empty()) return;
+            Job job = std::move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            const auto t0 = std::chrono::steady_clock::now();
+            stage.process(job);
+            const double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            lock.lock();
+            stats.add(s);
+        }
+    }
+};
+
+/**
+ * @class Pipeline
+ * @brief A Libcam2OpenCV::Callback which passes each frame through Stages in order.
+ *
+ * The stages are template parameters, so the only virtual call per frame
+ * is the one into the pipeline and the stages inline into it. Each frame
+ * is wrapped in a Context, constructed from the frame view and its
+ * metadata, which the stages fill in for the ones after them, for
+ * example capture, convert, detect, decide and actuate. Stages which
+ * only watch, such as the preview or the logging, can run on an
+ * executor thread of their own; see StageSlot for what a stage provides.
+ *
+ * Every stage is timed, timings() prints frames, mean and worst time
+ * per stage. The pipeline can be subclassed for the watchdog callbacks.
+ */
+
+template<typename Context, typename... Stages>
+class Pipeline : public Libcam2OpenCV::Callback {
+public:
+    explicit Pipeline(Stages... stages) : slots(std::move(stages)...) {}
+
+    /**
+     * @brief Wraps the BGR frame and passes it through the stages.
+     */
+
+    virtual void hasFrame(const cv::Mat &frame, const libcamera::ControlList &metadata) {
+        hasFrameView(Libcam2OpenCVFrame::fromBgr(frame), metadata);
+    }
+
+    /**
+     * @brief Passes the frame through the stages until one of them ends it.
+     */
+
+    virtual void hasFrameView(const Libcam2OpenCVFrame &view, const libcamera::ControlList &metadata) {
+        const auto t0 = std::chrono::steady_clock::now();
+        Context context(view, metadata);
+        runFrom<0>(context);
+        total.add(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    /**
+     * @brief The stage of type Stage.
+     */
+
+    template<typename Stage>
+    Stage &stage() {
+        return std::get<StageSlot<Context, Stage>>(slots).stage;
+    }
+
+    /**
+     * @brief Lets the executor stages finish their queues and stops them.
+     */
+
+    void stop() {
+        std::apply([](auto &... slot) { (slot.stop(), ...); }, slots);
+    }
+
+    /**
+     * @brief Prints the time spent in each stage and in the whole pipeline.
+     */
+
+    void timings(std::ostream &out) const {
+        out << "Stage         frames  dropped  mean ms   max ms" << std::endl;
+        std::apply([&out](const auto &... slot) {
+            (print(out, std::decay_t<decltype(slot.stage)>::name, slot.timing()), ...);
+        }, slots);
+        print(out, "pipeline", total);
+    }
+
+private:
+    std::tuple<StageSlot<Context, Stages>...> slots;
+    StageTiming total;
+
+    template<size_t I>
+    void runFrom(Context &context) {
+        if constexpr (I < sizeof...(Stages)) {
+            if (std::get<I>(slots).run(context)) runFrom<I + 1>(context);
+        }
+    }
+
+    static void print(std::ostream &out, const char *name, const StageTiming &t) {
+        const auto flags = out.flags();
+        out << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(2)
+            << "  " << std::setw(6) << t.frames << "  " << std::setw(7) << t.dropped
+            << "  " << std::setw(7) << (t.frames ? t.seconds / t.frames * 1000 : 0.0)
+            << "  " << std::setw(7) << t.maxSeconds * 1000 << std::endl;
+        out.flags(flags);
+    }
+};
+
+#endif
@@ -0,0 +1,289 @@
+/**
+ * @file preview_server.h
+ * @brief HTTP MJPEG preview of the camera with the detected face and eye boxes.
+ */
+
+#ifndef __PREVIEW_SERVER_H
+#define __PREVIEW_SERVER_H
+
+// Standard library Header files
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+/**
+ * @class PreviewServer
+ * @brief Serves the annotated camera image as multipart JPEG over HTTP.
+ *
+ * The preview shows the driver's face and has no authentication, so it
+ * only listens on the loopback address unless another one is given, for
+ * example the link-local address of the interface a laptop is plugged
+ * into ("fe80::1%eth0") or "::" for all of them. With the default an ssh
+ * tunnel reaches it. Open http://<address>:<port>/ in a browser. Each
+ * preview frame is drawn and encoded once by the encoder thread and the
+ * same JPEG buffer is sent to every client. The preview rate is limited
+ * by maxFps independently of the capture rate. wantsFrame() is a pair of
+ * atomic loads, so with no client connected the camera path pays nothing.
+ */
+
+class PreviewServer {
+public:
+    /**
+     * @brief Starts listening.
+     *
+     * @param port TCP port to listen on.
+     * @param address Numeric address to listen on, the loopback address by default.
+     * @param maxFps Maximum preview framerate.
+     * @param width Width of the preview image, the frame is scaled down to it.
+     */
+
+    PreviewServer(int port = 8080, const std::string &address = "::1", double maxFps = 5, int width = 640) :
+        interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / maxFps))),
+        previewWidth(width) {
+        // numeric only, a link-local address carries its interface as "%eth0"
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+        struct addrinfo *ai = nullptr;
+        const int err = getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &ai);
+        if (err != 0) {
+            std::cerr << "Preview: can't use address " << address << ": " << gai_strerror(err) << std::endl;
+            return;
+        }
+        listenFd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            std::cerr << "Preview: can't create socket: " << strerror(errno) << std::endl;
+            freeaddrinfo(ai);
+            return;
+        }
+        int on = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        const bool bound = (bind(listenFd, ai->ai_addr, ai->ai_addrlen) == 0) && (listen(listenFd, 4) == 0);
+        freeaddrinfo(ai);
+        if (!bound) {
+            std::cerr << "Preview: can't listen on " << address << " port " << port << ": " << strerror(errno) << std::endl;
+            close(listenFd);
+            listenFd = -1;
+            return;
+        }
+        acceptThread = std::thread(&PreviewServer::acceptLoop, this);
+        encodeThread = std::thread(&PreviewServer::encodeLoop, this);
+        const bool v6 = address.find(':') != std::string::npos;
+        std::cout << "Preview on http://" << (v6 ? "[" : "") << address << (v6 ? "]" : "") << ":" << port << "/" << std::endl;
+    }
+
+    /**
+     * @brief Disconnects all clients and stops the threads.
+     */
+
+    ~PreviewServer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cond.notify_all();
+        if (acceptThread.joinable()) acceptThread.join();
+        if (encodeThread.joinable()) encodeThread.join();
+        for (auto &c : clientThreads) c.thread.join();
+        if (listenFd >= 0) close(listenFd);
+    }
+
+    /**
+     * @brief Checks if a new preview frame is due.
+     *
+     * @return Returns true if a client is connected and the preview interval has passed.
+     */
+
+    bool wantsFrame() const {
+        if (clients.load(std::memory_order_relaxed) == 0) return false;
+        const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+        return now - lastSubmit.load(std::memory_order_relaxed) >= interval.count();
+    }
+
+    /**
+     * @brief Hands a frame to the encoder thread.
+     *
+     * Only a reference is kept, the frame must not be written to afterwards.
+     * A frame which hasn't been encoded yet is replaced by the new one.
+     *
+     * @param frame The camera frame.
+     * @param faces Face boxes to draw, in frame coordinates.
+     * @param eyes Eye boxes to draw, in frame coordinates.
+     */
+
+    void submit(const cv::Mat &frame, const std::vector<cv::Rect> &faces, const std::vector<cv::Rect> &eyes) {
+        lastSubmit = std::chrono::steady_clock::now().time_since_epoch().count();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            rawFrame = frame;
+            rawFaces = faces;
+            rawEyes = eyes;
+            hasRaw = true;
+        }
+        cond.notify_all();
+    }
+
+private:
+    const std::chrono::steady_clock::duration interval;
+    const int previewWidth;
+    int listenFd = -1;
+    std::atomic<int> clients{0};
+    std::atomic<std::chrono::steady_clock::rep> lastSubmit{0};
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool quit = false;
+    cv::Mat rawFrame;
+    std::vector<cv::Rect> rawFaces, rawEyes;
+    bool hasRaw = false;
+    std::shared_ptr<const std::vector<unsigned char>> jpeg;
+    unsigned long jpegSequence = 0;
+
+    std::thread acceptThread;
+    std::thread encodeThread;
+    struct Client {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+    std::vector<Client> clientThreads;
+    static constexpr int maxClients = 4;
+
+    void acceptLoop() {
+        for (;;) {
+            struct pollfd pfd = { listenFd, POLLIN, 0 };
+            int r = poll(&pfd, 1, 200);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (quit) return;
+            }
+            if (r <= 0) continue;
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;
+            if (clients >= maxClients) {
+                close(fd);
+                continue;
+            }
+            // don't let a stalled client hold up the shutdown
+            struct timeval timeout = { 2, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            clients++;
+            std::lock_guard<std::mutex> lock(mutex);
+            // reap the clients which have disconnected
+            for (auto it = clientThreads.begin(); it != clientThreads.end();) {
+                if (*it->done) {
+                    it->thread.join();
+                    it = clientThreads.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            Client c;
+            c.done = std::make_shared<std::atomic<bool>>(false);
+            c.thread = std::thread(&PreviewServer::clientLoop, this, fd, c.done);
+            clientThreads.push_back(std::move(c));
+        }
+    }
+
+    void encodeLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cond.wait(lock, [this]{ return quit || hasRaw; });
+            if (quit) return;
+            cv::Mat frame = rawFrame;
+            std::vector<cv::Rect> faces = rawFaces, eyes = rawEyes;
+            rawFrame.release();
+            hasRaw = false;
+            lock.unlock();
+
+            // scaling gives us our own copy to draw on
+            const double scale = (frame.cols > previewWidth) ? (double)previewWidth / frame.cols : 1.0;
+            cv::Mat preview;
+            cv::resize(frame, preview, cv::Size(), scale, scale, cv::INTER_AREA);
+            frame.release();
+            for (const auto &r : faces)
+                cv::rectangle(preview, scaleRect(r, scale), cv::Scalar(255, 0, 0), 2);
+            for (const auto &r : eyes)
+                cv::rectangle(preview, scaleRect(r, scale), cv::Scalar(0, 255, 0), 2);
+            auto buf = std::make_shared<std::vector<unsigned char>>();
+            cv::imencode(".jpg", preview, *buf, { cv::IMWRITE_JPEG_QUALITY, 70 });
+
+            lock.lock();
+            jpeg = buf;
+            jpegSequence++;
+            cond.notify_all();
+        }
+    }
+
+    void clientLoop(int fd, std::shared_ptr<std::atomic<bool>> done) {
+        static const char header[] =
+            "HTTP/1.0 200 OK\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Connection: close\r\n"
+            "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+        // the request itself doesn't matter, every path gets the stream
+        char request[1024];
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) > 0) {
+            ssize_t r = recv(fd, request, sizeof(request), 0);
+            (void)r;
+        }
+        bool ok = sendAll(fd, header, sizeof(header) - 1);
+        unsigned long sent = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (ok) {
+            cond.wait(lock, [this, sent]{ return quit || (jpeg && jpegSequence != sent); });
+            if (quit) break;
+            std::shared_ptr<const std::vector<unsigned char>> buf = jpeg;
+            sent = jpegSequence;
+            lock.unlock();
+            std::string part = "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: " +
+                std::to_string(buf->size()) + "\r\n\r\n";
+            ok = sendAll(fd, part.data(), part.size()) &&
+                 sendAll(fd, buf->data(), buf->size()) &&
+                 sendAll(fd, "\r\n", 2);
+            lock.lock();
+        }
+        lock.unlock();
+        close(fd);
+        clients--;
+        *done = true;
+    }
+
+    static cv::Rect scaleRect(const cv::Rect &r, double scale) {
+        return cv::Rect(cvRound(r.x * scale), cvRound(r.y * scale),
+                        cvRound(r.width * scale), cvRound(r.height * scale));
+    }
+
+    static bool sendAll(int fd, const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t r = send(fd, p, size, MSG_NOSIGNAL);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            p += r;
+            size -= r;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,110 @@
+// Header file for input output functions
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+// Header files for the harness and the stored configuration
+#include "regression.h"
+#include "monitor_config.h"
+
+/**********************************************************************/
+
+/**
+ * @brief Regression harness of the eye monitor.
+ *
+ * Usage: eye-regress <manifest.yml> [--baseline <file>] [--write-baseline <file>] [--config <file>]
+ *
+ * The manifest lists the labelled clips:
+ *
+ *     clips:
+ *       - { clip: "drive1.rec", labels: "drive1.csv" }
+ *
+ * Relative paths are relative to the manifest. The result is compared
+ * with the baseline, if one is given, and the program exits with 1 if
+ * anything has regressed beyond the tolerances stored in the baseline.
+ * "--write-baseline" stores the result as a new baseline. "--config"
+ * tests the detector parameters of a configuration written by
+ * "eye --calibrate". No camera, GPIO or sound device is needed.
+ *
+ * @return Returns 0 if there's no regression, 1 on a regression and 2 on an error.
+ */
+
+int main(int argc, char *argv[]) {
+    std::string manifest, baselinePath, writePath, configPath;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if ((arg == "--baseline") && (i + 1 < argc)) {
+            baselinePath = argv[++i];
+        } else if ((arg == "--write-baseline") && (i + 1 < argc)) {
+            writePath = argv[++i];
+        } else if ((arg == "--config") && (i + 1 < argc)) {
+            configPath = argv[++i];
+        } else if (manifest.empty() && (arg[0] != '-')) {
+            manifest = arg;
+        } else {
+            manifest.clear();
+            break;
+        }
+    }
+    if (manifest.empty()) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <manifest.yml> [--baseline <file>] [--write-baseline <file>] [--config <file>]" << std::endl;
+        return 2;
+    }
+
+    RegressionHarness harness;
+    if (!configPath.empty()) {
+        MonitorConfig config;
+        if (!config.load(configPath)) {
+            std::cerr << "Cannot read " << configPath << std::endl;
+            return 2;
+        }
+        harness.detection = config.detection;
+    }
+
+    cv::FileStorage fs(manifest, cv::FileStorage::READ);
+    if (!fs.isOpened()) {
+        std::cerr << "Cannot read " << manifest << std::endl;
+        return 2;
+    }
+    const size_t slash = manifest.find_last_of('/');
+    const std::string dir = (slash == std::string::npos) ? "" : manifest.substr(0, slash + 1);
+    auto resolve = [&dir](const std::string &path) {
+        return (path.empty() || path[0] == '/') ? path : dir + path;
+    };
+    const cv::FileNode clips = fs["clips"];
+    if (clips.empty()) {
+        std::cerr << "No clips in " << manifest << std::endl;
+        return 2;
+    }
+    for (const auto &clip : clips) {
+        const std::string clipPath = resolve((std::string)clip["clip"]);
+        const std::string labelPath = resolve((std::string)clip["labels"]);
+        std::cout << "Running " << clipPath << std::endl;
+        if (!harness.runClip(clipPath, labelPath)) {
+            return 2;
+        }
+    }
+
+    const RegressionResult result = harness.result();
+    result.print(std::cout);
+
+    RegressionTolerance tolerance;
+    bool ok = true;
+    if (!baselinePath.empty()) {
+        RegressionResult baseline;
+        if (!baseline.load(baselinePath, tolerance)) {
+            std::cerr << "Cannot read baseline " << baselinePath << std::endl;
+            return 2;
+        }
+        ok = result.compare(baseline, tolerance, std::cout);
+        std::cout << (ok ? "No regression" : "Regression against the baseline") << std::endl;
+    }
+    if (!writePath.empty() && !result.save(writePath, tolerance)) {
+        return 2;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,459 @@
+/**
+ * @file regression.h
+ * @brief Runs the detection and alert pipeline on labelled clips and compares the result with a baseline.
+ */
+
+#ifndef __REGRESSION_H
+#define __REGRESSION_H
+
+// Standard library Header files
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+
+// Header files for the camera library and the recordings
+#include "libcam2opencv.h"
+#include "framerecorder.h"
+#include <libcamera/libcamera.h>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+#include "eye_detection.h"
+#include "alert_logic.h"
+
+/**
+ * @struct RegressionTolerance
+ * @brief How far a result may fall behind the baseline before it counts as a regression.
+ */
+
+struct RegressionTolerance {
+    double quality = 0.02;      ///< Accepted absolute drop of precision and recall.
+    double leadTimeMs = 50;     ///< Accepted loss of alarm lead time in milliseconds.
+    double latency = 0.25;      ///< Accepted relative increase of the frame latency.
+    double throughput = 0.25;   ///< Accepted relative loss of throughput.
+};
+
+/**
+ * @struct RegressionResult
+ * @brief Accuracy, alarm timing and speed of the pipeline over all clips.
+ *
+ * A positive frame is one where the driver's open eyes can't be seen:
+ * no face, or the eyes closed. precision and recall compare that with
+ * "no eyes detected". An alarm episode is a run of at least buzzerFrames
+ * positive frames; its ideal alarm is on the buzzerFrames'th frame. The
+ * lead time is how much earlier than that the pipeline raised the alarm,
+ * negative if it was late.
+ */
+
+struct RegressionResult {
+    unsigned long frames = 0;     ///< Frames processed.
+    double facePrecision = 0;     ///< Frames with a face found which have a face.
+    double faceRecall = 0;        ///< Frames with a face in which it was found.
+    double precision = 0;         ///< Frames without eyes detected which are positive.
+    double recall = 0;            ///< Positive frames without eyes detected.
+    unsigned long episodes = 0;   ///< Alarm episodes in the labels.
+    unsigned long alarms = 0;     ///< Alarms raised by the pipeline.
+    double alarmPrecision = 0;    ///< Alarms raised within an episode.
+    double alarmRecall = 0;       ///< Episodes with an alarm.
+    double leadTimeMs = 0;        ///< Mean alarm lead time of the episodes with an alarm.
+    double p50Ms = 0;             ///< Median frame latency.
+    double p99Ms = 0;             ///< 99th percentile of the frame latency.
+    double fps = 0;               ///< Frames processed per second.
+
+    /**
+     * @brief Prints the result.
+     */
+
+    void print(std::ostream &os) const {
+        os << "Frames:          " << frames << std::endl
+           << "Face:            precision " << facePrecision << ", recall " << faceRecall << std::endl
+           << "Eyes not open:   precision " << precision << ", recall " << recall << std::endl
+           << "Alarms:          " << alarms << " for " << episodes << " episodes, precision "
+           << alarmPrecision << ", recall " << alarmRecall << std::endl
+           << "Alarm lead time: " << leadTimeMs << " ms" << std::endl
+           << "Latency:         p50 " << p50Ms << " ms, p99 " << p99Ms << " ms" << std::endl
+           << "Throughput:      " << fps << " fps" << std::endl;
+    }
+
+    /**
+     * @brief Writes the result and the tolerances as a baseline.
+     *
+     * @param path Path of the YAML file.
+     * @param tolerance Tolerances stored with the baseline.
+     * @return Returns false if the file can't be written.
+     */
+
+    bool save(const std::string &path, const RegressionTolerance &tolerance) const {
+        cv::FileStorage fs(path, cv::FileStorage::WRITE);
+        if (!fs.isOpened()) {
+            std::cerr << "Cannot write " << path << std::endl;
+            return false;
+        }
+        fs << "frames" << (int)frames;
+        fs << "facePrecision" << facePrecision;
+        fs << "faceRecall" << faceRecall;
+        fs << "precision" << precision;
+        fs << "recall" << recall;
+        fs << "alarmPrecision" << alarmPrecision;
+        fs << "alarmRecall" << alarmRecall;
+        fs << "leadTimeMs" << leadTimeMs;
+        fs << "p50Ms" << p50Ms;
+        fs << "p99Ms" << p99Ms;
+        fs << "fps" << fps;
+        fs << "tolerance" << "{";
+        fs << "quality" << tolerance.quality;
+        fs << "leadTimeMs" << tolerance.leadTimeMs;
+        fs << "latency" << tolerance.latency;
+        fs << "throughput" << tolerance.throughput;
+        fs << "}";
+        return true;
+    }
+
+    /**
+     * @brief Reads a baseline.
+     *
+     * @param path Path of the YAML file.
+     * @param tolerance Receives the tolerances stored with the baseline, if any.
+     * @return Returns false if the file can't be read.
+     */
+
+    bool load(const std::string &path, RegressionTolerance &tolerance) {
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (!fs.isOpened()) {
+            return false;
+        }
+        frames = (int)fs["frames"];
+        facePrecision = (double)fs["facePrecision"];
+        faceRecall = (double)fs["faceRecall"];
+        precision = (double)fs["precision"];
+        recall = (double)fs["recall"];
+        alarmPrecision = (double)fs["alarmPrecision"];
+        alarmRecall = (double)fs["alarmRecall"];
+        leadTimeMs = (double)fs["leadTimeMs"];
+        p50Ms = (double)fs["p50Ms"];
+        p99Ms = (double)fs["p99Ms"];
+        fps = (double)fs["fps"];
+        const cv::FileNode tol = fs["tolerance"];
+        if (!tol.empty()) {
+            if (!tol["quality"].empty()) tolerance.quality = (double)tol["quality"];
+            if (!tol["leadTimeMs"].empty()) tolerance.leadTimeMs = (double)tol["leadTimeMs"];
+            if (!tol["latency"].empty()) tolerance.latency = (double)tol["latency"];
+            if (!tol["throughput"].empty()) tolerance.throughput = (double)tol["throughput"];
+        }
+        return true;
+    }
+
+    /**
+     * @brief Compares the result with a baseline.
+     *
+     * @param baseline The stored result.
+     * @param tolerance How much worse than the baseline is accepted.
+     * @param os Receives one line per regression.
+     * @return Returns true if nothing has regressed.
+     */
+
+    bool compare(const RegressionResult &baseline, const RegressionTolerance &tolerance, std::ostream &os) const {
+        bool ok = true;
+        auto lower = [&](const char *name, double value, double base, double allowed) {
+            if (value < base - allowed) {
+                os << "REGRESSION " << name << ": " << value << " < baseline " << base << std::endl;
+                ok = false;
+            }
+        };
+        auto higher = [&](const char *name, double value, double base, double allowed) {
+            if (value > base + allowed) {
+                os << "REGRESSION " << name << ": " << value << " > baseline " << base << std::endl;
+                ok = false;
+            }
+        };
+        lower("face precision", facePrecision, baseline.facePrecision, tolerance.quality);
+        lower("face recall", faceRecall, baseline.faceRecall, tolerance.quality);
+        lower("precision", precision, baseline.precision, tolerance.quality);
+        lower("recall", recall, baseline.recall, tolerance.quality);
+        lower("alarm precision", alarmPrecision, baseline.alarmPrecision, tolerance.quality);
+        lower("alarm recall", alarmRecall, baseline.alarmRecall, tolerance.quality);
+        lower("alarm lead time", leadTimeMs, baseline.leadTimeMs, tolerance.leadTimeMs);
+        higher("p50 latency", p50Ms, baseline.p50Ms, baseline.p50Ms * tolerance.latency);
+        higher("p99 latency", p99Ms, baseline.p99Ms, baseline.p99Ms * tolerance.latency);
+        lower("throughput", fps, baseline.fps, baseline.fps * tolerance.throughput);
+        return ok;
+    }
+};
+
+/**
+ * @class RegressionHarness
+ * @brief Feeds labelled clips through EyeDetection and AlertLogic without camera, GPIO or sound.
+ *
+ * A clip is either a recording made with "eye --record" or a video file
+ * readable by OpenCV. Its labels are a CSV file with one line per frame:
+ * "frame,face,eyes" where face is 1 or 0 and eyes is 1 for open, 0 for
+ * closed or "-" if unknown. Lines starting with '#' and a header line are
+ * skipped, frames without a line are not scored. The latency is the time
+ * of EyeDetection::Frame() and AlertLogic::update() per frame; decoding
+ * the clip isn't included.
+ */
+
+class RegressionHarness {
+public:
+    DetectionSettings detection;   ///< Cascade parameters under test.
+    int buzzerFrames = 4;          ///< Frames without eyes before the alarm.
+    int relayFrames = 20;          ///< Frames without eyes before the eCall.
+
+    /**
+     * @brief Runs one clip and scores it against its labels.
+     *
+     * @param clipPath Path of the recording or video file.
+     * @param labelPath Path of the label CSV file.
+     * @return Returns false if the clip or the labels can't be read.
+     */
+
+    bool runClip(const std::string &clipPath, const std::string &labelPath) {
+        std::vector<Label> labels;
+        if (!loadLabels(labelPath, labels)) {
+            std::cerr << "Cannot read labels " << labelPath << std::endl;
+            return false;
+        }
+        std::vector<Outcome> outcomes;
+        if (!runRecording(clipPath, outcomes) && !runVideo(clipPath, outcomes)) {
+            std::cerr << "Cannot read clip " << clipPath << std::endl;
+            return false;
+        }
+        score(labels, outcomes);
+        return true;
+    }
+
+    /**
+     * @brief Returns the result over all clips run so far.
+     */
+
+    RegressionResult result() const {
+        RegressionResult r;
+        r.frames = latencies.size();
+        r.facePrecision = ratio(faceTP, faceTP + faceFP);
+        r.faceRecall = ratio(faceTP, faceTP + faceFN);
+        r.precision = ratio(closedTP, closedTP + closedFP);
+        r.recall = ratio(closedTP, closedTP + closedFN);
+        r.episodes = episodes;
+        r.alarms = alarms;
+        r.alarmPrecision = ratio(alarmsInEpisode, alarms);
+        r.alarmRecall = ratio(episodesAlarmed, episodes);
+        r.leadTimeMs = episodesAlarmed > 0 ? leadTimeSum / episodesAlarmed * 1000 : 0;
+        std::vector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        r.p50Ms = percentile(sorted, 0.50) * 1000;
+        r.p99Ms = percentile(sorted, 0.99) * 1000;
+        double total = 0;
+        for (double l : latencies) total += l;
+        r.fps = total > 0 ? latencies.size() / total : 0;
+        return r;
+    }
+
+    /**
+     * @struct Label
+     * @brief The label of one frame.
+     */
+
+    struct Label {
+        int face = -1;   ///< 1, 0 or -1 for no label.
+        int eyes = -1;   ///< 1 open, 0 closed, -1 unknown.
+    };
+
+    /**
+     * @struct Outcome
+     * @brief What the pipeline decided for one frame.
+     */
+
+    struct Outcome {
+        double time;     ///< Seconds from the start of the clip.
+        bool face;       ///< A face was found.
+        bool eyes;       ///< Eyes were detected.
+        bool alarm;      ///< The alarm was raised.
+    };
+
+    /**
+     * @brief Reads a label CSV file, see the class description.
+     *
+     * @param path Path of the label file.
+     * @param labels The labels, indexed by frame.
+     * @return Returns false if the file can't be read.
+     */
+
+    static bool loadLabels(const std::string &path, std::vector<Label> &labels) {
+        std::ifstream in(path);
+        if (!in) return false;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            std::replace(line.begin(), line.end(), ',', ' ');
+            std::istringstream fields(line);
+            long frame;
+            std::string face, eyes;
+            // the header line doesn't start with a number
+            if (!(fields >> frame >> face >> eyes) || (frame < 0)) continue;
+            if ((size_t)frame >= labels.size()) labels.resize(frame + 1);
+            labels[frame].face = (face == "1") ? 1 : (face == "0") ? 0 : -1;
+            labels[frame].eyes = (eyes == "1") ? 1 : (eyes == "0") ? 0 : -1;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Scores the outcomes of one clip against its labels and adds them to the result.
+     *
+     * runClip() calls it with the outcomes of the pipeline; it can also be
+     * given synthetic outcomes to check the scoring itself.
+     */
+
+    void score(const std::vector<Label> &labels, const std::vector<Outcome> &outcomes) {
+        const size_t n = std::min(labels.size(), outcomes.size());
+        for (size_t i = 0; i < n; i++) {
+            const Label &l = labels[i];
+            const Outcome &o = outcomes[i];
+            if (l.face >= 0) {
+                if (o.face && l.face) faceTP++;
+                else if (o.face) faceFP++;
+                else if (l.face) faceFN++;
+            }
+            const int p = positive(l);
+            if (p >= 0) {
+                if (!o.eyes && p) closedTP++;
+                else if (!o.eyes) closedFP++;
+                else if (p) closedFN++;
+            }
+        }
+
+        // the alarm episodes of the labels
+        struct Episode {
+            size_t first, last, ideal;
+            bool alarmed;
+        };
+        std::vector<Episode> clipEpisodes;
+        for (size_t i = 0; i < n;) {
+            if (positive(labels[i]) != 1) {
+                i++;
+                continue;
+            }
+            size_t j = i;
+            while ((j < n) && (positive(labels[j]) == 1)) j++;
+            if (j - i >= (size_t)buzzerFrames) {
+                clipEpisodes.push_back({ i, j - 1, i + buzzerFrames - 1, false });
+            }
+            i = j;
+        }
+        episodes += clipEpisodes.size();
+
+        for (size_t i = 0; i < n; i++) {
+            if (!outcomes[i].alarm) continue;
+            alarms++;
+            for (Episode &e : clipEpisodes) {
+                if ((i < e.first) || (i > e.last)) continue;
+                alarmsInEpisode++;
+                // only the first alarm of an episode counts for the lead time
+                if (!e.alarmed) {
+                    e.alarmed = true;
+                    episodesAlarmed++;
+                    leadTimeSum += outcomes[e.ideal].time - outcomes[i].time;
+                }
+                break;
+            }
+        }
+    }
+
+private:
+    unsigned long faceTP = 0, faceFP = 0, faceFN = 0;
+    unsigned long closedTP = 0, closedFP = 0, closedFN = 0;
+    unsigned long episodes = 0, episodesAlarmed = 0;
+    unsigned long alarms = 0, alarmsInEpisode = 0;
+    double leadTimeSum = 0;
+    std::vector<double> latencies;
+
+    /**
+     * @brief Runs one frame through the pipeline like the eye monitor does.
+     */
+
+    void process(EyeDetection &detector, AlertLogic &alert, cv::Mat &grey,
+                 const libcamera::ControlList &metadata, double time, std::vector<Outcome> &outcomes) {
+        const auto t0 = std::chrono::steady_clock::now();
+        const bool eyes = detector.Frame(grey, metadata, (int)outcomes.size());
+        const AlertState &state = alert.update(eyes);
+        const auto t1 = std::chrono::steady_clock::now();
+        latencies.push_back(std::chrono::duration<double>(t1 - t0).count());
+        outcomes.push_back({ time, detector.lastFaceCount() > 0, eyes, state.alarm });
+    }
+
+    bool runRecording(const std::string &path, std::vector<Outcome> &outcomes) {
+        FrameReplay replay;
+        if (replay.open(path) < 0) return false;
+
+        struct Runner : Libcam2OpenCV::Callback {
+            RegressionHarness *harness;
+            EyeDetection detector;
+            AlertLogic alert;
+            std::vector<Outcome> *outcomes;
+            int64_t t0 = -1;
+            Runner(int buzzerFrames, int relayFrames) : alert(buzzerFrames, relayFrames) {}
+            virtual void hasFrame(const cv::Mat &frame, const libcamera::ControlList &metadata) {
+                hasFrameView(Libcam2OpenCVFrame::fromBgr(frame), metadata);
+            }
+            virtual void hasFrameView(const Libcam2OpenCVFrame &view, const libcamera::ControlList &metadata) {
+                const auto ts = metadata.get(libcamera::controls::SensorTimestamp);
+                const int64_t t = ts ? *ts : 0;
+                if (t0 < 0) t0 = t;
+                cv::Mat grey = view.grey();
+                harness->process(detector, alert, grey, metadata, (t - t0) / 1e9, *outcomes);
+            }
+        } runner(buzzerFrames, relayFrames);
+        runner.harness = this;
+        runner.detector.setSettings(detection);
+        runner.outcomes = &outcomes;
+        replay.registerCallback(&runner);
+        // frame by frame on this thread, as fast as possible
+        for (size_t i = 0; i < replay.size(); i++) {
+            replay.deliver(i);
+        }
+        return true;
+    }
+
+    bool runVideo(const std::string &path, std::vector<Outcome> &outcomes) {
+        cv::VideoCapture clip(path);
+        if (!clip.isOpened()) return false;
+        double fps = clip.get(cv::CAP_PROP_FPS);
+        if (!(fps > 0)) fps = 30;
+        EyeDetection detector;
+        detector.setSettings(detection);
+        AlertLogic alert(buzzerFrames, relayFrames);
+        const libcamera::ControlList metadata;
+        cv::Mat frame, grey;
+        while (clip.read(frame)) {
+            cv::cvtColor(frame, grey, cv::COLOR_BGR2GRAY);
+            process(detector, alert, grey, metadata, outcomes.size() / fps, outcomes);
+        }
+        return true;
+    }
+
+    /*
+     * 1 if the open eyes can't be seen, 0 if they can, -1 if the label doesn't tell
+     */
+    static int positive(const Label &l) {
+        if (l.face == 0) return 1;
+        if (l.face == 1 && l.eyes >= 0) return l.eyes == 0 ? 1 : 0;
+        return -1;
+    }
+
+    static double ratio(unsigned long a, unsigned long b) {
+        return b > 0 ? (double)a / b : 1.0;
+    }
+
+    static double percentile(const std::vector<double> &sorted, double q) {
+        if (sorted.empty()) return 0;
+        size_t i = (size_t)std::ceil(q * sorted.size());
+        return sorted[std::min(sorted.size() - 1, i > 0 ? i - 1 : 0)];
+    }
+};
+
+#endif
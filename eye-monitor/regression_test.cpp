@@ -0,0 +1,110 @@
+// Header file for input output functions
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cmath>
+
+// Header file for the harness
+#include "regression.h"
+
+/**********************************************************************/
+
+namespace {
+    int failures = 0;
+
+    void check(const char *name, double value, double expected) {
+        if (std::fabs(value - expected) > 1e-9) {
+            std::cerr << "FAIL " << name << ": " << value << " instead of " << expected << std::endl;
+            failures++;
+        }
+    }
+}
+
+/**
+ * @brief Checks the scoring of the regression harness without any clip.
+ *
+ * Usage: eye-regress-test [labels.csv]
+ *
+ * A synthetic label file of 40 frames at 20 fps is written, read back
+ * and scored against synthetic outcomes with a known number of hits,
+ * misses and false alarms:
+ *
+ *     frames 10-17  eyes closed, an alarm episode whose ideal alarm is frame 13
+ *     frames 25-26  eyes closed, too short for an alarm
+ *     frames 30-31  no face
+ *     frame 5 and 35-39  eyes unknown
+ *
+ * The pipeline misses the face in frames 3 and 31 and sees one in 30, sees
+ * open eyes in the closed frame 12 and none in the open frames 3 and 20,
+ * and raises the alarm in frames 12 (one frame early) and 21 (a false
+ * alarm).
+ *
+ * @return Returns 0 if the scores are the expected ones, 1 otherwise.
+ */
+
+int main(int argc, char *argv[]) {
+    const std::string labelPath = (argc > 1) ? argv[1] : "regression_test_labels.csv";
+    const size_t n = 40;
+    auto closed = [](size_t i) { return ((i >= 10) && (i <= 17)) || (i == 25) || (i == 26); };
+    auto noFace = [](size_t i) { return (i == 30) || (i == 31); };
+    auto unknown = [](size_t i) { return (i == 5) || (i >= 35); };
+    {
+        std::ofstream out(labelPath);
+        out << "# synthetic labels" << std::endl << "frame,face,eyes" << std::endl;
+        for (size_t i = 0; i < n; i++) {
+            out << i << "," << (noFace(i) ? 0 : 1) << ","
+                << (noFace(i) ? "-" : unknown(i) ? "-" : closed(i) ? "0" : "1") << std::endl;
+        }
+        if (!out) {
+            std::cerr << "Cannot write " << labelPath << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<RegressionHarness::Label> labels;
+    if (!RegressionHarness::loadLabels(labelPath, labels) || (labels.size() != n)) {
+        std::cerr << "FAIL labels: " << labels.size() << " frames read from " << labelPath << std::endl;
+        return 1;
+    }
+
+    std::vector<RegressionHarness::Outcome> outcomes;
+    for (size_t i = 0; i < n; i++) {
+        const bool face = (i != 3) && (i != 31);
+        const bool eyes = face && !noFace(i) && ((!closed(i) && (i != 20)) || (i == 12));
+        outcomes.push_back({ i * 0.05, face, eyes, (i == 12) || (i == 21) });
+    }
+
+    RegressionHarness harness;
+    harness.buzzerFrames = 4;
+    harness.score(labels, outcomes);
+    const RegressionResult r = harness.result();
+    r.print(std::cout);
+
+    check("face precision", r.facePrecision, 37.0 / 38);
+    check("face recall", r.faceRecall, 37.0 / 38);
+    check("precision", r.precision, 11.0 / 13);
+    check("recall", r.recall, 11.0 / 12);
+    check("episodes", r.episodes, 1);
+    check("alarms", r.alarms, 2);
+    check("alarm precision", r.alarmPrecision, 0.5);
+    check("alarm recall", r.alarmRecall, 1);
+    check("lead time", r.leadTimeMs, 50);
+
+    // the same result passes against itself, lost lead time fails
+    const RegressionTolerance tolerance;
+    if (!r.compare(r, tolerance, std::cout)) {
+        std::cerr << "FAIL compare: the result regresses against itself" << std::endl;
+        failures++;
+    }
+    RegressionResult better = r;
+    better.alarmRecall = 1;
+    better.leadTimeMs = r.leadTimeMs + 2 * tolerance.leadTimeMs;
+    if (r.compare(better, tolerance, std::cout)) {
+        std::cerr << "FAIL compare: the lost lead time isn't reported" << std::endl;
+        failures++;
+    }
+
+    std::cout << (failures ? "Scoring FAILED" : "Scoring OK") << std::endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,303 @@
+/**
+ * @file snapshot.h
+ * @brief Saves evidence frames as JPEG files on a low priority worker thread.
+ */
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+// Standard library Header files
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// Header file for OpenCV
+#include <opencv2/opencv.hpp>
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+/**
+ * @struct SnapshotStats
+ * @brief Throughput and load shedding counters of the SnapshotService.
+ */
+
+struct SnapshotStats {
+    unsigned long submitted = 0;   ///< Snapshots handed to submit().
+    unsigned long dropped = 0;     ///< Snapshots dropped because the queue was full.
+    unsigned long written = 0;     ///< JPEG files written.
+    unsigned long failed = 0;      ///< JPEG files which could not be encoded or written.
+    unsigned long long bytes = 0;  ///< Bytes of JPEG data written.
+    double encodeSeconds = 0;      ///< Time spent encoding.
+
+    /**
+     * @brief Encoded images per second of encoding time.
+     */
+
+    double imagesPerSecond() const {
+        return encodeSeconds > 0 ? written / encodeSeconds : 0;
+    }
+
+    /**
+     * @brief Encoded megabytes per second of encoding time.
+     */
+
+    double megabytesPerSecond() const {
+        return encodeSeconds > 0 ? bytes / encodeSeconds / 1e6 : 0;
+    }
+};
+
+/**
+ * @class SnapshotService
+ * @brief Encodes and stores evidence frames without blocking the camera thread.
+ *
+ * submit() only queues a reference to the frame (cv::Mat shares its
+ * buffer) and returns. A worker thread at idle priority encodes the full
+ * frame and the face crop, with libjpeg-turbo if it is available and with
+ * cv::imencode otherwise. Each file is written to a temporary name; once a
+ * batch is complete or the queue runs empty the files are fsync'ed,
+ * renamed to their final names and the directory is fsync'ed once. When
+ * the bounded queue is full new snapshots are dropped and counted.
+ */
+
+class SnapshotService {
+public:
+    /**
+     * @brief Starts the worker thread.
+     *
+     * @param directory Directory the JPEG files are written to.
+     * @param queueDepth Maximum number of snapshots waiting to be encoded.
+     * @param fsyncBatch Number of files which share one round of fsync calls.
+     * @param quality JPEG quality from 1 to 100.
+     */
+
+    SnapshotService(const std::string &directory = ".", size_t queueDepth = 8,
+                    size_t fsyncBatch = 8, int quality = 85) :
+        dir(directory), maxQueue(queueDepth), batchSize(fsyncBatch), jpegQuality(quality) {
+        worker = std::thread(&SnapshotService::run, this);
+    }
+
+    /**
+     * @brief Encodes whatever is still queued and stops the worker thread.
+     */
+
+    ~SnapshotService() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cond.notify_one();
+        worker.join();
+    }
+
+    /**
+     * @brief Queues a frame for saving.
+     *
+     * The frame must not be written to afterwards, as only a reference is kept.
+     *
+     * @param frame The full frame.
+     * @param face The face in the frame, an empty rectangle saves no crop.
+     * @param label Prefix of the file names.
+     * @return Returns false if the snapshot was dropped.
+     */
+
+    bool submit(const cv::Mat &frame, const cv::Rect &face, const std::string &label) {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.submitted++;
+        if (queue.size() >= maxQueue) {
+            stats.dropped++;
+            return false;
+        }
+        Job job;
+        job.frame = frame;
+        job.face = face & cv::Rect(0, 0, frame.cols, frame.rows);
+        job.name = label + "_" + std::to_string(counter++);
+        queue.push_back(std::move(job));
+        cond.notify_one();
+        return true;
+    }
+
+    /**
+     * @brief Returns a copy of the counters.
+     */
+
+    SnapshotStats getStats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    /**
+     * @brief Prints the counters.
+     */
+
+    void report(std::ostream &os) {
+        SnapshotStats s = getStats();
+        os << "Snapshots: " << s.written << " files, " << s.dropped << " of " << s.submitted
+           << " dropped, " << s.failed << " failed, " << s.imagesPerSecond() << " images/s, "
+           << s.megabytesPerSecond() << " MB/s" << std::endl;
+    }
+
+private:
+    struct Job {
+        cv::Mat frame;
+        cv::Rect face;
+        std::string name;
+    };
+
+    struct PendingFile {
+        int fd;
+        std::string tmpPath;
+        std::string path;
+    };
+
+    const std::string dir;
+    const size_t maxQueue;
+    const size_t batchSize;
+    const int jpegQuality;
+    std::deque<Job> queue;
+    std::vector<PendingFile> pending;
+    SnapshotStats stats;
+    unsigned long counter = 0;
+    bool quit = false;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread worker;
+#ifdef HAVE_TURBOJPEG
+    tjhandle tj = nullptr;
+#endif
+
+    void run() {
+        lowerPriority();
+#ifdef HAVE_TURBOJPEG
+        tj = tjInitCompress();
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cond.wait(lock, [this]{ return quit || !queue.empty(); });
+            if (queue.empty()) break;
+            Job job = std::move(queue.front());
+            queue.pop_front();
+            const bool idle = queue.empty();
+            lock.unlock();
+
+            save(job.frame, job.name + "_frame.jpg");
+            if (job.face.area() > 0) {
+                save(job.frame(job.face), job.name + "_face.jpg");
+            }
+            // sync a full batch, or whatever there is once the queue has run empty
+            if (idle || pending.size() >= batchSize) {
+                commit();
+            }
+            job.frame.release();
+            lock.lock();
+        }
+        lock.unlock();
+        commit();
+#ifdef HAVE_TURBOJPEG
+        if (tj) tjDestroy(tj);
+#endif
+    }
+
+    static void lowerPriority() {
+        // the camera and detection threads always come first
+        struct sched_param param = {};
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+            setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+        }
+    }
+
+    bool encode(const cv::Mat &image, std::vector<unsigned char> &jpeg) {
+#ifdef HAVE_TURBOJPEG
+        if (tj && image.type() == CV_8UC3) {
+            unsigned char *buf = nullptr;
+            unsigned long size = 0;
+            if (tjCompress2(tj, image.data, image.cols, (int)image.step, image.rows, TJPF_BGR,
+                            &buf, &size, TJSAMP_420, jpegQuality, TJFLAG_FASTDCT) != 0) {
+                return false;
+            }
+            jpeg.assign(buf, buf + size);
+            tjFree(buf);
+            return true;
+        }
+#endif
+        return cv::imencode(".jpg", image, jpeg, { cv::IMWRITE_JPEG_QUALITY, jpegQuality });
+    }
+
+    void save(const cv::Mat &image, const std::string &name) {
+        std::vector<unsigned char> jpeg;
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = encode(image, jpeg);
+        auto t1 = std::chrono::steady_clock::now();
+
+        PendingFile f;
+        f.path = dir + "/" + name;
+        f.tmpPath = f.path + ".tmp";
+        f.fd = -1;
+        if (ok) {
+            f.fd = open(f.tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            ok = (f.fd >= 0) && writeAll(f.fd, jpeg.data(), jpeg.size());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.encodeSeconds += std::chrono::duration<double>(t1 - t0).count();
+        if (!ok) {
+            std::cerr << "Can't save snapshot " << f.path << std::endl;
+            if (f.fd >= 0) {
+                close(f.fd);
+                unlink(f.tmpPath.c_str());
+            }
+            stats.failed++;
+            return;
+        }
+        stats.written++;
+        stats.bytes += jpeg.size();
+        pending.push_back(f);
+    }
+
+    void commit() {
+        if (pending.empty()) return;
+        for (auto &f : pending) {
+            fsync(f.fd);
+            close(f.fd);
+            if (rename(f.tmpPath.c_str(), f.path.c_str()) != 0) {
+                std::cerr << "Can't rename " << f.tmpPath << ": " << strerror(errno) << std::endl;
+            }
+        }
+        pending.clear();
+        // make the renames durable
+        int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+    }
+
+    static bool writeAll(int fd, const unsigned char *data, size_t size) {
+        while (size > 0) {
+            ssize_t r = write(fd, data, size);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += r;
+            size -= r;
+        }
+        return true;
+    }
+};
+
+#endif
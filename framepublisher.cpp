@@ -0,0 +1,390 @@
+#include "framepublisher.h"
+#include "framerecorder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <new>
+
+namespace {
+    const size_t pageSize = 4096;
+
+    size_t padded(size_t n, size_t alignment) {
+	return (n + alignment - 1) & ~(alignment - 1);
+    }
+
+    uint32_t *futexWord(const std::atomic<uint32_t> &a) {
+	return reinterpret_cast<uint32_t *>(const_cast<std::atomic<uint32_t> *>(&a));
+    }
+
+    void wakeAll(const std::atomic<uint32_t> &a) {
+	syscall(SYS_futex, futexWord(a), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    int socketAddress(const std::string &path, struct sockaddr_un &addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) return -ENAMETOOLONG;
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	return 0;
+    }
+}
+
+int FramePublisher::open(const std::string &socketPath, unsigned int slots) {
+    close();
+    if (slots < 2) return -EINVAL;
+    struct sockaddr_un addr;
+    int ret = socketAddress(socketPath, addr);
+    if (ret < 0) return ret;
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) return -errno;
+    // a socket left behind by a previous run
+    unlink(socketPath.c_str());
+    if ((bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(listenFd, 8) < 0)) {
+	ret = -errno;
+	::close(listenFd);
+	listenFd = -1;
+	return ret;
+    }
+    path = socketPath;
+    nSlots = slots;
+    running = true;
+    acceptThread = std::thread(&FramePublisher::acceptLoop, this);
+    return 0;
+}
+
+void FramePublisher::close() {
+    running = false;
+    if (acceptThread.joinable()) acceptThread.join();
+    if (listenFd >= 0) {
+	::close(listenFd);
+	unlink(path.c_str());
+    }
+    listenFd = -1;
+    std::lock_guard<std::mutex> lock(ringMutex);
+    releaseRing();
+}
+
+void FramePublisher::releaseRing() {
+    if (nullptr != ring) {
+	// the subscribers still have it mapped and move on
+	FramePublishing::ControlBlock *cb = reinterpret_cast<FramePublishing::ControlBlock *>(ring);
+	cb->retired.store(1, std::memory_order_release);
+	cb->notify.fetch_add(1, std::memory_order_release);
+	wakeAll(cb->notify);
+	munmap(ring, ringSize);
+    }
+    if (ringFd >= 0) ::close(ringFd);
+    if (readOnlyFd >= 0) ::close(readOnlyFd);
+    ring = nullptr;
+    ringSize = 0;
+    ringFd = -1;
+    readOnlyFd = -1;
+    planeCapacity = 0;
+}
+
+int FramePublisher::createRing(size_t planeBytes) {
+    const size_t slotStride = padded(sizeof(FramePublishing::SlotHeader) +
+				     FramePublishing::metadataCapacity + planeBytes, pageSize);
+    const size_t size = pageSize + nSlots * slotStride;
+    int fd = memfd_create("libcam2opencv-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -errno;
+    if (ftruncate(fd, size) < 0) {
+	int ret = -errno;
+	::close(fd);
+	return ret;
+    }
+    void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+	int ret = -errno;
+	::close(fd);
+	return ret;
+    }
+    uint8_t *newRing = static_cast<uint8_t *>(m);
+
+    FramePublishing::ControlBlock *cb = new (newRing) FramePublishing::ControlBlock;
+    memcpy(cb->magic, FramePublishing::magic, sizeof(cb->magic));
+    cb->version = 1;
+    cb->slots = nSlots;
+    cb->slotOffset = pageSize;
+    cb->slotStride = slotStride;
+    cb->published.store(0);
+    cb->notify.store(0);
+    cb->retired.store(0);
+    for (unsigned int i = 0; i < nSlots; i++) {
+	FramePublishing::SlotHeader *h =
+	    new (newRing + pageSize + i * slotStride) FramePublishing::SlotHeader;
+	h->seq.store(0);
+    }
+
+    // the size is fixed and the subscribers can't map it writable
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+#ifdef F_SEAL_FUTURE_WRITE
+    fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+    const std::string self = "/proc/self/fd/" + std::to_string(fd);
+    int ro = ::open(self.c_str(), O_RDONLY | O_CLOEXEC);
+    if (ro < 0) {
+	int ret = -errno;
+	munmap(newRing, size);
+	::close(fd);
+	return ret;
+    }
+
+    std::lock_guard<std::mutex> lock(ringMutex);
+    releaseRing();
+    ring = newRing;
+    ringSize = size;
+    ringFd = fd;
+    readOnlyFd = ro;
+    planeCapacity = slotStride - sizeof(FramePublishing::SlotHeader) - FramePublishing::metadataCapacity;
+    return 0;
+}
+
+int FramePublisher::publish(const std::vector<libcamera::Span<const uint8_t>> &planes,
+			    const libcamera::StreamConfiguration &streamConfig,
+			    uint64_t sequence,
+			    const libcamera::ControlList &metadata) {
+    if (listenFd < 0) return -EBADF;
+    if (planes.size() > FramePublishing::maxPlanes) return -EINVAL;
+    size_t planeBytes = 0;
+    for (const auto &p : planes)
+	planeBytes += padded(p.size(), FramePublishing::alignment);
+    if ((nullptr == ring) || (planeBytes > planeCapacity)) {
+	int ret = createRing(planeBytes);
+	if (ret < 0) return ret;
+    }
+    std::vector<uint8_t> meta = FrameRecording::serialise(metadata);
+    // metadata which doesn't fit is left out rather than the frame
+    if (meta.size() > FramePublishing::metadataCapacity) meta.clear();
+
+    FramePublishing::ControlBlock *cb = reinterpret_cast<FramePublishing::ControlBlock *>(ring);
+    const uint64_t frame = cb->published.load(std::memory_order_relaxed);
+    uint8_t *slot = ring + cb->slotOffset + (frame % cb->slots) * cb->slotStride;
+    FramePublishing::SlotHeader *h = reinterpret_cast<FramePublishing::SlotHeader *>(slot);
+
+    // seqlock: odd while the slot is written
+    const uint64_t seq = h->seq.load(std::memory_order_relaxed);
+    h->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    h->frame = frame;
+    h->sequence = sequence;
+    const auto ts = metadata.get(libcamera::controls::SensorTimestamp);
+    h->timestamp = ts ? *ts : 0;
+    h->width = streamConfig.size.width;
+    h->height = streamConfig.size.height;
+    h->stride = streamConfig.stride;
+    h->pixelFormat = streamConfig.pixelFormat.fourcc();
+    h->numPlanes = planes.size();
+    h->metadataSize = meta.size();
+    memcpy(slot + sizeof(*h), meta.data(), meta.size());
+    uint8_t *data = slot + sizeof(*h) + FramePublishing::metadataCapacity;
+    uint64_t offset = 0;
+    for (size_t i = 0; i < planes.size(); i++) {
+	h->planeOffset[i] = offset;
+	h->planeLength[i] = planes[i].size();
+	memcpy(data + offset, planes[i].data(), planes[i].size());
+	offset += padded(planes[i].size(), FramePublishing::alignment);
+    }
+
+    h->seq.store(seq + 2, std::memory_order_release);
+    cb->published.store(frame + 1, std::memory_order_release);
+    cb->notify.fetch_add(1, std::memory_order_release);
+    // never waits, wakes whoever sleeps on the ring
+    wakeAll(cb->notify);
+    nFrames++;
+    return 0;
+}
+
+void FramePublisher::acceptLoop() {
+    while (running) {
+	struct pollfd pfd = { listenFd, POLLIN, 0 };
+	if (poll(&pfd, 1, 200) <= 0) continue;
+	int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+	if (client < 0) continue;
+	int fd = -1;
+	{
+	    std::lock_guard<std::mutex> lock(ringMutex);
+	    if (readOnlyFd >= 0) fd = dup(readOnlyFd);
+	}
+	// without a ring yet the subscriber gets nothing and tries again
+	if (fd >= 0) {
+	    struct iovec iov = { const_cast<char *>(FramePublishing::magic), sizeof(FramePublishing::magic) };
+	    char control[CMSG_SPACE(sizeof(int))] = {};
+	    struct msghdr msg = {};
+	    msg.msg_iov = &iov;
+	    msg.msg_iovlen = 1;
+	    msg.msg_control = control;
+	    msg.msg_controllen = sizeof(control);
+	    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	    cmsg->cmsg_level = SOL_SOCKET;
+	    cmsg->cmsg_type = SCM_RIGHTS;
+	    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	    if (sendmsg(client, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		std::cerr << "Can't hand the frame ring to a subscriber: " << strerror(errno) << std::endl;
+	    }
+	    ::close(fd);
+	}
+	::close(client);
+    }
+}
+
+int FrameSubscriber::open(const std::string &socketPath) {
+    close();
+    path = socketPath;
+    struct sockaddr_un addr;
+    int ret = socketAddress(socketPath, addr);
+    if (ret < 0) return ret;
+    int s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s < 0) return -errno;
+    if (connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	ret = -errno;
+	::close(s);
+	return ret;
+    }
+    struct timeval timeout = { 1, 0 };
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char payload[sizeof(FramePublishing::magic)] = {};
+    struct iovec iov = { payload, sizeof(payload) };
+    char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(s, &msg, MSG_CMSG_CLOEXEC);
+    ret = (n < 0) ? -errno : 0;
+    ::close(s);
+    if (ret < 0) return ret;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ((n == 0) || (nullptr == cmsg) || (cmsg->cmsg_type != SCM_RIGHTS)) {
+	// the publisher hasn't had a frame yet
+	return -EAGAIN;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    if (memcmp(payload, FramePublishing::magic, sizeof(payload)) != 0) {
+	::close(fd);
+	return -EPROTO;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	ret = -errno;
+	::close(fd);
+	return ret;
+    }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) return -errno;
+    ring = static_cast<const uint8_t *>(m);
+    ringSize = st.st_size;
+    if ((ringSize < sizeof(FramePublishing::ControlBlock)) ||
+	(memcmp(control()->magic, FramePublishing::magic, sizeof(FramePublishing::magic)) != 0) ||
+	(0 == control()->slots) ||
+	(control()->slotStride < sizeof(FramePublishing::SlotHeader) + FramePublishing::metadataCapacity) ||
+	(control()->slotOffset + (uint64_t)control()->slots * control()->slotStride > ringSize)) {
+	close();
+	return -EPROTO;
+    }
+    haveFrame = false;
+    return 0;
+}
+
+void FrameSubscriber::close() {
+    if (nullptr != ring) munmap(const_cast<uint8_t *>(ring), ringSize);
+    ring = nullptr;
+    ringSize = 0;
+}
+
+int FrameSubscriber::receive(int timeoutMs) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    uint64_t published;
+    for (;;) {
+	// the publisher has a new ring, or has restarted
+	if ((nullptr == ring) || control()->retired.load(std::memory_order_acquire)) {
+	    if (path.empty()) return -ENOTCONN;
+	    int ret = open(path);
+	    if ((ret < 0) && (ret != -EAGAIN) && (ret != -ECONNREFUSED) && (ret != -ENOENT)) return ret;
+	}
+	if (nullptr != ring) {
+	    const FramePublishing::ControlBlock *cb = control();
+	    const uint32_t n = cb->notify.load(std::memory_order_acquire);
+	    published = cb->published.load(std::memory_order_acquire);
+	    if ((published > 0) && (!haveFrame || (published - 1 != lastFrame))) break;
+	    const auto remaining = deadline - std::chrono::steady_clock::now();
+	    if (remaining <= std::chrono::steady_clock::duration::zero()) return 0;
+	    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(remaining).count();
+	    struct timespec ts = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+	    if (!cb->retired.load(std::memory_order_acquire))
+		syscall(SYS_futex, futexWord(cb->notify), FUTEX_WAIT, n, &ts, nullptr, 0);
+	} else {
+	    // nobody is publishing yet
+	    if (std::chrono::steady_clock::now() >= deadline) return 0;
+	    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+    }
+
+    const FramePublishing::ControlBlock *cb = control();
+    const uint64_t frame = published - 1;
+    if (haveFrame && (frame > lastFrame + 1)) skipped += frame - lastFrame - 1;
+    lastFrame = frame;
+    haveFrame = true;
+
+    const uint8_t *slot = ring + cb->slotOffset + (frame % cb->slots) * cb->slotStride;
+    const FramePublishing::SlotHeader *h = reinterpret_cast<const FramePublishing::SlotHeader *>(slot);
+    const uint64_t seq = h->seq.load(std::memory_order_acquire);
+    if ((seq & 1) || (h->frame != frame)) {
+	// the publisher has already lapped us
+	skipped++;
+	return -ESTALE;
+    }
+    // the header comes from another process: read each field once and check it before use
+    const unsigned int numPlanes = h->numPlanes;
+    const size_t metadataSize = h->metadataSize;
+    const uint8_t *data = slot + sizeof(*h) + FramePublishing::metadataCapacity;
+    const size_t capacity = cb->slotStride - sizeof(*h) - FramePublishing::metadataCapacity;
+    if ((numPlanes > FramePublishing::maxPlanes) || (metadataSize > FramePublishing::metadataCapacity)) return -EPROTO;
+    std::vector<libcamera::Span<const uint8_t>> planes;
+    for (unsigned int i = 0; i < numPlanes; i++) {
+	const uint64_t offset = h->planeOffset[i], length = h->planeLength[i];
+	if ((offset > capacity) || (length > capacity - offset)) return -EPROTO;
+	planes.emplace_back(data + offset, length);
+    }
+    const Libcam2OpenCVFrame view(libcamera::PixelFormat(h->pixelFormat),
+				  libcamera::Size(h->width, h->height), h->stride, planes);
+    // nor may its size and stride make the converters read past the planes
+    if (!view.fits()) {
+	if (h->seq.load(std::memory_order_acquire) == seq) return -EPROTO;
+	skipped++;
+	return -ESTALE;
+    }
+    const libcamera::ControlList metadata = FrameRecording::deserialise(slot + sizeof(*h), metadataSize);
+
+    // don't hand out a frame which was torn while we read its header
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (h->seq.load(std::memory_order_relaxed) != seq) {
+	skipped++;
+	return -ESTALE;
+    }
+    if (nullptr != callback) callback->hasFrameView(view, metadata);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (h->seq.load(std::memory_order_relaxed) != seq) {
+	skipped++;
+	return -ESTALE;
+    }
+    return 1;
+}
@@ -0,0 +1,198 @@
+#ifndef __FRAMEPUBLISHER
+#define __FRAMEPUBLISHER
+
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024, Bernd Porr
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+
+// need to undefine QT defines here as libcamera uses the same expressions (!).
+#undef signals
+#undef slots
+#undef emit
+#undef foreach
+
+#include <libcamera/libcamera.h>
+
+#include "libcam2opencv.h"
+
+/**
+ * Shared memory ring for handing frames to other local processes.
+ *
+ * The ring is a sealed memfd: a ControlBlock followed by a number of
+ * slots, each with a SlotHeader, room for the serialised metadata and
+ * the planes. The publisher writes each frame once into the next slot
+ * under a per-slot seqlock and then advances the published counter.
+ * Subscribers get a read-only descriptor of the memfd over a Unix
+ * socket and read the frames in place. They never take a lock the
+ * publisher waits for, so a slow subscriber only misses frames.
+ **/
+namespace FramePublishing {
+    static constexpr char magic[8] = { 'L', '2', 'O', 'C', 'P', 'U', 'B', '1' };
+    static constexpr size_t alignment = 64;
+    static constexpr size_t metadataCapacity = 4096;
+    static constexpr unsigned int maxPlanes = 3;
+
+    struct ControlBlock {
+	char magic[8];
+	uint32_t version;
+	uint32_t slots;
+	uint64_t slotOffset;          // of the first slot from the start of the memfd
+	uint64_t slotStride;
+	std::atomic<uint64_t> published; // number of frames published, the newest is published - 1
+	std::atomic<uint32_t> notify;    // futex word, incremented with every frame
+	std::atomic<uint32_t> retired;   // the publisher has moved on to a new ring
+	uint8_t reserved[16];
+    };
+
+    struct SlotHeader {
+	std::atomic<uint64_t> seq;    // odd while the slot is written
+	uint64_t frame;               // number of the frame in the slot
+	uint64_t sequence;            // camera sequence number
+	int64_t timestamp;            // sensor timestamp in ns
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixelFormat;         // fourcc
+	uint32_t numPlanes;
+	uint32_t metadataSize;
+	uint64_t planeOffset[maxPlanes]; // relative to the start of the plane data
+	uint64_t planeLength[maxPlanes];
+	uint8_t reserved[24];
+    };
+
+    static_assert(sizeof(ControlBlock) == 64, "ControlBlock must be 64 bytes");
+    static_assert(sizeof(SlotHeader) % alignment == 0, "SlotHeader must be aligned");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared atomics must be lock free");
+}
+
+/**
+ * Publishes the frames of a camera to subscriber processes.
+ * Subscribers connect to a Unix socket and receive the memfd of the ring.
+ * publish() copies the frame once into the ring and never blocks.
+ **/
+class FramePublisher {
+public:
+    ~FramePublisher() {
+	close();
+    }
+
+    /**
+     * Listens on the Unix socket at the given path. The ring is created
+     * with the first frame. Returns 0 or a negative errno.
+     **/
+    int open(const std::string &socketPath, unsigned int slots = 4);
+
+    /**
+     * Writes one frame into the ring. The planes are the mapped planes of
+     * the buffer. If the frame doesn't fit the ring is replaced by a
+     * larger one and the subscribers reconnect. Returns 0 or a negative errno.
+     **/
+    int publish(const std::vector<libcamera::Span<const uint8_t>> &planes,
+		const libcamera::StreamConfiguration &streamConfig,
+		uint64_t sequence,
+		const libcamera::ControlList &metadata);
+
+    /**
+     * Stops listening and releases the ring.
+     **/
+    void close();
+
+    /**
+     * Number of frames published.
+     **/
+    unsigned long framesPublished() const {
+	return nFrames;
+    }
+
+private:
+    std::string path;
+    unsigned int nSlots = 4;
+    int listenFd = -1;
+    std::thread acceptThread;
+    std::atomic<bool> running{false};
+
+    // the ring, replaced when the frames get bigger
+    std::mutex ringMutex;
+    int ringFd = -1;
+    int readOnlyFd = -1;          // handed to the subscribers
+    uint8_t *ring = nullptr;
+    size_t ringSize = 0;
+    size_t planeCapacity = 0;
+    unsigned long nFrames = 0;
+
+    int createRing(size_t planeBytes);
+    void releaseRing();
+    void acceptLoop();
+};
+
+/**
+ * Receives the frames of a FramePublisher in another process.
+ * The frames handed to the callback point into the shared ring.
+ **/
+class FrameSubscriber {
+public:
+    ~FrameSubscriber() {
+	close();
+    }
+
+    /**
+     * Connects to the publisher and maps its ring. Returns 0 or a negative errno.
+     **/
+    int open(const std::string &socketPath);
+
+    /**
+     * Unmaps the ring.
+     **/
+    void close();
+
+    /**
+     * Register the callback for the frame data
+     **/
+    void registerCallback(Libcam2OpenCV::Callback* cb) {
+	callback = cb;
+    }
+
+    /**
+     * Waits up to timeoutMs for a frame newer than the last one received
+     * and hands the newest one to the callback. Older frames which the
+     * subscriber was too slow for are skipped. The frame is checked again
+     * after the callback: if the publisher has overwritten it meanwhile
+     * -ESTALE is returned and the results should be discarded. A slot whose
+     * planes, size and stride don't fit together is never handed out,
+     * -EPROTO is returned. Returns 1 if a frame was delivered, 0 on
+     * timeout or a negative errno.
+     **/
+    int receive(int timeoutMs);
+
+    /**
+     * Number of frames which were skipped or overwritten.
+     **/
+    unsigned long framesSkipped() const {
+	return skipped;
+    }
+
+private:
+    std::string path;
+    const uint8_t *ring = nullptr;
+    size_t ringSize = 0;
+    uint64_t lastFrame = 0;
+    bool haveFrame = false;
+    unsigned long skipped = 0;
+    Libcam2OpenCV::Callback* callback = nullptr;
+
+    const FramePublishing::ControlBlock *control() const {
+	return reinterpret_cast<const FramePublishing::ControlBlock *>(ring);
+    }
+};
+
+#endif
@@ -0,0 +1,368 @@
+#include "framerecorder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+
+namespace {
+    struct ControlHeader {
+	uint32_t id;
+	uint8_t type;
+	uint8_t isArray;
+	uint16_t reserved;
+	uint32_t numElements;
+	uint32_t size;
+    };
+
+    size_t padded(size_t n) {
+	return (n + FrameRecording::alignment - 1) & ~(FrameRecording::alignment - 1);
+    }
+
+    // writes everything or fails
+    int writeAll(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+	    ssize_t r = writev(fd, iov, iovcnt);
+	    if (r < 0) {
+		if (errno == EINTR) continue;
+		return -errno;
+	    }
+	    size_t n = r;
+	    while ((iovcnt > 0) && (n >= iov->iov_len)) {
+		n -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	    }
+	    if (iovcnt > 0) {
+		iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + n;
+		iov->iov_len -= n;
+	    }
+	}
+	return 0;
+    }
+
+    // end of the record at offset, or 0 if it is damaged or runs past the end of the recording
+    uint64_t recordEnd(const uint8_t *data, size_t length, uint64_t offset) {
+	if ((offset > length) || (length - offset < sizeof(FrameRecording::RecordHeader))) return 0;
+	const FrameRecording::RecordHeader *h =
+	    reinterpret_cast<const FrameRecording::RecordHeader *>(data + offset);
+	if (h->magic != FrameRecording::recordMagic) return 0;
+	if ((h->headerSize < sizeof(FrameRecording::RecordHeader)) || (h->numPlanes > FrameRecording::maxPlanes)) return 0;
+	for (unsigned int p = 0; p < h->numPlanes; p++) {
+	    if ((h->planeOffset[p] > h->dataSize) || (h->planeLength[p] > h->dataSize - h->planeOffset[p])) return 0;
+	}
+	if (h->dataSize > length) return 0;
+	const uint64_t size = (uint64_t)h->headerSize + h->metadataSize + h->dataSize;
+	if (size > length - offset) return 0;
+	return offset + size;
+    }
+}
+
+std::vector<uint8_t> FrameRecording::serialise(const libcamera::ControlList &metadata) {
+    std::vector<uint8_t> out;
+    for (const auto &ctrl : metadata) {
+	const libcamera::ControlValue &value = ctrl.second;
+	libcamera::Span<const uint8_t> bytes = value.data();
+	ControlHeader h = {};
+	h.id = ctrl.first;
+	h.type = value.type();
+	h.isArray = value.isArray();
+	h.numElements = value.numElements();
+	h.size = bytes.size();
+	size_t pos = out.size();
+	out.resize(pos + sizeof(h) + ((bytes.size() + 7) & ~size_t(7)), 0);
+	memcpy(out.data() + pos, &h, sizeof(h));
+	memcpy(out.data() + pos + sizeof(h), bytes.data(), bytes.size());
+    }
+    return out;
+}
+
+libcamera::ControlList FrameRecording::deserialise(const uint8_t *data, size_t size) {
+    libcamera::ControlList list(libcamera::controls::controls);
+    size_t pos = 0;
+    while (pos + sizeof(ControlHeader) <= size) {
+	ControlHeader h;
+	memcpy(&h, data + pos, sizeof(h));
+	pos += sizeof(h);
+	if (pos + h.size > size) break;
+	libcamera::ControlValue value;
+	value.reserve(static_cast<libcamera::ControlType>(h.type), h.isArray, h.numElements);
+	libcamera::Span<uint8_t> bytes = value.data();
+	if (bytes.size() == h.size) {
+	    memcpy(bytes.data(), data + pos, h.size);
+	    list.set(h.id, value);
+	}
+	pos += (h.size + 7) & ~size_t(7);
+    }
+    return list;
+}
+
+int FrameRecorder::open(const std::string &path, unsigned int queueDepth) {
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return -errno;
+    indexFd = ::open((path + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (indexFd < 0) {
+	int ret = -errno;
+	close();
+	return ret;
+    }
+    FrameRecording::FileHeader h = {};
+    memcpy(h.magic, FrameRecording::fileMagic, sizeof(h.magic));
+    h.version = 1;
+    h.headerSize = sizeof(h);
+    struct iovec iov = { &h, sizeof(h) };
+    int ret = writeAll(fd, &iov, 1);
+    if (ret < 0) {
+	close();
+	return ret;
+    }
+    offset = sizeof(h);
+    nFrames = 0;
+    nDropped = 0;
+    error = 0;
+    maxQueue = std::max(1u, queueDepth);
+    quit = false;
+    writer = std::thread(&FrameRecorder::writeLoop, this);
+    return 0;
+}
+
+int FrameRecorder::append(const std::vector<libcamera::Span<const uint8_t>> &planes,
+			  const libcamera::StreamConfiguration &streamConfig,
+			  uint64_t sequence,
+			  const libcamera::ControlList &metadata) {
+    if (fd < 0) return -EBADF;
+    if (error < 0) return error;
+    if (planes.size() > FrameRecording::maxPlanes) return -EINVAL;
+
+    Record r;
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (queue.size() >= maxQueue) {
+	    // the disk can't keep up, don't hold up the camera
+	    nDropped++;
+	    return 0;
+	}
+	if (!spare.empty()) {
+	    r = std::move(spare.back());
+	    spare.pop_back();
+	}
+    }
+
+    FrameRecording::RecordHeader &h = r.header;
+    h = {};
+    h.magic = FrameRecording::recordMagic;
+    h.headerSize = sizeof(h);
+    h.sequence = sequence;
+    const auto ts = metadata.get(libcamera::controls::SensorTimestamp);
+    h.timestamp = ts ? *ts : std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now().time_since_epoch()).count();
+    h.width = streamConfig.size.width;
+    h.height = streamConfig.size.height;
+    h.stride = streamConfig.stride;
+    h.pixelFormat = streamConfig.pixelFormat.fourcc();
+    h.numPlanes = planes.size();
+    r.metadata = FrameRecording::serialise(metadata);
+    h.metadataSize = padded(r.metadata.size());
+    uint64_t dataSize = 0;
+    for (size_t i = 0; i < planes.size(); i++) {
+	h.planeOffset[i] = dataSize;
+	h.planeLength[i] = planes[i].size();
+	dataSize += planes[i].size();
+    }
+    h.dataSize = padded(dataSize);
+    // the buffer goes back to the camera, so the writer gets a copy
+    r.data.resize(dataSize);
+    for (size_t i = 0; i < planes.size(); i++)
+	memcpy(r.data.data() + h.planeOffset[i], planes[i].data(), planes[i].size());
+
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	queue.push_back(std::move(r));
+    }
+    cond.notify_one();
+    return 0;
+}
+
+void FrameRecorder::writeLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+	cond.wait(lock, [this]{ return quit || !queue.empty(); });
+	if (queue.empty()) return;
+	Record r = std::move(queue.front());
+	queue.pop_front();
+	lock.unlock();
+	int ret = write(r);
+	lock.lock();
+	if (ret < 0) {
+	    // nothing more can be appended in order, drop the rest
+	    error = ret;
+	    queue.clear();
+	    return;
+	}
+	spare.push_back(std::move(r));
+    }
+}
+
+int FrameRecorder::write(Record &r) {
+    static const uint8_t zeros[FrameRecording::alignment] = {};
+    FrameRecording::RecordHeader &h = r.header;
+    struct iovec iov[5] = {
+	{ &h, sizeof(h) },
+	{ r.metadata.data(), r.metadata.size() },
+	{ const_cast<uint8_t *>(zeros), h.metadataSize - r.metadata.size() },
+	{ r.data.data(), r.data.size() },
+	{ const_cast<uint8_t *>(zeros), h.dataSize - r.data.size() }
+    };
+    int ret = writeAll(fd, iov, 5);
+    if (ret < 0) return ret;
+
+    // the index entry is only written once the record is complete
+    FrameRecording::IndexEntry e = { offset, h.sequence, h.timestamp };
+    struct iovec idx = { &e, sizeof(e) };
+    ret = writeAll(indexFd, &idx, 1);
+    if (ret < 0) return ret;
+
+    offset += sizeof(h) + h.metadataSize + h.dataSize;
+    nFrames++;
+    return 0;
+}
+
+void FrameRecorder::close() {
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	quit = true;
+    }
+    cond.notify_one();
+    if (writer.joinable()) writer.join();
+    queue.clear();
+    spare.clear();
+    if (fd >= 0) ::close(fd);
+    if (indexFd >= 0) ::close(indexFd);
+    fd = -1;
+    indexFd = -1;
+}
+
+int FrameReplay::open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	int ret = -errno;
+	::close(fd);
+	return ret;
+    }
+    if ((size_t)st.st_size < sizeof(FrameRecording::FileHeader)) {
+	::close(fd);
+	return -EINVAL;
+    }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) return -errno;
+    data = static_cast<uint8_t *>(m);
+    length = st.st_size;
+
+    const FrameRecording::FileHeader *fh = reinterpret_cast<const FrameRecording::FileHeader *>(data);
+    if (memcmp(fh->magic, FrameRecording::fileMagic, sizeof(fh->magic)) != 0) {
+	close();
+	return -EINVAL;
+    }
+
+    // load the index and scan whatever it doesn't cover
+    uint64_t from = fh->headerSize;
+    int ifd = ::open((path + ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+    if (ifd >= 0) {
+	FrameRecording::IndexEntry e;
+	while (read(ifd, &e, sizeof(e)) == sizeof(e)) {
+	    const uint64_t end = recordEnd(data, length, e.offset);
+	    if (0 == end) break;
+	    index.push_back(e);
+	    from = end;
+	}
+	::close(ifd);
+    }
+    scan(from);
+    return 0;
+}
+
+void FrameReplay::scan(uint64_t from) {
+    for (;;) {
+	// a truncated or damaged last record is ignored
+	const uint64_t end = recordEnd(data, length, from);
+	if (0 == end) break;
+	const FrameRecording::RecordHeader *h =
+	    reinterpret_cast<const FrameRecording::RecordHeader *>(data + from);
+	index.push_back({ from, h->sequence, h->timestamp });
+	from = end;
+    }
+}
+
+void FrameReplay::close() {
+    if (nullptr != data) munmap(data, length);
+    data = nullptr;
+    length = 0;
+    index.clear();
+}
+
+bool FrameReplay::deliver(size_t i) {
+    if ((i >= index.size()) || (nullptr == callback)) return false;
+    // the planes must lie within the record and the record within the file
+    if (0 == recordEnd(data, length, index[i].offset)) return false;
+    const uint8_t *rec = data + index[i].offset;
+    const FrameRecording::RecordHeader *h = reinterpret_cast<const FrameRecording::RecordHeader *>(rec);
+    const uint8_t *meta = rec + h->headerSize;
+    const uint8_t *planes = meta + h->metadataSize;
+    libcamera::ControlList metadata = FrameRecording::deserialise(meta, h->metadataSize);
+
+    const libcamera::PixelFormat format(h->pixelFormat);
+    if (!Libcam2OpenCVConverters::supports(format)) {
+	std::cerr << "Replay of pixel format " << format.toString()
+		  << " is not supported." << std::endl;
+	return false;
+    }
+    // the planes point into the mapping, no copy
+    std::vector<libcamera::Span<const uint8_t>> planeSpans;
+    for (unsigned int p = 0; p < h->numPlanes; p++)
+	planeSpans.emplace_back(planes + h->planeOffset[p], h->planeLength[p]);
+    const Libcam2OpenCVFrame frame(format, libcamera::Size(h->width, h->height), h->stride, planeSpans);
+    // a damaged header must not make the converters read past the planes
+    if (!frame.fits()) {
+	std::cerr << "Replay: frame " << i << " doesn't fit its planes, skipped." << std::endl;
+	return false;
+    }
+    callback->hasFrameView(frame, metadata);
+    return true;
+}
+
+void FrameReplay::run(bool realtime) {
+    if (index.empty()) return;
+    const auto t0 = std::chrono::steady_clock::now();
+    const int64_t ts0 = index[0].timestamp;
+    for (size_t i = 0; (i < index.size()) && running; i++) {
+	if (realtime) {
+	    std::this_thread::sleep_until(t0 + std::chrono::nanoseconds(index[i].timestamp - ts0));
+	}
+	deliver(i);
+    }
+    running = false;
+}
+
+void FrameReplay::start(bool realtime) {
+    stop();
+    running = true;
+    thread = std::thread(&FrameReplay::run, this, realtime);
+}
+
+void FrameReplay::stop() {
+    running = false;
+    wait();
+}
+
+void FrameReplay::wait() {
+    if (thread.joinable()) thread.join();
+}
@@ -0,0 +1,237 @@
+#ifndef __FRAMERECORDER
+#define __FRAMERECORDER
+
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2024, Bernd Porr
+ */
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <opencv2/opencv.hpp>
+
+// need to undefine QT defines here as libcamera uses the same expressions (!).
+#undef signals
+#undef slots
+#undef emit
+#undef foreach
+
+#include <libcamera/libcamera.h>
+
+#include "libcam2opencv.h"
+
+/**
+ * Container format of a capture session.
+ *
+ * The recording is a file of 64 byte aligned records which is only ever
+ * appended to. Each record has a RecordHeader, the serialised metadata
+ * ControlList and the raw planes as they came from the camera. Next to it
+ * an index file "<name>.idx" gets one IndexEntry per record once the
+ * record has been written completely, so a crash leaves a valid prefix.
+ * The replay maps the whole file and hands out frames pointing straight
+ * into the mapping.
+ **/
+namespace FrameRecording {
+    static constexpr char fileMagic[8] = { 'L', '2', 'O', 'C', 'R', 'E', 'C', '1' };
+    static constexpr uint32_t recordMagic = 0x4d415246; // "FRAM"
+    static constexpr size_t alignment = 64;
+    static constexpr unsigned int maxPlanes = 3;
+
+    struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint8_t reserved[48];
+    };
+
+    struct RecordHeader {
+	uint32_t magic;
+	uint32_t headerSize;
+	uint64_t sequence;
+	int64_t timestamp;        // sensor timestamp in ns
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixelFormat;     // fourcc
+	uint32_t numPlanes;
+	uint32_t metadataSize;    // padded to the alignment
+	uint64_t planeOffset[maxPlanes]; // relative to the start of the plane data
+	uint64_t planeLength[maxPlanes];
+	uint64_t dataSize;        // all planes, padded to the alignment
+	uint8_t reserved[24];
+    };
+
+    struct IndexEntry {
+	uint64_t offset;          // of the RecordHeader in the recording
+	uint64_t sequence;
+	int64_t timestamp;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "FileHeader must be 64 bytes");
+    static_assert(sizeof(RecordHeader) % alignment == 0, "RecordHeader must be aligned");
+
+    /**
+     * Serialises a ControlList into a flat buffer.
+     **/
+    std::vector<uint8_t> serialise(const libcamera::ControlList &metadata);
+
+    /**
+     * Restores a ControlList from a buffer created by serialise().
+     **/
+    libcamera::ControlList deserialise(const uint8_t *data, size_t size);
+}
+
+/**
+ * Appends raw frames and their metadata to a recording.
+ *
+ * append() runs on the camera's completion thread, so it only copies the
+ * frame into a queue of queueDepth records and a thread of its own writes
+ * them. When the disk falls behind and the queue is full the frame is
+ * dropped and counted, the camera is never held up.
+ **/
+class FrameRecorder {
+public:
+    ~FrameRecorder() {
+	close();
+    }
+
+    /**
+     * Creates the recording and its index and starts the writer thread.
+     * Returns 0 or a negative errno.
+     **/
+    int open(const std::string &path, unsigned int queueDepth = 8);
+
+    /**
+     * Queues one frame for writing. The planes are the mapped planes of
+     * the buffer and are copied. Returns 0 or the negative errno of a
+     * failed write, after which the recording takes no more frames.
+     **/
+    int append(const std::vector<libcamera::Span<const uint8_t>> &planes,
+	       const libcamera::StreamConfiguration &streamConfig,
+	       uint64_t sequence,
+	       const libcamera::ControlList &metadata);
+
+    /**
+     * Writes what is still queued and closes the recording.
+     **/
+    void close();
+
+    /**
+     * Number of frames written.
+     **/
+    unsigned long framesWritten() const {
+	return nFrames;
+    }
+
+    /**
+     * Number of frames dropped because the queue was full.
+     **/
+    unsigned long framesDropped() const {
+	return nDropped;
+    }
+
+private:
+    struct Record {
+	FrameRecording::RecordHeader header;
+	std::vector<uint8_t> metadata;
+	std::vector<uint8_t> data;       // the planes back to back
+    };
+
+    int fd = -1;
+    int indexFd = -1;
+    uint64_t offset = 0;
+    std::atomic<unsigned long> nFrames{0};
+    std::atomic<unsigned long> nDropped{0};
+    std::atomic<int> error{0};
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<Record> queue;
+    std::vector<Record> spare;           // written records whose memory is reused
+    unsigned int maxQueue = 8;
+    bool quit = false;
+    std::thread writer;
+
+    void writeLoop();
+    int write(Record &record);
+};
+
+/**
+ * Replays a recording through a Libcam2OpenCV::Callback.
+ * The frames handed to the callback point into the memory mapped
+ * recording, nothing is copied.
+ **/
+class FrameReplay {
+public:
+    ~FrameReplay() {
+	stop();
+	close();
+    }
+
+    /**
+     * Maps the recording and loads its index. If the index is missing or
+     * shorter than the recording the records are scanned instead.
+     * Returns 0 or a negative errno.
+     **/
+    int open(const std::string &path);
+
+    /**
+     * Unmaps the recording.
+     **/
+    void close();
+
+    /**
+     * Number of frames in the recording.
+     **/
+    size_t size() const {
+	return index.size();
+    }
+
+    /**
+     * Register the callback for the frame data
+     **/
+    void registerCallback(Libcam2OpenCV::Callback* cb) {
+	callback = cb;
+    }
+
+    /**
+     * Starts the replay in its own thread. With realtime the frames are
+     * delivered with the original timing, otherwise as fast as possible.
+     **/
+    void start(bool realtime = true);
+
+    /**
+     * Stops the replay.
+     **/
+    void stop();
+
+    /**
+     * Waits till all frames have been replayed.
+     **/
+    void wait();
+
+    /**
+     * Delivers the frame with the given index. Returns false if the
+     * frame can't be turned into an image.
+     **/
+    bool deliver(size_t i);
+
+private:
+    uint8_t *data = nullptr;
+    size_t length = 0;
+    std::vector<FrameRecording::IndexEntry> index;
+    Libcam2OpenCV::Callback* callback = nullptr;
+    std::thread thread;
+    std::atomic<bool> running{false};
+
+    void scan(uint64_t from);
+    void run(bool realtime);
+};
+
+#endif
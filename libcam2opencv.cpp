@@ -1,9 +1,455 @@
 #include "libcam2opencv.h"
+#include "framerecorder.h"
+#include "framepublisher.h"
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+namespace {
+    // how often the watchdog looks at the capture
+    const std::chrono::milliseconds watchdogPoll(20);
+    // a stall is never shorter than this, whatever the framerate
+    const int64_t minStallNs = 200000000;
+    // time a (re)started camera gets for its first frame
+    const int64_t startupGraceNs = 1000000000;
+
+    int64_t nowNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+std::mutex Libcam2OpenCVManager::mutex;
+std::weak_ptr<libcamera::CameraManager> Libcam2OpenCVManager::instance;
+
+std::shared_ptr<libcamera::CameraManager> Libcam2OpenCVManager::get() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<libcamera::CameraManager> cm = instance.lock();
+    if (cm) return cm;
+    cm = std::make_shared<libcamera::CameraManager>();
+    int ret = cm->start();
+    if (ret) {
+	std::cerr << "Failed to start camera manager: " << ret << std::endl;
+	return nullptr;
+    }
+    instance = cm;
+    return cm;
+}
+
+std::vector<std::string> Libcam2OpenCVManager::cameraIds() {
+    std::vector<std::string> ids;
+    std::shared_ptr<libcamera::CameraManager> cm = get();
+    if (!cm) return ids;
+    for (auto const &camera : cm->cameras())
+	ids.push_back(camera->id());
+    return ids;
+}
+
+Libcam2OpenCVWorkerPool::Libcam2OpenCVWorkerPool(unsigned int nThreads, unsigned int depth) :
+    queueDepth(depth > 0 ? depth : 1) {
+    if (0 == nThreads) nThreads = std::thread::hardware_concurrency();
+    if (0 == nThreads) nThreads = 1;
+    for (unsigned int i = 0; i < nThreads; i++)
+	workers.emplace_back(&Libcam2OpenCVWorkerPool::worker, this);
+}
+
+Libcam2OpenCVWorkerPool::~Libcam2OpenCVWorkerPool() {
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	quit = true;
+    }
+    cond.notify_all();
+    for (auto &t : workers)
+	t.join();
+}
+
+Libcam2OpenCVWorkerPool::Source *Libcam2OpenCVWorkerPool::findSource(const void *source) {
+    for (auto &s : sources)
+	if (s.id == source) return &s;
+    return nullptr;
+}
+
+void Libcam2OpenCVWorkerPool::submit(const void *source, std::function<void()> job) {
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	Source *s = findSource(source);
+	if (nullptr == s) {
+	    sources.push_back(Source());
+	    s = &sources.back();
+	    s->id = source;
+	}
+	if (s->jobs.size() >= queueDepth) {
+	    // the newest frame wins
+	    s->jobs.pop_front();
+	    s->dropped++;
+	}
+	s->jobs.push_back(std::move(job));
+    }
+    cond.notify_one();
+}
+
+void Libcam2OpenCVWorkerPool::removeSource(const void *source) {
+    std::unique_lock<std::mutex> lock(mutex);
+    Source *s = findSource(source);
+    if (nullptr == s) return;
+    s->jobs.clear();
+    cond.wait(lock, [this, source]{
+	Source *cur = findSource(source);
+	return (nullptr == cur) || !cur->busy;
+    });
+    for (auto it = sources.begin(); it != sources.end(); ++it) {
+	if (it->id == source) {
+	    sources.erase(it);
+	    break;
+	}
+    }
+}
+
+unsigned long Libcam2OpenCVWorkerPool::dropped(const void *source) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Source *s = findSource(source);
+    return (nullptr == s) ? 0 : s->dropped;
+}
+
+void Libcam2OpenCVWorkerPool::worker() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+	Source *s = nullptr;
+	cond.wait(lock, [this, &s]{
+	    if (quit) return true;
+	    // round robin, starting after the source served last
+	    for (size_t i = 0; i < sources.size(); i++) {
+		size_t idx = (next + i) % sources.size();
+		if (!sources[idx].busy && !sources[idx].jobs.empty()) {
+		    s = &sources[idx];
+		    next = idx + 1;
+		    return true;
+		}
+	    }
+	    return false;
+	});
+	if (quit) return;
+	const void *id = s->id;
+	std::function<void()> job = std::move(s->jobs.front());
+	s->jobs.pop_front();
+	s->busy = true;
+	lock.unlock();
+	job();
+	lock.lock();
+	// the vector might have been re-allocated while the job was running
+	s = findSource(id);
+	if (nullptr != s) s->busy = false;
+	cond.notify_all();
+    }
+}
+
+Libcam2OpenCVFrame::Libcam2OpenCVFrame(const libcamera::PixelFormat &format,
+				       const libcamera::Size &size,
+				       unsigned int stride,
+				       const std::vector<libcamera::Span<const uint8_t>> &planes) :
+    format(format), size(size), lineStride(stride), planeData(planes) {
+}
+
+Libcam2OpenCVFrame Libcam2OpenCVFrame::fromBgr(const cv::Mat &bgr) {
+    std::vector<libcamera::Span<const uint8_t>> planes;
+    planes.emplace_back(bgr.data, bgr.step * bgr.rows);
+    Libcam2OpenCVFrame f(libcamera::formats::BGR888, libcamera::Size(bgr.cols, bgr.rows), bgr.step, planes);
+    f.source = bgr;
+    return f;
+}
+
+Libcam2OpenCVFrame Libcam2OpenCVFrame::copy() const {
+    size_t total = 0;
+    for (const auto &p : planeData)
+	total += p.size();
+    std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>(total);
+    std::vector<libcamera::Span<const uint8_t>> planes;
+    size_t offset = 0;
+    for (const auto &p : planeData) {
+	memcpy(data->data() + offset, p.data(), p.size());
+	planes.emplace_back(data->data() + offset, p.size());
+	offset += p.size();
+    }
+    Libcam2OpenCVFrame f(format, size, lineStride, planes);
+    f.storage = data;
+    return f;
+}
+
+const cv::Mat &Libcam2OpenCVFrame::grey() const {
+    if (greyImage.empty())
+	Libcam2OpenCVConverters::convert(*this, Libcam2OpenCVConverters::Grey, greyImage);
+    return greyImage;
+}
+
+const cv::Mat &Libcam2OpenCVFrame::bgr() const {
+    if (bgrImage.empty())
+	Libcam2OpenCVConverters::convert(*this, Libcam2OpenCVConverters::BGR, bgrImage);
+    return bgrImage;
+}
+
+cv::Mat Libcam2OpenCVFrame::detachedBgr() const {
+    const cv::Mat &image = bgr();
+    // a BGR source keeps its own reference count
+    if (!source.empty() && (image.data == source.data))
+	return source;
+    // a converted image has its own memory, a wrapped one points into the planes,
+    // which belong to the camera buffer or to the storage of this frame
+    for (const auto &p : planeData)
+	if ((image.data >= p.data()) && (image.data < p.data() + p.size()))
+	    return image.clone();
+    return image;
+}
+
+bool Libcam2OpenCVFrame::fits() const {
+    if (planeData.empty() || (0 == size.width) || (0 == size.height)) return false;
+    const size_t w = size.width, h = size.height, s = lineStride;
+    // the sizes of the planes, which may also follow each other in plane 0
+    std::vector<size_t> need;
+    if (format == libcamera::formats::NV12) {
+	if (s < w) return false;
+	need = { s * h, s * (h / 2) };
+    } else if (format == libcamera::formats::YUV420) {
+	if (s < w) return false;
+	need = { s * h, (s / 2) * (h / 2), (s / 2) * (h / 2) };
+    } else if (format == libcamera::formats::XRGB8888) {
+	if (s < w * 4) return false;
+	need = { s * h };
+    } else if (format == libcamera::formats::BGR888) {
+	if (s < w * 3) return false;
+	need = { s * h };
+    } else {
+	return true;
+    }
+    size_t inFirst = 0;
+    for (size_t i = 0; i < need.size(); i++) {
+	if (i < planeData.size()) {
+	    if (planeData[i].size() < need[i]) return false;
+	    if (0 == i) inFirst = need[0];
+	} else {
+	    inFirst += need[i];
+	}
+    }
+    return planeData[0].size() >= inFirst;
+}
+
+namespace {
+    // pointer to plane i, or to where it would be if the buffer has fewer planes,
+    // nullptr if the plane is shorter than length or doesn't fit into plane 0
+    const uint8_t *planePointer(const Libcam2OpenCVFrame &f, size_t i, size_t offsetInFirst, size_t length) {
+	if (i < f.planes().size())
+	    return (f.planes()[i].size() >= length) ? f.planes()[i].data() : nullptr;
+	if ((offsetInFirst > f.planes()[0].size()) || (length > f.planes()[0].size() - offsetInFirst))
+	    return nullptr;
+	return f.planes()[0].data() + offsetInFirst;
+    }
+
+    cv::Mat wrapPlane(const Libcam2OpenCVFrame &f, int type) {
+	return cv::Mat(f.height(), f.width(), type, const_cast<uint8_t *>(f.planes()[0].data()), f.stride());
+    }
+
+    void nv12ToBgr(const Libcam2OpenCVFrame &f, cv::Mat &out) {
+	const unsigned int w = f.width(), h = f.height(), s = f.stride();
+	const uint8_t *y = f.planes()[0].data();
+	const uint8_t *uv = planePointer(f, 1, (size_t)s * h, (size_t)s * (h / 2));
+	if (nullptr == uv) {
+	    out.release();
+	    return;
+	}
+	cv::Mat yuv;
+	if (uv == y + (size_t)s * h) {
+	    // both planes back to back with the same stride, as cvtColor expects
+	    yuv = cv::Mat(h * 3 / 2, w, CV_8UC1, const_cast<uint8_t *>(y), s);
+	} else {
+	    yuv.create(h * 3 / 2, w, CV_8UC1);
+	    for (unsigned int r = 0; r < h; r++)
+		memcpy(yuv.ptr(r), y + (size_t)r * s, w);
+	    for (unsigned int r = 0; r < h / 2; r++)
+		memcpy(yuv.ptr(h + r), uv + (size_t)r * s, w);
+	}
+	cv::cvtColor(yuv, out, cv::COLOR_YUV2BGR_NV12);
+    }
+
+    void yuv420ToBgr(const Libcam2OpenCVFrame &f, cv::Mat &out) {
+	const unsigned int w = f.width(), h = f.height(), s = f.stride();
+	const unsigned int cs = s / 2;
+	const uint8_t *y = f.planes()[0].data();
+	const uint8_t *u = planePointer(f, 1, (size_t)s * h, (size_t)cs * (h / 2));
+	const uint8_t *v = planePointer(f, 2, (size_t)s * h + (size_t)cs * (h / 2), (size_t)cs * (h / 2));
+	if ((nullptr == u) || (nullptr == v)) {
+	    out.release();
+	    return;
+	}
+	cv::Mat yuv;
+	if ((s == w) && (u == y + (size_t)s * h) && (v == u + (size_t)cs * (h / 2))) {
+	    yuv = cv::Mat(h * 3 / 2, w, CV_8UC1, const_cast<uint8_t *>(y));
+	} else {
+	    // cvtColor wants the planes packed without padding
+	    yuv.create(h * 3 / 2, w, CV_8UC1);
+	    uint8_t *d = yuv.data;
+	    for (unsigned int r = 0; r < h; r++, d += w)
+		memcpy(d, y + (size_t)r * s, w);
+	    for (unsigned int r = 0; r < h / 2; r++, d += w / 2)
+		memcpy(d, u + (size_t)r * cs, w / 2);
+	    for (unsigned int r = 0; r < h / 2; r++, d += w / 2)
+		memcpy(d, v + (size_t)r * cs, w / 2);
+	}
+	cv::cvtColor(yuv, out, cv::COLOR_YUV2BGR_I420);
+    }
+}
+
+std::mutex Libcam2OpenCVConverters::mutex;
+
+std::map<std::pair<uint32_t, int>, Libcam2OpenCVConverters::Converter> &Libcam2OpenCVConverters::registry() {
+    static std::map<std::pair<uint32_t, int>, Converter> converters = {
+	// the Y plane is the grey image
+	{ { libcamera::formats::NV12.fourcc(), Grey },
+	  [](const Libcam2OpenCVFrame &f, cv::Mat &out) { out = wrapPlane(f, CV_8UC1); } },
+	{ { libcamera::formats::NV12.fourcc(), BGR }, nv12ToBgr },
+	{ { libcamera::formats::YUV420.fourcc(), Grey },
+	  [](const Libcam2OpenCVFrame &f, cv::Mat &out) { out = wrapPlane(f, CV_8UC1); } },
+	{ { libcamera::formats::YUV420.fourcc(), BGR }, yuv420ToBgr },
+	// XRGB8888 is B, G, R, X in memory
+	{ { libcamera::formats::XRGB8888.fourcc(), Grey },
+	  [](const Libcam2OpenCVFrame &f, cv::Mat &out) { cv::cvtColor(wrapPlane(f, CV_8UC4), out, cv::COLOR_BGRA2GRAY); } },
+	{ { libcamera::formats::XRGB8888.fourcc(), BGR },
+	  [](const Libcam2OpenCVFrame &f, cv::Mat &out) { cv::cvtColor(wrapPlane(f, CV_8UC4), out, cv::COLOR_BGRA2BGR); } },
+	{ { libcamera::formats::BGR888.fourcc(), Grey },
+	  [](const Libcam2OpenCVFrame &f, cv::Mat &out) { cv::cvtColor(wrapPlane(f, CV_8UC3), out, cv::COLOR_BGR2GRAY); } },
+	{ { libcamera::formats::BGR888.fourcc(), BGR },
+	  [](const Libcam2OpenCVFrame &f, cv::Mat &out) { out = wrapPlane(f, CV_8UC3); } },
+    };
+    return converters;
+}
+
+void Libcam2OpenCVConverters::add(const libcamera::PixelFormat &format, Target target, Converter converter) {
+    std::lock_guard<std::mutex> lock(mutex);
+    registry()[{ format.fourcc(), target }] = converter;
+}
+
+bool Libcam2OpenCVConverters::convert(const Libcam2OpenCVFrame &frame, Target target, cv::Mat &out) {
+    Converter converter;
+    {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = registry().find({ frame.pixelFormat().fourcc(), target });
+	if (it == registry().end()) return false;
+	converter = it->second;
+    }
+    // a converter would read past the end of a plane which is too small
+    if (frame.planes().empty() || !frame.fits()) return false;
+    converter(frame, out);
+    return !out.empty();
+}
+
+bool Libcam2OpenCVConverters::supports(const libcamera::PixelFormat &format) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return (registry().count({ format.fourcc(), Grey }) > 0) &&
+	(registry().count({ format.fourcc(), BGR }) > 0);
+}
+
+std::vector<libcamera::Span<const uint8_t>> Libcam2OpenCV::mappedPlanes(libcamera::FrameBuffer *buffer) const {
+    // the planes sharing an fd are in one mapping, each at its own offset
+    std::vector<libcamera::Span<const uint8_t>> planes;
+    auto mem = Mmap(buffer);
+    size_t m = 0;
+    for (unsigned i = 0; i < buffer->planes().size(); i++) {
+	const libcamera::FrameBuffer::Plane &plane = buffer->planes()[i];
+	if (i > 0 && plane.fd.get() != buffer->planes()[i - 1].fd.get()) m++;
+	if (m >= mem.size()) break;
+	if ((size_t)plane.offset + plane.length > mem[m].size()) break;
+	planes.emplace_back(mem[m].data() + plane.offset, plane.length);
+    }
+    return planes;
+}
+
+Libcam2OpenCV::~Libcam2OpenCV() {
+    stop();
+}
+
+int Libcam2OpenCV::startRecording(const std::string &path) {
+    std::unique_ptr<FrameRecorder> r = std::make_unique<FrameRecorder>();
+    int ret = r->open(path);
+    if (ret < 0) {
+	std::cerr << "Can't create recording " << path << ": " << strerror(-ret) << std::endl;
+	return ret;
+    }
+    {
+	std::lock_guard<std::mutex> lock(recorderMutex);
+	std::swap(recorder, r);
+    }
+    // a previous recording is finished outside the lock
+    return 0;
+}
+
+void Libcam2OpenCV::stopRecording() {
+    std::unique_ptr<FrameRecorder> r;
+    {
+	std::lock_guard<std::mutex> lock(recorderMutex);
+	r = std::move(recorder);
+    }
+    // the queued frames are written without holding up the completion thread
+    if (r) {
+	r->close();
+	if (r->framesDropped() > 0)
+	    std::cerr << "Recording dropped " << r->framesDropped() << " of "
+		      << r->framesWritten() + r->framesDropped() << " frames." << std::endl;
+    }
+}
+
+int Libcam2OpenCV::startPublishing(const std::string &socketPath, unsigned int slots) {
+    std::unique_ptr<FramePublisher> p = std::make_unique<FramePublisher>();
+    int ret = p->open(socketPath, slots);
+    if (ret < 0) {
+	std::cerr << "Can't publish on " << socketPath << ": " << strerror(-ret) << std::endl;
+	return ret;
+    }
+    std::lock_guard<std::mutex> lock(publisherMutex);
+    publisher = std::move(p);
+    return 0;
+}
+
+void Libcam2OpenCV::stopPublishing() {
+    std::lock_guard<std::mutex> lock(publisherMutex);
+    publisher.reset();
+}
+
+void Libcam2OpenCV::setFramerate(unsigned int framerate) {
+    if (0 == framerate) return;
+    int64_t frame_time = 1000000 / framerate; // in us
+    configuredIntervalUs = frame_time;
+    std::lock_guard<std::mutex> lock(controlsMutex);
+    pendingControls.set(libcamera::controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+}
+
+int Libcam2OpenCV::setControls(const libcamera::ControlList &newControls) {
+    std::lock_guard<std::mutex> lock(controlsMutex);
+    if (supportedControls.empty()) return -ENODEV;
+    int n = 0;
+    for (const auto &ctrl : newControls) {
+	if (supportedControls.count(ctrl.first) == 0) continue;
+	pendingControls.set(ctrl.first, ctrl.second);
+	n++;
+    }
+    return n;
+}
+
+bool Libcam2OpenCV::supportsControl(const libcamera::ControlId &id) {
+    std::lock_guard<std::mutex> lock(controlsMutex);
+    return supportedControls.count(id.id()) > 0;
+}
+
+std::vector<libcamera::Size> Libcam2OpenCV::sensorModes() {
+    std::lock_guard<std::mutex> lock(controlsMutex);
+    return rawSizes;
+}
 
 void Libcam2OpenCV::requestComplete(libcamera::Request *request) {
     if (nullptr == request) return;
-    if (request->status() == libcamera::Request::RequestCancelled)
+    // a request which isn't queued again is an orphan for the watchdog
+    if ((request->status() == libcamera::Request::RequestCancelled) || !running) {
+	setRequestState(request, RequestIdle);
 	return;
+    }
+    setRequestState(request, RequestCompleting);
 
     /*
      * When a request has completed, it is populated with a metadata control
@@ -17,6 +463,22 @@ void Libcam2OpenCV::requestComplete(libcamera::Request *request) {
      * of these items and process them according to its needs.
      */
     const libcamera::ControlList &requestMetadata = request->metadata();
+
+    // the capture is alive
+    const int64_t now = nowNs();
+    lastFrameNs = now;
+    const auto duration = requestMetadata.get(libcamera::controls::FrameDuration);
+    if (duration) observedIntervalUs = *duration;
+    if (faulted.exchange(false)) {
+	const double blind = (now - faultSinceNs) / 1e9;
+	{
+	    std::lock_guard<std::mutex> lock(watchdogMutex);
+	    stats.lastBlindSeconds = blind;
+	    stats.maxBlindSeconds = std::max(stats.maxBlindSeconds, blind);
+	}
+	std::cerr << "Capture recovered after " << blind << " s without frames" << std::endl;
+	if (nullptr != callback) callback->captureRecovered(blind);
+    }
     
     /*
      * Each buffer has its own FrameMetadata to describe its state, or the
@@ -32,32 +494,81 @@ void Libcam2OpenCV::requestComplete(libcamera::Request *request) {
     for (auto bufferPair : buffers) {
 	libcamera::FrameBuffer *buffer = bufferPair.second;
 	libcamera::StreamConfiguration &streamConfig = config->at(0);
-	unsigned int vw = streamConfig.size.width;
-	unsigned int vh = streamConfig.size.height;
-	unsigned int vstr = streamConfig.stride;
-	auto mem = Mmap(buffer);
-	frame.create(vh,vw,CV_8UC3);
-	uint ls = vw*3;
-	uint8_t *ptr = mem[0].data();
-	for (unsigned int i = 0; i < vh; i++, ptr += vstr) {
-	    memcpy(frame.ptr(i),ptr,ls);
+	const std::vector<libcamera::Span<const uint8_t>> planes = mappedPlanes(buffer);
+	{
+	    std::lock_guard<std::mutex> lock(recorderMutex);
+	    if (recorder) {
+		int ret = recorder->append(planes, streamConfig, buffer->metadata().sequence, requestMetadata);
+		if (ret < 0) {
+		    std::cerr << "Recording failed: " << strerror(-ret) << std::endl;
+		    recorder.reset();
+		}
+	    }
+	}
+	{
+	    std::lock_guard<std::mutex> lock(publisherMutex);
+	    if (publisher) {
+		int ret = publisher->publish(planes, streamConfig, buffer->metadata().sequence, requestMetadata);
+		if (ret < 0) {
+		    std::cerr << "Publishing failed: " << strerror(-ret) << std::endl;
+		    publisher.reset();
+		}
+	    }
 	}
+	// the frame points straight into the camera buffer
+	Libcam2OpenCVFrame view(streamConfig.pixelFormat, streamConfig.size, streamConfig.stride, planes);
 	if (nullptr != callback) {
-	    callback->hasFrame(frame, requestMetadata);
+	    if (nullptr != pool) {
+		// the buffer is re-queued straight away, so the worker gets a copy of the native planes
+		Callback* cb = callback;
+		Libcam2OpenCVFrame owned = view.copy();
+		libcamera::ControlList metadata = requestMetadata;
+		pool->submit(this, [cb, owned, metadata]() {
+		    cb->hasFrameView(owned, metadata);
+		});
+	    } else {
+		callback->hasFrameView(view, requestMetadata);
+	    }
 	}
     }
 
-    // in case the request has been cancelled in the meantime
-    // this is a hack because libcamera should wait till a request has finisehd but doesn't
-    if (nullptr == request) return;
-    if (request->status() == libcamera::Request::RequestCancelled)
+    // stop() or reconfigure() might have been called from the callback
+    if (!running) {
+	setRequestState(request, RequestIdle);
 	return;
+    }
     /* Re-queue the Request to the camera. */
     request->reuse(libcamera::Request::ReuseBuffers);
-    camera->queueRequest(request);
+    {
+	// controls changed at runtime are applied from this request on
+	std::lock_guard<std::mutex> lock(controlsMutex);
+	for (const auto &ctrl : pendingControls)
+	    request->controls().set(ctrl.first, ctrl.second);
+	pendingControls.clear();
+    }
+    queueRequest(request);
 }
 
-void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
+void Libcam2OpenCV::setRequestState(const libcamera::Request *request, RequestState state) {
+    std::lock_guard<std::mutex> lock(requestsMutex);
+    requestStates[request] = state;
+}
+
+int Libcam2OpenCV::queueRequest(libcamera::Request *request) {
+    // marked first as it can complete before queueRequest returns
+    setRequestState(request, RequestQueued);
+    int ret = camera->queueRequest(request);
+    if (ret < 0) setRequestState(request, RequestIdle);
+    return ret;
+}
+
+int Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
+    std::lock_guard<std::mutex> lock(stateMutex);
+    if (camera) {
+	std::cerr << "Camera already started." << std::endl;
+	return -EBUSY;
+    }
+
     /*
      * --------------------------------------------------------------------
      * Create a Camera Manager.
@@ -69,15 +580,12 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
      * The CameraManager provides a list of available Cameras that
      * applications can operate on.
      *
-     * When the CameraManager is no longer to be used, it should be deleted.
-     * We use a unique_ptr here to manage the lifetime automatically during
-     * the scope of this function.
-     *
      * There can only be a single CameraManager constructed within any
-     * process space.
+     * process space. It is therefore shared between all instances of
+     * this class.
      */
-    cm  = std::make_unique<libcamera::CameraManager>();
-    cm->start();
+    cm = Libcam2OpenCVManager::get();
+    if (!cm) return -ENODEV;
 	
     /*
      * Just as a test, generate names of the Cameras registered in the
@@ -100,25 +608,172 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
      * Application lock usage of Camera by 'acquiring' them.
      * Once done with it, application shall similarly 'release' the Camera.
      *
-     * As an example, use the first available camera in the system after
-     * making sure that at least one camera is available.
-     *
-     * Cameras can be obtained by their ID or their index, to demonstrate
-     * this, the following code gets the ID of the first camera; then gets
-     * the camera associated with that ID (which is of course the same as
-     * cm->cameras()[0]).
+     * Cameras can be obtained by their ID or their index. The settings
+     * select one or the other so that several instances can each open
+     * their own camera.
      */
     if (cm->cameras().empty()) {
 	std::cerr << "No cameras were identified on the system."
 		  << std::endl;
-	cm->stop();
-	return;
+	cm.reset();
+	return -ENODEV;
     }
 	
-    std::string cameraId = cm->cameras()[0]->id();
+    std::string cameraId = settings.cameraId;
+    if (cameraId.empty()) {
+	if (settings.cameraIndex >= cm->cameras().size()) {
+	    std::cerr << "No camera with index " << settings.cameraIndex << std::endl;
+	    cm.reset();
+	    return -ENODEV;
+	}
+	cameraId = cm->cameras()[settings.cameraIndex]->id();
+    }
+    int ret = openCamera(cameraId);
+    if (ret) {
+	cm.reset();
+	return ret;
+    }
+
+    ret = configureStream(settings);
+    if (!ret) ret = allocateBuffers();
+    if (!ret) ret = startCapture(settings);
+    if (ret) {
+	closeCamera();
+	cm.reset();
+	return ret;
+    }
+    activeSettings = settings;
+    activeCameraId = cameraId;
+    startWatchdog();
+    return 0;
+}
+
+int Libcam2OpenCV::openCamera(const std::string &cameraId) {
     camera = cm->get(cameraId);
-    camera->acquire();
+    if (!camera) {
+	std::cerr << "No camera with ID " << cameraId << std::endl;
+	return -ENODEV;
+    }
+    int ret = camera->acquire();
+    if (ret) {
+	std::cerr << "Camera " << cameraId << " is in use." << std::endl;
+	camera.reset();
+	return ret;
+    }
 
+    /*
+     * --------------------------------------------------------------------
+     * Signal&Slots
+     *
+     * libcamera uses a Signal&Slot based system to connect events to
+     * callback operations meant to handle them, inspired by the QT graphic
+     * toolkit.
+     *
+     * Signals are events 'emitted' by a class instance.
+     * Slots are callbacks that can be 'connected' to a Signal.
+     *
+     * A Camera exposes Signals, to report the completion of a Request and
+     * the completion of a Buffer part of a Request to support partial
+     * Request completions.
+     *
+     * In order to receive the notification for request completions,
+     * applications shall connecte a Slot to the Camera 'requestCompleted'
+     * Signal before the camera is started.
+     */
+    camera->requestCompleted.connect(this,&Libcam2OpenCV::requestComplete);
+
+    // kept apart from the camera so that setControls() never waits for a restart
+    {
+	std::lock_guard<std::mutex> lock(controlsMutex);
+	supportedControls.clear();
+	for (const auto &info : camera->controls())
+	    supportedControls.insert(info.first->id());
+
+	// the sizes of the raw stream are the sensor modes
+	rawSizes.clear();
+	std::unique_ptr<libcamera::CameraConfiguration> raw =
+	    camera->generateConfiguration( { libcamera::StreamRole::Raw } );
+	if (raw && !raw->empty()) {
+	    const libcamera::StreamFormats &formats = raw->at(0).formats();
+	    for (const libcamera::PixelFormat &f : formats.pixelformats()) {
+		for (const libcamera::Size &size : formats.sizes(f)) {
+		    if (std::find(rawSizes.begin(), rawSizes.end(), size) == rawSizes.end())
+			rawSizes.push_back(size);
+		}
+	    }
+	    std::sort(rawSizes.begin(), rawSizes.end(), [](const libcamera::Size &a, const libcamera::Size &b) {
+		return a.width * a.height < b.width * b.height;
+	    });
+	}
+    }
+    return 0;
+}
+
+void Libcam2OpenCV::closeCamera() {
+    if (!camera) return;
+    running = false;
+    if (cameraStarted) {
+	camera->stop();
+	cameraStarted = false;
+    }
+    camera->requestCompleted.disconnect(this, &Libcam2OpenCV::requestComplete);
+    {
+	std::lock_guard<std::mutex> lock(controlsMutex);
+	supportedControls.clear();
+	rawSizes.clear();
+    }
+    releaseBuffers();
+    config.reset();
+    camera->release();
+    camera.reset();
+}
+
+int Libcam2OpenCV::reconfigure(Libcam2OpenCVSettings settings) {
+    std::lock_guard<std::mutex> lock(stateMutex);
+    if (!camera) return -ENODEV;
+
+    /*
+     * Stopping the camera drains it: when stop() returns every queued
+     * request has either completed or been cancelled and the slot for
+     * it has returned, so nothing touches the buffers any longer.
+     */
+    running = false;
+    if (cameraStarted) {
+	camera->stop();
+	cameraStarted = false;
+    }
+
+    // remember what the buffers look like before changing the configuration
+    const libcamera::Size oldSize = config ? config->at(0).size : libcamera::Size();
+    const unsigned int oldStride = config ? config->at(0).stride : 0;
+    const libcamera::PixelFormat oldFormat = config ? config->at(0).pixelFormat : libcamera::PixelFormat();
+    const unsigned int oldCount = config ? config->at(0).bufferCount : 0;
+
+    int ret = configureStream(settings);
+    if (ret) return ret;
+
+    const libcamera::StreamConfiguration &streamConfig = config->at(0);
+    const bool sameGeometry = (nullptr != allocator) &&
+	(streamConfig.size == oldSize) &&
+	(streamConfig.stride == oldStride) &&
+	(streamConfig.pixelFormat == oldFormat) &&
+	(streamConfig.bufferCount == oldCount) &&
+	(streamConfig.stream() == stream);
+    if (!sameGeometry) {
+	releaseBuffers();
+	ret = allocateBuffers();
+	if (ret) return ret;
+    }
+    ret = startCapture(settings);
+    if (ret) return ret;
+    // the watchdog recovers with these from now on
+    settings.cameraId = activeSettings.cameraId;
+    settings.cameraIndex = activeSettings.cameraIndex;
+    activeSettings = settings;
+    return 0;
+}
+
+int Libcam2OpenCV::configureStream(const Libcam2OpenCVSettings &settings) {
     /*
      * Stream
      *
@@ -157,7 +812,12 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
      * A Camera produces a CameraConfigration based on a set of intended
      * roles for each Stream the application requires.
      */
-    config = camera->generateConfiguration( { libcamera::StreamRole::Viewfinder } );
+    std::unique_ptr<libcamera::CameraConfiguration> newConfig =
+	camera->generateConfiguration( { libcamera::StreamRole::Viewfinder } );
+    if (!newConfig) {
+	std::cerr << "Can't generate a configuration" << std::endl;
+	return -EINVAL;
+    }
 
     /*
      * The CameraConfiguration contains a StreamConfiguration instance
@@ -167,7 +827,7 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
      * Each StreamConfiguration has default size and format, assigned
      * by the Camera depending on the Role the application has requested.
      */
-    libcamera::StreamConfiguration &streamConfig = config->at(0);
+    libcamera::StreamConfiguration &streamConfig = newConfig->at(0);
 	
     /*
      * Each StreamConfiguration parameter which is part of a
@@ -181,36 +841,84 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
      * The CameraConfiguration validation process adjusts each
      * StreamConfiguration to a valid value.
      */
-
-    /*
-     * The Camera configuration procedure fails with invalid parameters.
-     */
     if ((settings.width > 0) && (settings.height > 0)) {
 	streamConfig.size.width = settings.width;
 	streamConfig.size.height = settings.height;
-	int ret = camera->configure(config.get());
-	if (ret) {
-	    std::cerr << "CONFIGURATION FAILED!" << std::endl;
-	    return;
+    }
+
+    /*
+     * Take the first preferred format which the stream supports natively
+     * and which we can convert. BGR888 is the fall back.
+     */
+    const std::vector<libcamera::PixelFormat> native = streamConfig.formats().pixelformats();
+    libcamera::PixelFormat wanted = libcamera::formats::BGR888;
+    for (const libcamera::PixelFormat &f : settings.pixelFormats) {
+	if (!Libcam2OpenCVConverters::supports(f)) continue;
+	if (std::find(native.begin(), native.end(), f) != native.end()) {
+	    wanted = f;
+	    break;
 	}
     }
+    streamConfig.pixelFormat = wanted;
 
-    // opencv compatible format
-    streamConfig.pixelFormat = libcamera::formats::BGR888;
+    /*
+     * A particular sensor mode, such as a binned one for a high framerate,
+     * is asked for with the sensor configuration. The analogue crop is
+     * the whole pixel array, as for a binned mode.
+     */
+    if (!settings.sensorMode.isNull()) {
+	libcamera::SensorConfiguration sensor;
+	sensor.bitDepth = settings.sensorBitDepth;
+	sensor.outputSize = settings.sensorMode;
+	const auto pixelArray = camera->properties().get(libcamera::properties::PixelArraySize);
+	sensor.analogCrop = libcamera::Rectangle(pixelArray ? *pixelArray : settings.sensorMode);
+	newConfig->sensorConfig = sensor;
+    }
 
     /*
      * Validating a CameraConfiguration -before- applying it will adjust it
      * to a valid configuration which is as close as possible to the one
-     * requested.
+     * requested. A pipeline handler which can't honour the sensor mode
+     * rejects the configuration, it then chooses the mode itself.
      */
-    config->validate();
+    libcamera::CameraConfiguration::Status status = newConfig->validate();
+    if ((status == libcamera::CameraConfiguration::Invalid) && newConfig->sensorConfig) {
+	std::cerr << "Sensor mode " << settings.sensorMode.toString() << " not accepted" << std::endl;
+	newConfig->sensorConfig.reset();
+	status = newConfig->validate();
+    }
+    switch (status) {
+    case libcamera::CameraConfiguration::Invalid:
+	std::cerr << "Invalid configuration " << streamConfig.toString() << std::endl;
+	return -EINVAL;
+    case libcamera::CameraConfiguration::Adjusted:
+	std::cerr << "Configuration adjusted to " << streamConfig.toString() << std::endl;
+	break;
+    default:
+	break;
+    }
+    if (!Libcam2OpenCVConverters::supports(streamConfig.pixelFormat)) {
+	std::cerr << "No converter for pixel format " << streamConfig.pixelFormat.toString() << std::endl;
+	return -EINVAL;
+    }
+    std::cerr << "Pixel format " << streamConfig.pixelFormat.toString()
+	      << (streamConfig.pixelFormat != wanted ? " (adjusted)" : "") << std::endl;
 	
     /*
      * Once we have a validated configuration, we can apply it to the
-     * Camera.
+     * Camera. The camera configuration procedure fails with invalid
+     * parameters.
      */
-    camera->configure(config.get());
+    int ret = camera->configure(newConfig.get());
+    if (ret) {
+	std::cerr << "CONFIGURATION FAILED!" << std::endl;
+	return ret;
+    }
+    config = std::move(newConfig);
+    return 0;
+}
 
+int Libcam2OpenCV::allocateBuffers() {
     /*
      * --------------------------------------------------------------------
      * Buffer Allocation
@@ -238,21 +946,26 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
 	int ret = allocator->allocate(cfg.stream());
 	if (ret < 0) {
 	    std::cerr << "Can't allocate buffers" << std::endl;
-	    return;
+	    return ret;
 	}
 	    
 	for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : allocator->buffers(cfg.stream()))
 	    {
 		// "Single plane" buffers appear as multi-plane here, but we can spot them because then
-		// planes all share the same fd. We accumulate them so as to mmap the buffer only once.
+		// planes all share the same fd. The planes may be padded apart, so the mapping of
+		// an fd has to reach the end of the plane furthest into it, and is made only once.
 		size_t buffer_size = 0;
 		for (unsigned i = 0; i < buffer->planes().size(); i++)
 		    {
 			const libcamera::FrameBuffer::Plane &plane = buffer->planes()[i];
-			buffer_size += plane.length;
+			buffer_size = std::max(buffer_size, (size_t)plane.offset + plane.length);
 			if (i == buffer->planes().size() - 1 || plane.fd.get() != buffer->planes()[i + 1].fd.get())
 			    {
 				void *memory = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
+				if (memory == MAP_FAILED) {
+				    std::cerr << "Can't map buffer" << std::endl;
+				    return -errno;
+				}
 				mapped_buffers[buffer.get()].push_back(
 								       libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), buffer_size));
 				buffer_size = 0;
@@ -279,14 +992,14 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
      * that applications can access and for each of them a list of metadata
      * properties that reports the capture parameters applied to the image.
      */
-    stream = streamConfig.stream();
+    stream = config->at(0).stream();
     const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers = allocator->buffers(stream);
     for (unsigned int i = 0; i < buffers.size(); ++i) {
 	std::unique_ptr<libcamera::Request> request = camera->createRequest();
 	if (!request)
 	    {
 		std::cerr << "Can't create request" << std::endl;
-		return;
+		return -ENOMEM;
 	    }
 
 	const std::unique_ptr<libcamera::FrameBuffer> &buffer = buffers[i];
@@ -295,39 +1008,57 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
 	    {
 		std::cerr << "Can't set buffer for request"
 			  << std::endl;
-		return;
+		return ret;
 	    }
 
 	requests.push_back(std::move(request));
     }
+    return 0;
+}
 
-    /*
-     * --------------------------------------------------------------------
-     * Signal&Slots
-     *
-     * libcamera uses a Signal&Slot based system to connect events to
-     * callback operations meant to handle them, inspired by the QT graphic
-     * toolkit.
-     *
-     * Signals are events 'emitted' by a class instance.
-     * Slots are callbacks that can be 'connected' to a Signal.
-     *
-     * A Camera exposes Signals, to report the completion of a Request and
-     * the completion of a Buffer part of a Request to support partial
-     * Request completions.
-     *
-     * In order to receive the notification for request completions,
-     * applications shall connecte a Slot to the Camera 'requestCompleted'
-     * Signal before the camera is started.
-     */
-    camera->requestCompleted.connect(this,&Libcam2OpenCV::requestComplete);
+void Libcam2OpenCV::releaseBuffers() {
+    {
+	std::lock_guard<std::mutex> lock(requestsMutex);
+	requestStates.clear();
+    }
+    requests.clear();
+    for (auto &item : mapped_buffers)
+	for (auto &span : item.second)
+	    munmap(span.data(), span.size());
+    mapped_buffers.clear();
+    if (nullptr != allocator) {
+	if (nullptr != stream) allocator->free(stream);
+	delete allocator;
+    }
+    allocator = nullptr;
+    stream = nullptr;
+}
 
+int Libcam2OpenCV::startCapture(const Libcam2OpenCVSettings &settings) {
+    controls = libcamera::ControlList();
+    configuredIntervalUs = 0;
     if (settings.framerate > 0) {
 	int64_t frame_time = 1000000 / settings.framerate; // in us
 	controls.set(libcamera::controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+	configuredIntervalUs = frame_time;
     }
+    observedIntervalUs = 0;
+    // the first frame after a start takes longer
+    lastFrameNs = nowNs() + startupGraceNs;
     controls.set(libcamera::controls::Brightness,settings.brightness);
     controls.set(libcamera::controls::Contrast,settings.contrast);
+    if (!settings.scalerCrop.isNull()) {
+	std::lock_guard<std::mutex> lock(controlsMutex);
+	if (supportedControls.count(libcamera::controls::ScalerCrop.id()))
+	    controls.set(libcamera::controls::ScalerCrop, settings.scalerCrop);
+	else
+	    std::cerr << "The camera can't crop, capturing the whole field of view" << std::endl;
+    }
+    {
+	// these are superseded by the new settings
+	std::lock_guard<std::mutex> lock(controlsMutex);
+	pendingControls.clear();
+    }
 
     /*
      * --------------------------------------------------------------------
@@ -340,23 +1071,196 @@ void Libcam2OpenCV::start(Libcam2OpenCVSettings settings) {
      * For each delivered frame, the Slot connected to the
      * Camera::requestCompleted Signal is called.
      */
-    camera->start(&controls);
-    for (std::unique_ptr<libcamera::Request> &request : requests)
-	camera->queueRequest(request.get());
+    int ret = camera->start(&controls);
+    if (ret) {
+	std::cerr << "Can't start the camera" << std::endl;
+	return ret;
+    }
+    cameraStarted = true;
+    running = true;
+    for (std::unique_ptr<libcamera::Request> &request : requests) {
+	// requests which have been used before need to be reset
+	if (request->status() != libcamera::Request::RequestPending)
+	    request->reuse(libcamera::Request::ReuseBuffers);
+	ret = queueRequest(request.get());
+	if (ret < 0) {
+	    std::cerr << "Can't queue request" << std::endl;
+	    running = false;
+	    camera->stop();
+	    cameraStarted = false;
+	    return ret;
+	}
+    }
+    return 0;
 }
 
 void Libcam2OpenCV::stop() {
+    stopWatchdog();
+    std::lock_guard<std::mutex> lock(stateMutex);
     /*
      * --------------------------------------------------------------------
      * Clean Up
      *
-     * Stop the Camera, release resources and stop the CameraManager.
+     * Stop the Camera, release resources and let go of the CameraManager,
+     * which stops once the last instance has released it.
      * libcamera has now released all resources it owned.
+     *
+     * Camera::stop() only returns once all queued requests have been
+     * completed or cancelled, so once it returns requestComplete won't
+     * be called again.
      */
-    camera->stop();
-    allocator->free(stream);
-    camera->release();
-    camera.reset();
-    cm->stop();
-    delete allocator;
+    if (camera) {
+	running = false;
+	if (cameraStarted) {
+	    camera->stop();
+	    cameraStarted = false;
+	}
+	if (nullptr != pool) pool->removeSource(this);
+	closeCamera();
+    }
+    // the watchdog might have lost the camera while reopening it
+    cm.reset();
+}
+
+Libcam2OpenCVWatchdogStats Libcam2OpenCV::watchdogStats() {
+    std::lock_guard<std::mutex> lock(watchdogMutex);
+    return stats;
+}
+
+void Libcam2OpenCV::startWatchdog() {
+    watching = true;
+    if ((0 == activeSettings.watchdogFrames) || watchdogThread.joinable()) return;
+    {
+	std::lock_guard<std::mutex> lock(watchdogMutex);
+	watchdogQuit = false;
+    }
+    watchdogThread = std::thread(&Libcam2OpenCV::watchdog, this);
+}
+
+void Libcam2OpenCV::stopWatchdog() {
+    watching = false;
+    {
+	std::lock_guard<std::mutex> lock(watchdogMutex);
+	watchdogQuit = true;
+    }
+    watchdogCond.notify_all();
+    if (watchdogThread.joinable()) watchdogThread.join();
+}
+
+int64_t Libcam2OpenCV::stallTimeoutNs() const {
+    const int64_t interval = std::max(configuredIntervalUs.load(), observedIntervalUs.load());
+    return std::max(minStallNs, interval * 1000 * activeSettings.watchdogFrames);
+}
+
+/*
+ * The watchdog compares the time since the last completed request with
+ * a multiple of the frame interval. On a stall it raises the fault at
+ * once and then escalates, giving each step time to bring the frames
+ * back: re-queue the orphaned requests, restart the capture, and
+ * finally release the camera and look it up again by its ID.
+ */
+void Libcam2OpenCV::watchdog() {
+    int level = 0;
+    int64_t lastAction = 0;
+    std::unique_lock<std::mutex> lock(watchdogMutex);
+    for (;;) {
+	watchdogCond.wait_for(lock, watchdogPoll, [this]{ return watchdogQuit; });
+	if (watchdogQuit) return;
+	lock.unlock();
+	{
+	    // start(), stop() and reconfigure() take precedence
+	    std::unique_lock<std::mutex> state(stateMutex, std::try_to_lock);
+	    if (state.owns_lock() && watching && (activeSettings.watchdogFrames > 0)) {
+		const int64_t now = nowNs();
+		const int64_t timeout = stallTimeoutNs();
+		if (!faulted) {
+		    level = 0;
+		    const int64_t last = lastFrameNs;
+		    if (now - last >= timeout) {
+			faultSinceNs = last;
+			faulted = true;
+			{
+			    std::lock_guard<std::mutex> guard(watchdogMutex);
+			    stats.stalls++;
+			}
+			std::cerr << "Capture stalled, no frame for " << (now - last) / 1e6 << " ms" << std::endl;
+			if (nullptr != callback) callback->captureStalled((now - last) / 1e9);
+		    }
+		}
+		const int64_t grace = (level < 2) ? timeout : std::max(timeout, startupGraceNs);
+		if (faulted && ((0 == level) || (now - lastAction >= grace))) {
+		    level = std::min(level + 1, 3);
+		    if ((1 == level) && (0 == requeueOrphans())) level = 2;
+		    if ((2 == level) && (restartCapture() < 0)) level = 3;
+		    if (3 == level) reopenCamera();
+		    lastAction = nowNs();
+		}
+	    }
+	}
+	lock.lock();
+    }
+}
+
+unsigned int Libcam2OpenCV::requeueOrphans() {
+    if (!running || !camera) return 0;
+    std::vector<libcamera::Request *> orphans;
+    {
+	std::lock_guard<std::mutex> lock(requestsMutex);
+	for (const std::unique_ptr<libcamera::Request> &request : requests) {
+	    auto it = requestStates.find(request.get());
+	    if ((it == requestStates.end()) || (RequestIdle == it->second))
+		orphans.push_back(request.get());
+	}
+    }
+    unsigned int n = 0;
+    for (libcamera::Request *request : orphans) {
+	request->reuse(libcamera::Request::ReuseBuffers);
+	if (queueRequest(request) == 0) n++;
+    }
+    if (n > 0) {
+	std::lock_guard<std::mutex> lock(watchdogMutex);
+	stats.requeues += n;
+	std::cerr << "Watchdog: re-queued " << n << " orphaned requests" << std::endl;
+    }
+    return n;
+}
+
+int Libcam2OpenCV::restartCapture() {
+    if (!camera || !config || requests.empty()) return -ENODEV;
+    std::cerr << "Watchdog: restarting the capture" << std::endl;
+    {
+	std::lock_guard<std::mutex> lock(watchdogMutex);
+	stats.restarts++;
+    }
+    running = false;
+    if (cameraStarted) {
+	camera->stop();
+	cameraStarted = false;
+    }
+    // keep the framerate which was set at runtime
+    Libcam2OpenCVSettings settings = activeSettings;
+    if (configuredIntervalUs > 0) settings.framerate = 1000000 / configuredIntervalUs;
+    return startCapture(settings);
+}
+
+int Libcam2OpenCV::reopenCamera() {
+    std::cerr << "Watchdog: reopening camera " << activeCameraId << std::endl;
+    {
+	std::lock_guard<std::mutex> lock(watchdogMutex);
+	stats.reopens++;
+    }
+    Libcam2OpenCVSettings settings = activeSettings;
+    if (configuredIntervalUs > 0) settings.framerate = 1000000 / configuredIntervalUs;
+    /*
+     * The camera manager is shared and keeps its list of cameras up to
+     * date when they disappear and come back, so the camera is released
+     * and looked up again by its ID.
+     */
+    closeCamera();
+    int ret = openCamera(activeCameraId);
+    if (!ret) ret = configureStream(settings);
+    if (!ret) ret = allocateBuffers();
+    if (!ret) ret = startCapture(settings);
+    if (ret) std::cerr << "Watchdog: can't reopen the camera: " << strerror(-ret) << std::endl;
+    return ret;
 }
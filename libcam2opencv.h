@@ -14,6 +14,15 @@
 #include <chrono>
 #include <thread>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
 #include <sys/mman.h>
 #include <opencv2/opencv.hpp>
 
@@ -25,6 +34,9 @@
 
 #include <libcamera/libcamera.h>
 
+class FrameRecorder;
+class FramePublisher;
+
 /**
  * Settings
  **/
@@ -53,12 +65,285 @@ struct Libcam2OpenCVSettings {
      * Contrast
      **/
     float contrast = 1.0;
+
+    /**
+     * ID of the camera to open. If empty the camera is selected by cameraIndex.
+     **/
+    std::string cameraId;
+
+    /**
+     * Index of the camera to open in the list of the camera manager.
+     **/
+    unsigned int cameraIndex = 0;
+
+    /**
+     * Pixel formats in order of preference. The first one which the camera
+     * supports natively and which has converters is used.
+     **/
+    std::vector<libcamera::PixelFormat> pixelFormats = {
+	libcamera::formats::NV12,
+	libcamera::formats::YUV420,
+	libcamera::formats::XRGB8888,
+	libcamera::formats::BGR888
+    };
+
+    /**
+     * Number of frame intervals without a completed request after which
+     * the watchdog reports a stall and starts the recovery. Zero disables
+     * the watchdog.
+     **/
+    unsigned int watchdogFrames = 5;
+
+    /**
+     * Part of the sensor to capture, in the coordinates of the
+     * ScalerCropMaximum property. An empty rectangle captures the whole
+     * field of view. With a small size and a high framerate the camera
+     * picks a fast binned sensor mode and crops it digitally.
+     **/
+    libcamera::Rectangle scalerCrop;
+
+    /**
+     * Output size of the sensor mode, one of sensorModes(), for example a
+     * binned mode for a high framerate. It is requested through the
+     * sensor configuration; pipeline handlers which don't support that
+     * choose the mode themselves. An empty size leaves the choice to them.
+     **/
+    libcamera::Size sensorMode;
+
+    /**
+     * Bit depth of the sensor mode.
+     **/
+    unsigned int sensorBitDepth = 10;
+};
+
+/**
+ * Counters of the capture watchdog.
+ **/
+struct Libcam2OpenCVWatchdogStats {
+    unsigned long stalls = 0;          // stalls detected
+    unsigned long requeues = 0;        // orphaned requests queued again
+    unsigned long restarts = 0;        // fast restarts of the capture
+    unsigned long reopens = 0;         // camera released and looked up again
+    double lastBlindSeconds = 0;       // last frame before to first frame after the last stall
+    double maxBlindSeconds = 0;        // longest time without frames
+};
+
+/**
+ * A frame in the native pixel format of the camera.
+ * The planes point either into the camera buffer, in which case they are
+ * only valid during the callback, or into memory owned by the frame.
+ * grey() and bgr() convert on first use with the converters registered
+ * in Libcam2OpenCVConverters and return the cached result afterwards.
+ **/
+class Libcam2OpenCVFrame {
+public:
+    Libcam2OpenCVFrame(const libcamera::PixelFormat &format,
+		       const libcamera::Size &size,
+		       unsigned int stride,
+		       const std::vector<libcamera::Span<const uint8_t>> &planes);
+
+    /**
+     * Wraps a BGR image.
+     **/
+    static Libcam2OpenCVFrame fromBgr(const cv::Mat &bgr);
+
+    /**
+     * Returns a frame with its own copy of the planes.
+     **/
+    Libcam2OpenCVFrame copy() const;
+
+    /**
+     * 8 bit grey image, for the detection.
+     **/
+    const cv::Mat &grey() const;
+
+    /**
+     * BGR image, for recording and display.
+     **/
+    const cv::Mat &bgr() const;
+
+    /**
+     * BGR image which stays valid after the callback and this frame are gone.
+     * It is copied if it points into the planes, whether they are the
+     * camera buffer or the storage of a copy().
+     **/
+    cv::Mat detachedBgr() const;
+
+    /**
+     * True if the planes are large enough for the size, stride and pixel
+     * format, so that the converters stay within them. Frames from a file
+     * or another process have to pass this before they are converted.
+     * Formats without a built-in converter are only checked for planes.
+     **/
+    bool fits() const;
+
+    /**
+     * True if the planes point into the camera buffer.
+     **/
+    bool isMapped() const {
+	return !storage && source.empty();
+    }
+
+    const libcamera::PixelFormat &pixelFormat() const { return format; }
+    unsigned int width() const { return size.width; }
+    unsigned int height() const { return size.height; }
+    unsigned int stride() const { return lineStride; }
+    const std::vector<libcamera::Span<const uint8_t>> &planes() const { return planeData; }
+
+private:
+    libcamera::PixelFormat format;
+    libcamera::Size size;
+    unsigned int lineStride;
+    std::vector<libcamera::Span<const uint8_t>> planeData;
+    std::shared_ptr<std::vector<uint8_t>> storage;
+    cv::Mat source;
+    mutable cv::Mat greyImage;
+    mutable cv::Mat bgrImage;
+};
+
+/**
+ * Registry of converters from the native pixel formats to the
+ * representations the consumers need. The built-in ones use the native
+ * planes directly where possible, for example the Y plane of NV12 and
+ * YUV420 is the grey image without any conversion.
+ **/
+class Libcam2OpenCVConverters {
+public:
+    enum Target { Grey, BGR };
+
+    typedef std::function<void(const Libcam2OpenCVFrame &frame, cv::Mat &out)> Converter;
+
+    /**
+     * Adds or replaces a converter.
+     **/
+    static void add(const libcamera::PixelFormat &format, Target target, Converter converter);
+
+    /**
+     * Converts a frame. Returns false if there's no converter, if the
+     * planes are too small for the geometry of the frame or if the
+     * converter leaves out empty.
+     **/
+    static bool convert(const Libcam2OpenCVFrame &frame, Target target, cv::Mat &out);
+
+    /**
+     * True if there are converters to grey and to BGR for the format.
+     **/
+    static bool supports(const libcamera::PixelFormat &format);
+
+private:
+    static std::mutex mutex;
+    static std::map<std::pair<uint32_t, int>, Converter> &registry();
+};
+
+/**
+ * Shared camera manager.
+ * libcamera allows only one CameraManager per process. All instances of
+ * Libcam2OpenCV get it from here. It is started with the first user and
+ * stopped when the last user releases it.
+ **/
+class Libcam2OpenCVManager {
+public:
+    /**
+     * Returns the running camera manager or nullptr if it can't be started.
+     **/
+    static std::shared_ptr<libcamera::CameraManager> get();
+
+    /**
+     * Returns the IDs of all cameras in the system.
+     **/
+    static std::vector<std::string> cameraIds();
+
+private:
+    static std::mutex mutex;
+    static std::weak_ptr<libcamera::CameraManager> instance;
+};
+
+/**
+ * Worker pool shared by several cameras.
+ * Each camera (source) has its own short queue. When the queue is full the
+ * oldest frame is dropped so that a slow consumer never stalls the camera.
+ * The workers serve the sources round robin and run at most one job per
+ * source at a time, so every camera gets a fair share and its callback is
+ * never entered concurrently.
+ **/
+class Libcam2OpenCVWorkerPool {
+public:
+    /**
+     * Starts the workers.
+     * nThreads is the number of worker threads, zero means one per core.
+     * queueDepth is the maximum number of pending frames per source.
+     **/
+    Libcam2OpenCVWorkerPool(unsigned int nThreads = 0, unsigned int queueDepth = 2);
+
+    /**
+     * Stops the workers. Pending jobs are discarded.
+     **/
+    ~Libcam2OpenCVWorkerPool();
+
+    /**
+     * Adds a job for the given source.
+     **/
+    void submit(const void *source, std::function<void()> job);
+
+    /**
+     * Discards the pending jobs of a source and waits till its running job has finished.
+     **/
+    void removeSource(const void *source);
+
+    /**
+     * Number of jobs of a source which have been dropped because its queue was full.
+     **/
+    unsigned long dropped(const void *source);
+
+private:
+    struct Source {
+	const void *id;
+	std::deque<std::function<void()>> jobs;
+	bool busy = false;
+	unsigned long dropped = 0;
+    };
+    std::vector<Source> sources;
+    size_t next = 0;
+    unsigned int queueDepth;
+    bool quit = false;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::thread> workers;
+
+    Source *findSource(const void *source);
+    void worker();
 };
 
 class Libcam2OpenCV {
 public:
+    ~Libcam2OpenCV();
+
     struct Callback {
+	/**
+	 * Receives the frame as BGR image. Only valid during the call.
+	 **/
 	virtual void hasFrame(const cv::Mat &frame, const libcamera::ControlList &metadata) = 0;
+
+	/**
+	 * Receives the frame in the native format of the camera. Override this
+	 * to take the grey image or the planes without the BGR conversion.
+	 **/
+	virtual void hasFrameView(const Libcam2OpenCVFrame &frame, const libcamera::ControlList &metadata) {
+	    hasFrame(frame.bgr(), metadata);
+	}
+
+	/**
+	 * Called by the watchdog as soon as no frame has arrived for longer
+	 * than expected. There are no frames until captureRecovered().
+	 * Must not call stop() or reconfigure().
+	 **/
+	virtual void captureStalled(double secondsSinceLastFrame) {}
+
+	/**
+	 * Called before the first frame after a stall with the time between
+	 * the last frame before and the first frame after it.
+	 **/
+	virtual void captureRecovered(double blindSeconds) {}
 	virtual ~Callback() {}
     };
 
@@ -70,26 +355,176 @@ public:
     }
 
     /**
-     * Starts the camera and the callback at default resolution and framerate
+     * Runs the callback on a worker pool instead of the libcamera thread.
+     * The frame is then copied into its own buffer so that the request
+     * can be re-queued straight away. A nullptr runs the callback inline.
+     **/
+    void setWorkerPool(Libcam2OpenCVWorkerPool* workerPool) {
+	pool = workerPool;
+    }
+
+    /**
+     * Starts the camera and the callback at default resolution and framerate.
+     * Returns 0 or a negative errno.
      **/
-    void start(Libcam2OpenCVSettings settings = Libcam2OpenCVSettings() );
+    int start(Libcam2OpenCVSettings settings = Libcam2OpenCVSettings() );
 
     /**
-     * Stops the camera and the callback
+     * Applies new settings to the running camera. The camera manager and
+     * the acquired camera are kept. The camera is stopped, which drains all
+     * requests in flight, and restarted with the new configuration. The
+     * buffers and their mappings are kept if the geometry hasn't changed.
+     * The camera selection in the settings is ignored.
+     * Returns 0 or a negative errno.
+     **/
+    int reconfigure(Libcam2OpenCVSettings settings);
+
+    /**
+     * Stops the camera and the callback. Can be called more than once.
      **/
     void stop();
+
+    /**
+     * The pixel format negotiated with the camera.
+     **/
+    libcamera::PixelFormat pixelFormat() const {
+	return config ? config->at(0).pixelFormat : libcamera::PixelFormat();
+    }
+
+    /**
+     * The frame size negotiated with the camera.
+     **/
+    libcamera::Size size() const {
+	return config ? config->at(0).size : libcamera::Size();
+    }
+
+    /**
+     * Changes the framerate while the camera is running. The new frame
+     * duration limits travel with the next request which is re-queued,
+     * so the camera doesn't need to be restarted.
+     **/
+    void setFramerate(unsigned int framerate);
+
+    /**
+     * Sets any controls while the camera is running, for example
+     * AeMeteringMode, ExposureValue or AfWindows. Like setFramerate()
+     * they travel with the next request which is re-queued. Controls
+     * the camera doesn't support are dropped, so that every request
+     * stays valid. Returns the number of controls queued or -ENODEV.
+     **/
+    int setControls(const libcamera::ControlList &newControls);
+
+    /**
+     * True if the open camera supports the control.
+     **/
+    bool supportsControl(const libcamera::ControlId &id);
+
+    /**
+     * Output sizes of the sensor modes of the open camera, the smallest
+     * first. Empty if the camera has no raw stream or isn't open.
+     **/
+    std::vector<libcamera::Size> sensorModes();
+
+    /**
+     * Appends every captured frame with its raw planes, stride, pixel
+     * format and metadata to a recording which can be replayed with
+     * FrameReplay. Returns 0 or a negative errno.
+     **/
+    int startRecording(const std::string &path);
+
+    /**
+     * Closes the recording.
+     **/
+    void stopRecording();
+
+    /**
+     * Publishes every captured frame to other processes on this machine.
+     * They connect with FrameSubscriber to the Unix socket at socketPath
+     * and read the frames from a shared ring of the given number of slots.
+     * A slow subscriber never holds up the camera. Returns 0 or a
+     * negative errno.
+     **/
+    int startPublishing(const std::string &socketPath, unsigned int slots = 4);
+
+    /**
+     * Stops publishing, the subscribers see the ring retired.
+     **/
+    void stopPublishing();
+
+    /**
+     * Returns a copy of the watchdog counters.
+     **/
+    Libcam2OpenCVWatchdogStats watchdogStats();
     
 private:
     std::shared_ptr<libcamera::Camera> camera;
     std::map<libcamera::FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers;
     std::unique_ptr<libcamera::CameraConfiguration> config;
-    cv::Mat frame;
     Callback* callback = nullptr;
+    Libcam2OpenCVWorkerPool* pool = nullptr;
     libcamera::FrameBufferAllocator* allocator = nullptr;
     libcamera::Stream *stream = nullptr;
-    std::unique_ptr<libcamera::CameraManager> cm;
+    std::shared_ptr<libcamera::CameraManager> cm;
     std::vector<std::unique_ptr<libcamera::Request>> requests;
     libcamera::ControlList controls;
+    std::mutex controlsMutex;
+    libcamera::ControlList pendingControls;
+    std::set<unsigned int> supportedControls;  // of the open camera, guarded by controlsMutex
+    std::vector<libcamera::Size> rawSizes;     // sensor modes of the open camera, guarded by controlsMutex
+    std::mutex recorderMutex;
+    std::unique_ptr<FrameRecorder> recorder;
+    std::mutex publisherMutex;
+    std::unique_ptr<FramePublisher> publisher;
+    std::atomic<bool> running{false};
+    bool cameraStarted = false;
+
+    /*
+     * start(), stop(), reconfigure() and the watchdog recovery each hold
+     * stateMutex while they change the camera.
+     */
+    std::mutex stateMutex;
+    Libcam2OpenCVSettings activeSettings;
+    std::string activeCameraId;
+
+    /*
+     * Where each request is: queued to the camera, in requestComplete or
+     * idle. Idle requests while capturing are orphans.
+     */
+    enum RequestState { RequestIdle, RequestQueued, RequestCompleting };
+    std::mutex requestsMutex;
+    std::map<const libcamera::Request *, RequestState> requestStates;
+
+    /*
+     * Capture watchdog
+     */
+    std::thread watchdogThread;
+    std::mutex watchdogMutex;
+    std::condition_variable watchdogCond;
+    bool watchdogQuit = false;
+    Libcam2OpenCVWatchdogStats stats;
+    std::atomic<bool> watching{false};
+    std::atomic<bool> faulted{false};
+    std::atomic<int64_t> lastFrameNs{0};
+    std::atomic<int64_t> faultSinceNs{0};
+    std::atomic<int64_t> configuredIntervalUs{0};
+    std::atomic<int64_t> observedIntervalUs{0};
+
+    int openCamera(const std::string &cameraId);
+    void closeCamera();
+    int configureStream(const Libcam2OpenCVSettings &settings);
+    int allocateBuffers();
+    void releaseBuffers();
+    int startCapture(const Libcam2OpenCVSettings &settings);
+    void setRequestState(const libcamera::Request *request, RequestState state);
+    int queueRequest(libcamera::Request *request);
+
+    void startWatchdog();
+    void stopWatchdog();
+    void watchdog();
+    int64_t stallTimeoutNs() const;
+    unsigned int requeueOrphans();
+    int restartCapture();
+    int reopenCamera();
 
     std::vector<libcamera::Span<uint8_t>> Mmap(libcamera::FrameBuffer *buffer) const
     {
@@ -99,6 +534,11 @@ private:
 	return item->second;
     }
 
+    /*
+     * The planes of a buffer in the mappings.
+     */
+    std::vector<libcamera::Span<const uint8_t>> mappedPlanes(libcamera::FrameBuffer *buffer) const;
+
     /*
      * --------------------------------------------------------------------
      * Handle RequestComplete